@@ -7,11 +7,17 @@ align 4
     dd -(0x1BADB002 + 0x00000003) ; Checksum
 
 section .text
+global start
+extern kernel_main
 start:
     cli                     ; Disable interrupts
     mov esp, 0x90000        ; Set up stack
-    mov eax, 0x100000       ; Kernel load address
-    jmp eax                 ; Jump to kernel entry point
+    push ebx                ; Multiboot info structure
+    push eax                ; Multiboot magic
+    call kernel_main
+.hang:
+    hlt
+    jmp .hang
 
 section .note.GNU-stack noalloc noexec nowrite progbits
 
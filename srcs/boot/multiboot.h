@@ -0,0 +1,36 @@
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include "../utils/stdint.h"
+
+/* https://www.gnu.org/software/grub/manual/multiboot/multiboot.html */
+#define MULTIBOOT_BOOTLOADER_MAGIC  0x2BADB002
+
+#define MULTIBOOT_INFO_MEMORY       0x00000001 /* mem_lower/mem_upper are valid */
+#define MULTIBOOT_INFO_MEM_MAP      0x00000040 /* mmap_length/mmap_addr are valid */
+
+#define MULTIBOOT_MEMORY_AVAILABLE  1
+
+typedef struct __attribute__((packed)) multiboot_info
+{
+    uint32_t flags;
+    uint32_t mem_lower;     /* KB of memory below 1 MB */
+    uint32_t mem_upper;     /* KB of memory above 1 MB */
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;
+    uint32_t mmap_addr;
+} multiboot_info_t;
+
+typedef struct __attribute__((packed)) multiboot_mmap_entry
+{
+    uint32_t size;          /* Size of the entry, not counting this field */
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+} multiboot_mmap_entry_t;
+
+#endif
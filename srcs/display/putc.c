@@ -1,6 +1,9 @@
 #include "display.h"
+#include "../utils/spinlock.h"
 
 static int cursor_position = 0;
+/* Every CPU prints: keeps the cursor and the scrolling consistent */
+static spinlock_t console_lock = SPINLOCK_INIT;
 static int color = LIGHT_GREY;
 static bool ofuscated = false;
 static bool can_print = true;
@@ -159,6 +162,7 @@ void move_cursor_down()
 void putc_color(char c, uint8_t color)
 {
     char* video_memory;
+    uint32_t flags;
 
     if (!can_print)
     {
@@ -166,6 +170,7 @@ void putc_color(char c, uint8_t color)
     }
 
     video_memory = (char *)VIDEO_MEMORY;
+    flags = spin_lock_irqsave(&console_lock);
 
     if (ofuscated)
     {
@@ -196,6 +201,7 @@ void putc_color(char c, uint8_t color)
         cursor_position -= SCREEN_WIDTH;
         update_cursor(cursor_position);
     }
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 void putc(char c)
@@ -1,7 +1,9 @@
 #include "gdt.h"
 #include "../display/display.h"
+#include "../smp/smp.h"
 
-gdt_entry_t gdt[GDT_ENTRIES];
+/* Each CPU has its own GDT: its TSS and per-CPU segment differ */
+gdt_entry_t gdt[MAX_CPUS][GDT_ENTRIES];
 gdt_ptr_t* gdt_ptr = (gdt_ptr_t*)GDT_ADDRESS;
 
 typedef struct __attribute__((packed)) tss_entry
@@ -35,75 +37,109 @@ typedef struct __attribute__((packed)) tss_entry
     uint16_t iomap;
 } tss_entry_t;
 
-static tss_entry_t tss;
+static tss_entry_t tss[MAX_CPUS];
+/* Static, so the BSP can set up its GDT before there is any allocator */
+static uint8_t tss_stacks[MAX_CPUS][KB(4)] __attribute__((aligned(16)));
 
 extern void load_tss();
-#include "../memory/memory.h"
 
-void tss_init()
+void tss_init(uint32_t id)
 {
-    memset(&tss, 0, sizeof(tss_entry_t));
-    uint32_t *stack = kmalloc(KB(4));
-    stack += KB(4) / sizeof(uint32_t);
-    tss.esp0 = (uint32_t)stack & 0xFFFFFFF0;
-    tss.ss0 = 0x10;
-    tss.iomap = sizeof(tss_entry_t);
+    memset(&tss[id], 0, sizeof(tss_entry_t));
+    tss[id].esp0 = (uint32_t)(tss_stacks[id] + sizeof(tss_stacks[id]));
+    tss[id].ss0 = 0x10;
+    tss[id].iomap = sizeof(tss_entry_t);
     load_tss();
 }
 
+/* Stack of the task this CPU is switching to. */
 void tss_set_stack(uint32_t stack)
 {
-    tss.esp0 = stack;
+    tss[smp_processor_id()].esp0 = stack;
 }
 
 /* Assembly function to load the GDT */
 extern void gdt_flush();
 
-void register_gdt(void)
+/* The pointer is only read by lgdt, so the CPUs can take turns with it. */
+void register_gdt(uint32_t id)
 {
-    gdt_ptr->base = (uint32_t) &gdt;
+    gdt_ptr->base = (uint32_t) &gdt[id];
     gdt_ptr->limit = (GDT_ENTRIES * sizeof(gdt_entry_t)) - 1;
     __asm__ __volatile__("lgdtl (%0)" : : "r" (gdt_ptr));
     gdt_flush();
+    __asm__ __volatile__("mov %0, %%gs" : : "r" ((uint16_t)GDT_CPU_SELECTOR));
 }
 
-void gdt_set_entry(int index, uint32_t base, uint32_t limit, uint8_t access, uint8_t granularity)
+void gdt_set_entry(uint32_t id, int index, uint32_t base, uint32_t limit, uint8_t access, uint8_t granularity)
 {
-    gdt[index].base_low = (base & 0xFFFF);
-    gdt[index].base_middle = (base >> 16) & 0xFF;
-    gdt[index].base_high = (base >> 24) & 0xFF;
-    gdt[index].limit_low = (limit & 0xFFFF);
-    gdt[index].granularity = (limit >> 16) & 0x0F;
-    gdt[index].granularity |= (granularity & 0xF0);
-    gdt[index].access = access;
+    gdt[id][index].base_low = (base & 0xFFFF);
+    gdt[id][index].base_middle = (base >> 16) & 0xFF;
+    gdt[id][index].base_high = (base >> 24) & 0xFF;
+    gdt[id][index].limit_low = (limit & 0xFFFF);
+    gdt[id][index].granularity = (limit >> 16) & 0x0F;
+    gdt[id][index].granularity |= (granularity & 0xF0);
+    gdt[id][index].access = access;
 }
 
-void gdt_init()
+/*
+ * Bases this CPU's TLS segment at 'base', for the task it is switching
+ * to. %fs caches the old base: it is reloaded for the new one to count.
+ */
+void gdt_set_tls(uint32_t base)
+{
+    uint32_t id = smp_processor_id();
+
+    gdt_set_entry(id, GDT_TLS_ENTRY, base, 0xFFFFFFFF, 0xF2, 0xCF);
+    __asm__ __volatile__("mov %0, %%fs" : : "r" ((uint16_t)GDT_TLS_SELECTOR));
+}
+
+/**
+ * gdt_init_cpu:
+ *   Loads the GDT and TSS of CPU 'id', whose segment 8 covers cpus[id]
+ *   and ends up in %gs. Run by every CPU on itself, first thing.
+ */
+void gdt_init_cpu(uint32_t id)
 {
+    cpus[id].self = &cpus[id];
+    cpus[id].id = id;
+
     /* NULL */
-    gdt_set_entry(0, 0, 0, 0, 0);
+    gdt_set_entry(id, 0, 0, 0, 0, 0);
 
     /* Kernel Code segment */
-    gdt_set_entry(1, 0, 0xFFFFFFFF, 0x9A, 0xCF);
+    gdt_set_entry(id, 1, 0, 0xFFFFFFFF, 0x9A, 0xCF);
 
     /* Kernel Data segment */
-    gdt_set_entry(2, 0, 0xFFFFFFFF, 0x92, 0xCF);
+    gdt_set_entry(id, 2, 0, 0xFFFFFFFF, 0x92, 0xCF);
 
     /* Kernel Stack */
-    gdt_set_entry(3, 0, 0xFFFFFFFF, 0x96, 0xCF);
+    gdt_set_entry(id, 3, 0, 0xFFFFFFFF, 0x96, 0xCF);
 
     /* User mode code segment */
-    gdt_set_entry(4, 0, 0xFFFFFFFF, 0xFA, 0xCF);
+    gdt_set_entry(id, 4, 0, 0xFFFFFFFF, 0xFA, 0xCF);
 
     /* User mode data segment */
-    gdt_set_entry(5, 0, 0xFFFFFFFF, 0xF2, 0xCF);
+    gdt_set_entry(id, 5, 0, 0xFFFFFFFF, 0xF2, 0xCF);
 
     /* User mode stack */
-    gdt_set_entry(6, 0, 0xFFFFFFFF, 0xF6, 0xCF);
+    gdt_set_entry(id, 6, 0, 0xFFFFFFFF, 0xF6, 0xCF);
 
     /* task state segment */
-    gdt_set_entry(7, (uint32_t)&tss, sizeof(tss) - 1, 0x89, 0x40);
+    gdt_set_entry(id, GDT_TSS_ENTRY, (uint32_t)&tss[id], sizeof(tss_entry_t) - 1, 0x89, 0x40);
 
-    register_gdt();
-    tss_init();
+    /* Per-CPU data, byte granular */
+    gdt_set_entry(id, GDT_CPU_ENTRY, (uint32_t)&cpus[id], sizeof(cpu_t) - 1, 0x92, 0x40);
+
+    /* Thread-local storage, based per task by gdt_set_tls() */
+    gdt_set_entry(id, GDT_TLS_ENTRY, 0, 0xFFFFFFFF, 0xF2, 0xCF);
+
+    register_gdt(id);
+    tss_init(id);
+}
+
+/* The boot CPU's. */
+void gdt_init()
+{
+    gdt_init_cpu(0);
 }
@@ -5,9 +5,15 @@
 
 /* info from: https://wiki.osdev.org/GDT_Tutorial */
 /* To consider: https://samypesse.gitbook.io/how-to-create-an-operating-system/chapter-6 */
-#define GDT_ENTRIES 8
+#define GDT_ENTRIES 10
 #define GDT_ADDRESS 0x00000800
 
+#define GDT_TSS_ENTRY   7
+#define GDT_CPU_ENTRY   8       /* Per-CPU data, see this_cpu() */
+#define GDT_CPU_SELECTOR (GDT_CPU_ENTRY * 8)
+#define GDT_TLS_ENTRY   9       /* Thread-local storage of the running task, in %fs */
+#define GDT_TLS_SELECTOR ((GDT_TLS_ENTRY * 8) | 3)
+
 #define SEG_DESCTYPE(x)  ((x) << 0x04) // Descriptor type (0 for system, 1 for code/data)
 #define SEG_PRES(x)      ((x) << 0x07) // Present
 #define SEG_SAVL(x)      ((x) << 0x0C) // Available for system use
@@ -73,6 +79,8 @@ typedef struct __attribute__((packed)) {
 } gdt_ptr_t;
 
 void gdt_init();
+void gdt_init_cpu(uint32_t id);
 void tss_set_stack(uint32_t stack);
+void gdt_set_tls(uint32_t base);
 
 #endif
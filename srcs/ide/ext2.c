@@ -1,18 +1,25 @@
 #include "ext2.h"
 #include "../ide/ide.h"
 #include "../memory/memory.h"
+#include "../memory/slab.h"
 #include "../utils/utils.h"
 #include "../utils/stdint.h"
 #include "../kshell/kshell.h"
 #include "../keyboard/keyboard.h"
 #include "../display/display.h"
 #include "ext2_fileio.h"
+#include "../memory/page_cache.h"
+#include "../tasks/task.h"
+#include "../tasks/wait_queue.h"
 
 extern int ide_read_sectors(uint32_t lba, uint8_t count, void *buffer);
 extern int ide_write_sectors(uint32_t lba, uint8_t count, void *buffer);
 
 /* --- Derived constants --- */
 #define SECTORS_PER_BLOCK (EXT2_BLOCK_SIZE / IDE_SECTOR_SIZE)
+#define EXT2_NDIR_BLOCKS  12
+#define EXT2_ADDR_PER_BLOCK (EXT2_BLOCK_SIZE / sizeof(uint32_t))
+#define EXT2_PAGE_BLOCKS  (PAGE_SIZE / EXT2_BLOCK_SIZE)
 
 /* --- Global FS structure --- */
 struct ext2_fs
@@ -25,11 +32,46 @@ struct ext2_fs
 
 static uint32_t current_dir = EXT2_ROOT_INODE;  /* current working directory inode */
 
+static kmem_cache_t* ext2_block_cache;
+static kmem_cache_t* ext2_file_cache;
+
 void set_current_dir(uint32_t inode)
 {
     current_dir = inode;
 }
 
+/*
+ * One filesystem operation at a time, on all CPUs: nothing below is
+ * locked, and the IDE driver sleeps between a command and its data.
+ * Every entry point takes it, the page cache included. It is a sleeping
+ * lock, as the holder waits on the disk. The holder may take it again: a
+ * copy to a file mapping can fault back in through the page cache.
+ */
+static wait_queue_t ext2_wq;
+static struct task_struct* volatile ext2_owner = NULL;
+static uint32_t ext2_depth = 0;
+
+static void ext2_lock(void)
+{
+    task_t* task = get_current_task();
+
+    if (ext2_owner == task)
+    {
+        ext2_depth++;
+        return;
+    }
+    wait_event(ext2_wq, __sync_bool_compare_and_swap(&ext2_owner, NULL, task));
+    ext2_depth = 1;
+}
+
+static void ext2_unlock(void)
+{
+    if (--ext2_depth)
+        return;
+    __atomic_store_n(&ext2_owner, NULL, __ATOMIC_RELEASE);
+    wake_up(&ext2_wq);
+}
+
 static void split_path(const char *full_path, char *out_parent, char *out_name)
 {
     char temp[256];
@@ -79,21 +121,21 @@ static void ext2_read_inode(uint32_t inode_num, struct ext2_inode *inode)
     uint32_t index = inode_num - 1;
     uint32_t block_offset = (index * EXT2_INODE_SIZE) / EXT2_BLOCK_SIZE;
     uint32_t offset_in_block = (index * EXT2_INODE_SIZE) % EXT2_BLOCK_SIZE;
-    uint8_t* block = kmalloc(EXT2_BLOCK_SIZE);
+    uint8_t* block = kmem_cache_alloc(ext2_block_cache);
     ext2_read_block(ext2.gd.bg_inode_table + block_offset, block);
     memcpy(inode, block + offset_in_block, sizeof(struct ext2_inode));
-    kfree(block);
+    kmem_cache_free(ext2_block_cache, block);
 }
 
 static void ext2_write_inode(uint32_t inode_num, struct ext2_inode *inode) {
     uint32_t index = inode_num - 1;
     uint32_t block_offset = (index * EXT2_INODE_SIZE) / EXT2_BLOCK_SIZE;
     uint32_t offset_in_block = (index * EXT2_INODE_SIZE) % EXT2_BLOCK_SIZE;
-    uint8_t* block = kmalloc(EXT2_BLOCK_SIZE);
+    uint8_t* block = kmem_cache_alloc(ext2_block_cache);
     ext2_read_block(ext2.gd.bg_inode_table + block_offset, block);
     memcpy(block + offset_in_block, inode, sizeof(struct ext2_inode));
     ext2_write_block(ext2.gd.bg_inode_table + block_offset, block);
-    kfree(block);
+    kmem_cache_free(ext2_block_cache, block);
 }
 
 static uint32_t ext2_allocate_inode(void)
@@ -338,10 +380,11 @@ static void ext2_truncate_inode(uint32_t inode_num, struct ext2_inode *inode)
     inode->i_size = 0;
     inode->i_blocks = 0;
     ext2_write_inode(inode_num, inode);
+    page_cache_invalidate(inode_num);
 }
 
 /* Get inode from path */
-uint32_t ext2_get_inode(const char *path)
+static uint32_t ext2_get_inode_locked(const char *path)
 {
     uint32_t inode_num;
     if (ext2_resolve_path(path, &inode_num) < 0)
@@ -352,7 +395,17 @@ uint32_t ext2_get_inode(const char *path)
     return inode_num;
 }
 
-char *ext2_pwd(void)
+uint32_t ext2_get_inode(const char *path)
+{
+    uint32_t ret;
+
+    ext2_lock();
+    ret = ext2_get_inode_locked(path);
+    ext2_unlock();
+    return ret;
+}
+
+static char *ext2_pwd_locked(void)
 {
     if (current_dir == EXT2_ROOT_INODE)
         return vstrdup("/");
@@ -429,7 +482,17 @@ char *ext2_pwd(void)
     return pwd;
 }
 
-ext2_FILE *ext2_fopen(const char *path, const char *mode)
+char *ext2_pwd(void)
+{
+    char *ret;
+
+    ext2_lock();
+    ret = ext2_pwd_locked();
+    ext2_unlock();
+    return ret;
+}
+
+static ext2_FILE *ext2_fopen_locked(const char *path, const char *mode)
 {
     int allow_write = 0;
     int truncate = 0;
@@ -498,7 +561,7 @@ ext2_FILE *ext2_fopen(const char *path, const char *mode)
         ext2_truncate_inode(inode_num, &in);
     }
 
-    ext2_FILE *fp = kmalloc(sizeof(ext2_FILE));
+    ext2_FILE *fp = kmem_cache_alloc(ext2_file_cache);
     fp->inode_num = inode_num;
     fp->inode = in;
     fp->pos = 0;
@@ -512,14 +575,136 @@ ext2_FILE *ext2_fopen(const char *path, const char *mode)
     return fp;
 }
 
+ext2_FILE *ext2_fopen(const char *path, const char *mode)
+{
+    ext2_FILE *ret;
+
+    ext2_lock();
+    ret = ext2_fopen_locked(path, mode);
+    ext2_unlock();
+    return ret;
+}
+
+/* Disk block backing block 'file_block' of the file, 0 for a hole. */
+static uint32_t ext2_bmap(struct ext2_inode *inode, uint32_t file_block)
+{
+    uint32_t* table;
+    uint32_t block;
+
+    if (file_block < EXT2_NDIR_BLOCKS)
+        return inode->i_block[file_block];
+
+    file_block -= EXT2_NDIR_BLOCKS;
+    table = kmem_cache_alloc(ext2_block_cache);
+    if (file_block < EXT2_ADDR_PER_BLOCK)
+    {
+        block = inode->i_block[12];
+    }
+    else
+    {
+        file_block -= EXT2_ADDR_PER_BLOCK;
+        block = 0;
+        if (file_block < EXT2_ADDR_PER_BLOCK * EXT2_ADDR_PER_BLOCK && inode->i_block[13])
+        {
+            ext2_read_block(inode->i_block[13], table);
+            block = table[file_block / EXT2_ADDR_PER_BLOCK];
+            file_block %= EXT2_ADDR_PER_BLOCK;
+        }
+    }
+    if (block)
+    {
+        ext2_read_block(block, table);
+        block = table[file_block];
+    }
+    kmem_cache_free(ext2_block_cache, table);
+    return block;
+}
+
+/**
+ * ext2_read_page:
+ *   Fills 'page' with the PAGE_SIZE bytes at 'offset' of the file. Holes
+ *   and the part past the end of the file read as zeroes.
+ */
+static int ext2_read_page_locked(uint32_t inode_num, uint32_t offset, void *page)
+{
+    struct ext2_inode in;
+    uint32_t block;
+
+    ext2_read_inode(inode_num, &in);
+    memset(page, 0, PAGE_SIZE);
+    for (uint32_t i = 0; i < EXT2_PAGE_BLOCKS; i++)
+    {
+        if (offset + i * EXT2_BLOCK_SIZE >= in.i_size)
+            break;
+        block = ext2_bmap(&in, offset / EXT2_BLOCK_SIZE + i);
+        if (block)
+            ext2_read_block(block, (uint8_t*)page + i * EXT2_BLOCK_SIZE);
+    }
+    return 0;
+}
+
+int ext2_read_page(uint32_t inode_num, uint32_t offset, void *page)
+{
+    int ret;
+
+    ext2_lock();
+    ret = ext2_read_page_locked(inode_num, offset, page);
+    ext2_unlock();
+    return ret;
+}
+
+/**
+ * ext2_write_page:
+ *   Writes back the PAGE_SIZE bytes at 'offset' of the file. Only blocks
+ *   that already exist are written: a mapping never grows the file.
+ */
+static int ext2_write_page_locked(uint32_t inode_num, uint32_t offset, const void *page)
+{
+    struct ext2_inode in;
+    uint8_t* blockbuf;
+    uint32_t block;
+    uint32_t len;
+
+    ext2_read_inode(inode_num, &in);
+    blockbuf = kmem_cache_alloc(ext2_block_cache);
+    for (uint32_t i = 0; i < EXT2_PAGE_BLOCKS; i++)
+    {
+        if (offset + i * EXT2_BLOCK_SIZE >= in.i_size)
+            break;
+        block = ext2_bmap(&in, offset / EXT2_BLOCK_SIZE + i);
+        if (!block)
+            continue;
+        /* Keep the tail of the last block as it is on disk */
+        len = in.i_size - (offset + i * EXT2_BLOCK_SIZE);
+        if (len < EXT2_BLOCK_SIZE)
+            ext2_read_block(block, blockbuf);
+        else
+            len = EXT2_BLOCK_SIZE;
+        memcpy(blockbuf, (const uint8_t*)page + i * EXT2_BLOCK_SIZE, len);
+        ext2_write_block(block, blockbuf);
+    }
+    kmem_cache_free(ext2_block_cache, blockbuf);
+    return 0;
+}
+
+int ext2_write_page(uint32_t inode_num, uint32_t offset, const void *page)
+{
+    int ret;
+
+    ext2_lock();
+    ret = ext2_write_page_locked(inode_num, offset, page);
+    ext2_unlock();
+    return ret;
+}
+
 int ext2_fclose(ext2_FILE *stream)
 {
     if (!stream) return -1;
-    kfree(stream);
+    kmem_cache_free(ext2_file_cache, stream);
     return 0;
 }
 
-size_t ext2_fread(void *ptr, size_t size, size_t nmemb, ext2_FILE *stream)
+static size_t ext2_fread_locked(void *ptr, size_t size, size_t nmemb, ext2_FILE *stream)
 {
     if (!stream) return 0;
     if (stream->mode != 0)
@@ -557,7 +742,17 @@ size_t ext2_fread(void *ptr, size_t size, size_t nmemb, ext2_FILE *stream)
     return total / size;
 }
 
-size_t ext2_fwrite(const void *ptr, size_t size, size_t nmemb, ext2_FILE *stream)
+size_t ext2_fread(void *ptr, size_t size, size_t nmemb, ext2_FILE *stream)
+{
+    size_t ret;
+
+    ext2_lock();
+    ret = ext2_fread_locked(ptr, size, nmemb, stream);
+    ext2_unlock();
+    return ret;
+}
+
+static size_t ext2_fwrite_locked(const void *ptr, size_t size, size_t nmemb, ext2_FILE *stream)
 {
     if (!stream) return 0;
     if (stream->mode != 1)
@@ -600,12 +795,23 @@ size_t ext2_fwrite(const void *ptr, size_t size, size_t nmemb, ext2_FILE *stream
         stream->inode.i_size = stream->pos;
     }
     ext2_write_inode(stream->inode_num, &stream->inode);
+    page_cache_invalidate(stream->inode_num);
 
     return total / size; /* number of "elements" written */
 }
 
+size_t ext2_fwrite(const void *ptr, size_t size, size_t nmemb, ext2_FILE *stream)
+{
+    size_t ret;
+
+    ext2_lock();
+    ret = ext2_fwrite_locked(ptr, size, nmemb, stream);
+    ext2_unlock();
+    return ret;
+}
+
 /* --- Command Implementations --- */
-void ext2_cmd_ls(const char *path)
+static void ext2_cmd_ls_locked(const char *path)
 {
     uint32_t inode_num;
     if (ext2_resolve_path(path, &inode_num) < 0)
@@ -640,7 +846,14 @@ void ext2_cmd_ls(const char *path)
     kfree(blkbuf);
 }
 
-void ext2_cmd_cat(const char *path)
+void ext2_cmd_ls(const char *path)
+{
+    ext2_lock();
+    ext2_cmd_ls_locked(path);
+    ext2_unlock();
+}
+
+static void ext2_cmd_cat_locked(const char *path)
 {
     uint32_t inode_num;
     if (ext2_resolve_path(path, &inode_num) < 0)
@@ -665,7 +878,14 @@ void ext2_cmd_cat(const char *path)
     kfree(blkbuf);
 }
 
-void ext2_cmd_touch(const char *path)
+void ext2_cmd_cat(const char *path)
+{
+    ext2_lock();
+    ext2_cmd_cat_locked(path);
+    ext2_unlock();
+}
+
+static void ext2_cmd_touch_locked(const char *path)
 {
     uint32_t inode_num;
     if (ext2_resolve_path(path, &inode_num) == 0)
@@ -701,7 +921,14 @@ void ext2_cmd_touch(const char *path)
     ext2_create_file(parent, file_name, 0x8000);
 }
 
-void ext2_cmd_mkdir(const char *path)
+void ext2_cmd_touch(const char *path)
+{
+    ext2_lock();
+    ext2_cmd_touch_locked(path);
+    ext2_unlock();
+}
+
+static void ext2_cmd_mkdir_locked(const char *path)
 {
     char parent_path[256];
     char dir_name[256];
@@ -776,7 +1003,14 @@ void ext2_cmd_mkdir(const char *path)
     ext2_add_dir_entry(parent, dir_name, new_inode, EXT2_FT_DIR);
 }
 
-void ext2_cmd_rm(const char *path)
+void ext2_cmd_mkdir(const char *path)
+{
+    ext2_lock();
+    ext2_cmd_mkdir_locked(path);
+    ext2_unlock();
+}
+
+static void ext2_cmd_rm_locked(const char *path)
 {
     uint32_t inode_num;
     if (ext2_resolve_path(path, &inode_num) < 0)
@@ -819,7 +1053,14 @@ void ext2_cmd_rm(const char *path)
     ext2_free_inode(inode_num);
 }
 
-void ext2_cmd_rmdir(const char *path)
+void ext2_cmd_rm(const char *path)
+{
+    ext2_lock();
+    ext2_cmd_rm_locked(path);
+    ext2_unlock();
+}
+
+static void ext2_cmd_rmdir_locked(const char *path)
 {
     uint32_t inode_num;
     if (ext2_resolve_path(path, &inode_num) < 0)
@@ -878,7 +1119,14 @@ void ext2_cmd_rmdir(const char *path)
     ext2_free_inode(inode_num);
 }
 
-void ext2_cmd_cd(const char *path)
+void ext2_cmd_rmdir(const char *path)
+{
+    ext2_lock();
+    ext2_cmd_rmdir_locked(path);
+    ext2_unlock();
+}
+
+static void ext2_cmd_cd_locked(const char *path)
 {
     uint32_t inode_num;
     if (ext2_resolve_path(path, &inode_num) < 0)
@@ -896,7 +1144,14 @@ void ext2_cmd_cd(const char *path)
     current_dir = inode_num;
 }
 
-void ext2_cmd_cp(const char *src_path, const char *dst_path)
+void ext2_cmd_cd(const char *path)
+{
+    ext2_lock();
+    ext2_cmd_cd_locked(path);
+    ext2_unlock();
+}
+
+static void ext2_cmd_cp_locked(const char *src_path, const char *dst_path)
 {
     uint32_t src_inode_num;
     if (ext2_resolve_path(src_path, &src_inode_num) < 0)
@@ -964,7 +1219,14 @@ void ext2_cmd_cp(const char *src_path, const char *dst_path)
     printf("cp: copied '%s' to '%s'\n", src_path, dst_path);
 }
 
-void ext2_cmd_mv(const char *src_path, const char *dst_path)
+void ext2_cmd_cp(const char *src_path, const char *dst_path)
+{
+    ext2_lock();
+    ext2_cmd_cp_locked(src_path, dst_path);
+    ext2_unlock();
+}
+
+static void ext2_cmd_mv_locked(const char *src_path, const char *dst_path)
 {
     uint32_t src_inode_num;
     if (ext2_resolve_path(src_path, &src_inode_num) < 0)
@@ -1019,6 +1281,13 @@ void ext2_cmd_mv(const char *src_path, const char *dst_path)
     printf("mv: moved '%s' to '%s'\n", src_path, dst_path);
 }
 
+void ext2_cmd_mv(const char *src_path, const char *dst_path)
+{
+    ext2_lock();
+    ext2_cmd_mv_locked(src_path, dst_path);
+    ext2_unlock();
+}
+
 static void cmd_ls();
 static void cmd_cat();
 static void cmd_touch();
@@ -1160,6 +1429,10 @@ void test_fileio()
 
 void ext2_mount(void)
 {
+    ext2_block_cache = kmem_cache_create("ext2_block", EXT2_BLOCK_SIZE, 0, NULL);
+    ext2_file_cache = kmem_cache_create("ext2_FILE", sizeof(ext2_FILE), 0, NULL);
+    page_cache_init();
+
     uint8_t* buf = kmalloc(EXT2_BLOCK_SIZE);
     /* Read superblock (located at block 1) */
     ext2_read_block(1, buf);
@@ -17,5 +17,7 @@ ext2_FILE *ext2_fopen(const char *path, const char *mode);
 size_t ext2_fread(void *ptr, size_t size, size_t nmemb, ext2_FILE *stream);
 size_t ext2_fwrite(const void *ptr, size_t size, size_t nmemb, ext2_FILE *stream);
 int ext2_fclose(ext2_FILE *stream);
+int ext2_read_page(uint32_t inode_num, uint32_t offset, void *page);
+int ext2_write_page(uint32_t inode_num, uint32_t offset, const void *page);
 
 #endif
@@ -6,24 +6,34 @@
 #include "memory/memory.h"
 #include "keyboard/signals.h"
 #include "tasks/task.h"
+#include "smp/smp.h"
+#include "tasks/fpu.h"
+#include "tasks/workqueue.h"
 #include "ide/ide.h"
 #include "ide/ext2.h"
 #include "syscalls/syscalls.h"
 
 #include "umgmnt/users.h"
+#include "boot/multiboot.h"
 
 extern uint32_t endkernel;
 
-void kernel_main()
+void kernel_main(uint32_t magic, multiboot_info_t* mbi)
 {
+    /* First: %gs must point at our cpu_t before anything locks or allocates */
+    gdt_init();
     disable_print();
     clear_screen();
     init_kshell();
 
-    paging_init();
+    /* Without a valid multiboot handoff the PMM falls back to 64 MB */
+    if (magic != MULTIBOOT_BOOTLOADER_MAGIC)
+        mbi = NULL;
+
+    paging_init(mbi);
     init_interrupts();
     heap_init();
-    gdt_init();
+    fpu_init();
 
     init_timer();
 
@@ -41,15 +51,15 @@ void kernel_main()
 
     // kshell(); /* Uncomment this line to not run the scheduler */
     scheduler_init();
+    /* Needs the timer running, to wait on the APs and calibrate theirs */
+    smp_init();
+    workqueue_init();
     start_foo_tasks();
 
     enable_print();
     
     scheduler();
 
-    /* Keep CPU busy */
-    while (1)
-    {
-    }
-    
+    /* From here on we are the idle task */
+    cpu_idle();
 }
@@ -4,7 +4,7 @@
 char* get_line()
 {
     clear_kb_buffer();
-    while (getc() != '\n') scheduler();
+    while (get_last_char_blocking() != '\n');
     char* buffer = get_kb_buffer();
     buffer[strlen(buffer) - 1] = '\0'; /* remove '\n' */
     return buffer;
@@ -12,12 +12,13 @@
 		jmp common_isr_handler ; jump to the common handler
 %endmacro
 
+; the CPU already pushed an error code: it ends up in error_state.err_code
 %macro error_code_isr_handler 1
 	global isr_handler_%1
 		isr_handler_%1:
 		push %1 ; push the parameter as error code & interrupt number
 		push %1 ; push the parameter as error code & interrupt number
-		jmp common_isr_handler ; jump to the common handler
+		jmp common_isr_handler_err ; jump to the common handler
 %endmacro
 
 %macro no_error_code_irq_handler 2
@@ -46,6 +47,14 @@ common_isr_handler:
 	; iret call
 	iret
 
+; same, also dropping the error code the CPU pushed
+common_isr_handler_err:
+	pusha
+	call isr_handler
+	popa
+	add	esp, 12
+	iret
+
 global syscall_handler_asm
 syscall_handler_asm:
 ; when calling here i must build a trampoline, so then i'll not care about the stack corruption
@@ -87,21 +96,21 @@ no_error_code_isr_handler 3
 no_error_code_isr_handler 4
 no_error_code_isr_handler 5
 no_error_code_isr_handler 6
-error_code_isr_handler 7
-no_error_code_isr_handler 8
-error_code_isr_handler 9
+no_error_code_isr_handler 7
+error_code_isr_handler 8
+no_error_code_isr_handler 9
 error_code_isr_handler 10
 error_code_isr_handler 11
 error_code_isr_handler 12
 error_code_isr_handler 13
-no_error_code_isr_handler 14
+error_code_isr_handler 14
 no_error_code_isr_handler 15
-error_code_isr_handler 16
-no_error_code_isr_handler 17
+no_error_code_isr_handler 16
+error_code_isr_handler 17
 no_error_code_isr_handler 18
 no_error_code_isr_handler 19
 no_error_code_isr_handler 20
-no_error_code_isr_handler 21
+error_code_isr_handler 21
 no_error_code_isr_handler 22
 no_error_code_isr_handler 23
 no_error_code_isr_handler 24
@@ -131,4 +140,13 @@ no_error_code_irq_handler 13, 45
 no_error_code_irq_handler 14, 46
 no_error_code_irq_handler 15, 47
 
+; local APIC interrupts, numbered on from the ISA ones
+no_error_code_irq_handler 16, 0x40 ; LAPIC timer
+no_error_code_irq_handler 17, 0x41 ; IPI: reschedule, TLB shootdown
+
+; the local APIC does not wait for an EOI after a spurious interrupt
+global spurious_irq_handler
+spurious_irq_handler:
+	iret
+
 section .note.GNU-stack noalloc noexec nowrite progbits
@@ -102,6 +102,9 @@ extern void irq_handler_12();
 extern void irq_handler_13();
 extern void irq_handler_14();
 extern void irq_handler_15();
+extern void irq_handler_16();
+extern void irq_handler_17();
+extern void spurious_irq_handler();
 
 extern void syscall_handler_asm();
 
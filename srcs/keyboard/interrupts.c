@@ -9,6 +9,9 @@
 #include "../syscalls/syscalls.h"
 #include "../tasks/task.h"
 #include "../ide/ide.h"
+#include "../smp/smp.h"
+#include "../smp/apic.h"
+#include "../tasks/fpu.h"
 
 void enable_interrupts(void)
 {
@@ -20,8 +23,16 @@ void disable_interrupts(void)
 	__asm__ __volatile__("cli");
 }
 
+static inline uint32_t read_cr2()
+{
+    uint32_t cr2;
+
+    __asm__ __volatile__("mov %%cr2, %0" : "=r"(cr2));
+    return cr2;
+}
+
 /* PAGE FAULT HANDLER */
-void page_fault_handler(registers* regs, error_state* stack)
+void page_fault_handler(registers* regs, error_state* stack, uint32_t intr_no)
 {
     uint32_t faulting_address;
     __asm__ __volatile__("mov %%cr2, %0" : "=r"(faulting_address));
@@ -48,9 +59,16 @@ void page_fault_handler(registers* regs, error_state* stack)
 
 
     // debug_page_mapping(faulting_address);
-    while(1);
 
-    NEVER_HERE;
+    /*
+     * Every task runs in ring 0, so the U/S bit is never set. A bad access
+     * to the user window (past the stack limit, unmapped, PROT_NONE) only
+     * takes its task down; anything else is a kernel bug.
+     */
+    if (intr_no == 14 && task && task != this_cpu()->idle && task->mm
+        && faulting_address >= USER_SPACE_START && faulting_address < USER_SPACE_END)
+        kill_task(14);
+    kernel_panic("Unhandled fault in the kernel");
 } /* PAGE FAULT HANDLER */
 
 void isr_handler(registers reg, uint32_t intr_no, uint32_t err_code, error_state stack)
@@ -62,9 +80,20 @@ void isr_handler(registers reg, uint32_t intr_no, uint32_t err_code, error_state
 
     // printf("Interrupt SW number: %d\n", intr_no);
 
+    /* Device not available: lazy FPU switching */
+    if (intr_no == 7)
+    {
+        fpu_handle_nm();
+        return;
+    }
+
+    /* Copy-on-write, demand-zero and stack growth faults are not errors */
+    if (intr_no == 14 && vmm_handle_fault(read_cr2(), stack.err_code))
+        return;
+
     if (intr_no == 14 || intr_no == 13)
     {
-        page_fault_handler(&reg, &stack);
+        page_fault_handler(&reg, &stack, intr_no);
     }
 
     _kill(0, intr_no); /* kernell side so call _kill directly */
@@ -92,12 +121,25 @@ void irq_handler(registers reg, uint32_t intr_no, uint32_t err_code, error_state
     //     // printf("Switching tasks\n");
     // }
 
+    /*
+     * Acknowledge first: the timer may switch tasks below, and the PIC or
+     * local APIC must not hold back further IRQs until this task happens
+     * to run again. Interrupts stay off, iret turns them back on.
+     */
+    irq_eoi(intr_no);
+
     switch (intr_no)
     {
         case 0:
-            // scheduler();
-            // disable_interrupts();
             irq_handler_timer();
+            scheduler_tick();
+            break;
+        case 16:
+            /* The APs' own tick, the PIT one only reaches the BSP */
+            scheduler_tick();
+            break;
+        case 17:
+            smp_handle_ipi();
             break;
         case 1:
             keyboard_handler();
@@ -111,12 +153,6 @@ void irq_handler(registers reg, uint32_t intr_no, uint32_t err_code, error_state
             printf("Interrupt HW number: %d\n", intr_no);
             kernel_panic("Unknown interrupt");
     }
-
-    enable_interrupts();
-    // if (intr_no >= 8)
-    // puts("#######################################################");
-    if(intr_no >= 8) outb(0xA0, 0x20);
-	outb(PIC_EOI, PIC1_COMMAND);
 }
 
 void init_interrupts()
@@ -192,6 +228,10 @@ void init_interrupts()
 
     idt_set_gate(0x30, (uint32_t)syscall_handler_asm);
 
+    idt_set_gate(LAPIC_TIMER_VECTOR, (uint32_t)irq_handler_16);
+    idt_set_gate(IPI_VECTOR, (uint32_t)irq_handler_17);
+    idt_set_gate(SPURIOUS_VECTOR, (uint32_t)spurious_irq_handler);
+
     register_idt();
     ide_init();
 }
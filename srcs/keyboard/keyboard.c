@@ -5,6 +5,7 @@
 #include "idt.h"
 #include "../memory/memory.h"
 #include "keyboard.h"
+#include "../tasks/wait_queue.h"
 
 #define KEYBOARD_DATA_PORT 0x60
 
@@ -19,6 +20,9 @@ static int keyb_buff_end = 0;
 bool shift_pressed = false;
 bool ctrl_pressed = false;
 
+/* Readers sleeping until a key lands in the buffer */
+static wait_queue_t keyboard_wq;
+
 char get_last_char()
 {
     if (keyb_buff_start == keyb_buff_end)
@@ -33,9 +37,8 @@ char get_last_char()
 
 char get_last_char_blocking()
 {
-    char c;
-    while ((c = get_last_char()) == '\0');
-    return c;
+    wait_event(keyboard_wq, keyb_buff_start != keyb_buff_end);
+    return get_last_char();
 }
 
 char* get_kb_buffer()
@@ -129,6 +132,7 @@ void keyboard_handler()
             {
                 putc(key);
                 set_kb_char(key);
+                wake_up(&keyboard_wq);
             }
     }
 
@@ -10,7 +10,7 @@ void signal_task(task_t* task, int signal, signal_handler_t handler)
 {
     if (signal >= 0 && signal < MAX_SIGNALS)
     {
-        task->signals.handlers[signal] = handler;
+        task->signals.sighand->handlers[signal] = handler;
     }
 }
 
@@ -18,7 +18,7 @@ int _signal(int signal, signal_handler_t handler)
 {
     task_t *task = get_current_task();
     // printf("SIGNAL################task: %p\n", task);
-    task->signals.handlers[signal] = handler;
+    task->signals.sighand->handlers[signal] = handler;
     return 1;
 }
 
@@ -62,9 +62,9 @@ void handle_signals()
          !(task->signals.blocked_signals & (1 << i)))
         {
             task->signals.pending_signals &= ~(1 << i);
-            if (task->signals.handlers[i])
+            if (task->signals.sighand->handlers[i])
             {
-                task->signals.handlers[i](i);
+                task->signals.sighand->handlers[i](i);
             }
         }
     }
@@ -102,14 +102,13 @@ static void panic_signal_handler(int signal)
     kernel_panic("Panic signal received");
 }
 
-void init_signals(task_t* task)
+/* Default handlers: a signal kills the task, 0, 6 and 14 the kernel. */
+int init_signals(task_t* task)
 {
-    for (int i = 0; i < MAX_SIGNALS; i++)
-    {
-        task->signals.handlers[i] = NULL;
-    }
-    task->signals.pending_signals = 0;
-    task->signals.blocked_signals = 0;
+    task->signals.sighand = kmalloc(sizeof(sighand_t));
+    if (!task->signals.sighand)
+        return -1;
+    task->signals.sighand->users = 1;
 
     for (int i = 0; i < MAX_SIGNALS; i++)
     {
@@ -123,6 +122,42 @@ void init_signals(task_t* task)
     // task->signals.handlers[6](6);
     task->signals.pending_signals = 0;
     task->signals.blocked_signals = 0;
+    return 0;
+}
+
+/**
+ * copy_signals:
+ *   Handlers of a new thread: the same ones as 'from' with 'share', a
+ *   copy of them otherwise. Nothing is pending, the blocked mask is
+ *   inherited.
+ */
+int copy_signals(task_t* task, task_t* from, bool share)
+{
+    if (share)
+    {
+        task->signals.sighand = from->signals.sighand;
+        __atomic_fetch_add(&task->signals.sighand->users, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        task->signals.sighand = kmalloc(sizeof(sighand_t));
+        if (!task->signals.sighand)
+            return -1;
+        memcpy(task->signals.sighand, from->signals.sighand, sizeof(sighand_t));
+        task->signals.sighand->users = 1;
+    }
+    task->signals.pending_signals = 0;
+    task->signals.blocked_signals = from->signals.blocked_signals;
+    return 0;
+}
+
+void free_signals(task_t* task)
+{
+    sighand_t* sighand = task->signals.sighand;
+
+    task->signals.sighand = NULL;
+    if (sighand && !__atomic_sub_fetch(&sighand->users, 1, __ATOMIC_ACQ_REL))
+        kfree(sighand);
 }
 
 /* This will come when i'll be having tasks. */
@@ -142,9 +177,9 @@ void init_signals(task_t* task)
 //             !(task->signals.blocked_signals & (1 << i)))
 //             {
 //             task->signals.pending_signals &= ~(1 << i);
-//             if (task->signals.handlers[i])
+//             if (task->signals.sighand->handlers[i])
 //             {
-//                 task->signals.handlers[i](i);
+//                 task->signals.sighand->handlers[i](i);
 //             }
 //         }
 //     }
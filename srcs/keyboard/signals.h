@@ -2,23 +2,35 @@
 #define SIGNALS_H
 
 #include "../utils/stdint.h"
+#include "../utils/utils.h"
 
 #define MAX_SIGNALS 32
 
 typedef void (*signal_handler_t)(int);
 typedef int pid_t;
 
+/* Threads made with CLONE_SIGHAND share their handlers */
 typedef struct
 {
     signal_handler_t handlers[MAX_SIGNALS]; /* Handler for each signal, _signal() would set it. */
+    volatile uint32_t users;
+} sighand_t;
+
+typedef struct
+{
+    sighand_t *sighand;
     uint32_t pending_signals; /* 'flag' of pending signals */
     uint32_t blocked_signals; /* 'flag' of blocked signals */
 } signal_context_t;
 
+struct task_struct;
+
 int _signal(int signal, signal_handler_t handler);
 int _kill(pid_t pid, int signal);
 // int _signal(pid_t pid, int signal);
 void handle_signals();
-void init_signals();
+int init_signals(struct task_struct* task);
+int copy_signals(struct task_struct* task, struct task_struct* from, bool share);
+void free_signals(struct task_struct* task);
 
 #endif
\ No newline at end of file
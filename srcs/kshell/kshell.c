@@ -139,30 +139,25 @@ void init_kshell()
 static void kuptime()
 {
     uint64_t uptime;
+    uint32_t entries, skipped;
+
     uptime = get_kuptime();
     printf("Uptime: %d seconds\n", uptime);
+    get_nohz_stats(&entries, &skipped);
+    printf("Tickless idle: %u times, %u ticks skipped\n", entries, skipped);
 }
 
 static void ksleep()
 {
-    // fs_node_t* node;
-    // node = fs_build_tree_from_inode(2, "/", NULL, NULL);
-    // if (node)
-    // {
-    //     fs_print_tree(node, 0);
-    //     fs_destroy_tree(node);
-    // }
-    // char* buffer;
-    // uint32_t seconds;
-
-    // printf("Enter the number of seconds to sleep: ");
-    
-    // buffer = get_line();
+    char* buffer;
+    uint32_t seconds;
 
-    // seconds = (uint32_t)hex_string_to_int(buffer);
-    // printf("Sleeping for %d seconds...\n", seconds);
-    // sleep(seconds);
-    // printf("Woke up!\n");
+    printf("Enter the number of seconds to sleep: ");
+    buffer = get_line();
+    seconds = (uint32_t)hex_string_to_int(buffer);
+    printf("Sleeping for %d seconds...\n", seconds);
+    sleep(seconds);
+    printf("Woke up!\n");
 }
 
 static void ks_kill()
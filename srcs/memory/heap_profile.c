@@ -0,0 +1,224 @@
+#include "heap_profile.h"
+
+#ifdef HEAP_PROFILE
+
+#include "../utils/stdint.h"
+#include "../utils/utils.h"
+#include "../display/display.h"
+#include "../timers/timers.h"
+#include "../utils/spinlock.h"
+#include "slab.h"
+
+/*############################################################################*/
+/*                                                                            */
+/*                           DEFINES                                          */
+/*                                                                            */
+/*############################################################################*/
+#define PROFILE_RECORD_HASH_SIZE    1024
+#define PROFILE_SITE_HASH_SIZE      128
+#define PROFILE_TOP_SITES           10
+
+/* One live allocation */
+typedef struct alloc_record
+{
+    void* ptr;
+    size_t size;
+    uint32_t tick;
+    struct alloc_site* site;
+    struct alloc_record* next;
+} alloc_record_t;
+
+/* Everything allocated from one return address */
+typedef struct alloc_site
+{
+    void* caller;
+    uint32_t allocs;
+    uint32_t frees;
+    size_t live_bytes;
+    size_t peak_bytes;
+    uint32_t first_tick;
+    struct alloc_site* next;
+} alloc_site_t;
+
+/*############################################################################*/
+/*                                                                            */
+/*                           LOCALS                                           */
+/*                                                                            */
+/*############################################################################*/
+static alloc_record_t* records[PROFILE_RECORD_HASH_SIZE];
+static alloc_site_t* sites[PROFILE_SITE_HASH_SIZE];
+/* Slab caches: kmem_cache_alloc() does not come back through kmalloc() */
+static kmem_cache_t* record_cache;
+static kmem_cache_t* site_cache;
+/* kmalloc() runs on every CPU: the tables are shared */
+static spinlock_t profile_lock = SPINLOCK_INIT;
+
+/*############################################################################*/
+/*                                                                            */
+/*                           FUNCTIONS                                        */
+/*                                                                            */
+/*############################################################################*/
+
+static inline uint32_t record_hash(void* ptr)
+{
+    return ((uintptr_t)ptr >> 3) % PROFILE_RECORD_HASH_SIZE;
+}
+
+static inline uint32_t site_hash(void* caller)
+{
+    return ((uintptr_t)caller >> 2) % PROFILE_SITE_HASH_SIZE;
+}
+
+void heap_profile_init()
+{
+    memset(records, 0, sizeof(records));
+    memset(sites, 0, sizeof(sites));
+    record_cache = kmem_cache_create("heap_prof_record", sizeof(alloc_record_t), 0, NULL);
+    site_cache = kmem_cache_create("heap_prof_site", sizeof(alloc_site_t), 0, NULL);
+}
+
+static alloc_site_t* get_site(void* caller)
+{
+    alloc_site_t** bucket = &sites[site_hash(caller)];
+    alloc_site_t* site;
+
+    for (site = *bucket; site; site = site->next)
+    {
+        if (site->caller == caller)
+            return site;
+    }
+
+    site = kmem_cache_alloc(site_cache);
+    if (!site)
+        return NULL;
+    memset(site, 0, sizeof(alloc_site_t));
+    site->caller = caller;
+    site->first_tick = get_kticks();
+    site->next = *bucket;
+    *bucket = site;
+    return site;
+}
+
+void heap_profile_alloc(void* ptr, size_t size, void* caller)
+{
+    alloc_record_t* record;
+    alloc_site_t* site;
+    uint32_t flags;
+
+    if (!ptr || !record_cache || !site_cache)
+        return;
+    flags = spin_lock_irqsave(&profile_lock);
+    site = get_site(caller);
+    record = site ? kmem_cache_alloc(record_cache) : NULL;
+    if (!record)
+    {
+        spin_unlock_irqrestore(&profile_lock, flags);
+        return;
+    }
+
+    record->ptr = ptr;
+    record->size = size;
+    record->tick = get_kticks();
+    record->site = site;
+    record->next = records[record_hash(ptr)];
+    records[record_hash(ptr)] = record;
+
+    site->allocs++;
+    site->live_bytes += size;
+    if (site->live_bytes > site->peak_bytes)
+        site->peak_bytes = site->live_bytes;
+    spin_unlock_irqrestore(&profile_lock, flags);
+}
+
+void heap_profile_free(void* ptr)
+{
+    alloc_record_t** link;
+    alloc_record_t* record;
+    uint32_t flags;
+
+    if (!ptr || !record_cache)
+        return;
+    flags = spin_lock_irqsave(&profile_lock);
+    for (link = &records[record_hash(ptr)]; (record = *link); link = &record->next)
+    {
+        if (record->ptr != ptr)
+            continue;
+        *link = record->next;
+        record->site->frees++;
+        record->site->live_bytes -= record->size;
+        kmem_cache_free(record_cache, record);
+        break;
+    }
+    spin_unlock_irqrestore(&profile_lock, flags);
+}
+
+/* Age in seconds of the oldest allocation still live from 'site'. profile_lock is held. */
+static uint32_t oldest_live(alloc_site_t* site, uint32_t now)
+{
+    uint32_t oldest = now;
+
+    for (uint32_t i = 0; i < PROFILE_RECORD_HASH_SIZE; i++)
+    {
+        for (alloc_record_t* record = records[i]; record; record = record->next)
+        {
+            if (record->site == site && record->tick < oldest)
+                oldest = record->tick;
+        }
+    }
+    return (now - oldest) / PIT_FREQUENCY;
+}
+
+/*
+ * Prints the PROFILE_TOP_SITES call sites holding the most live memory.
+ * They are copied out under profile_lock and printed once it is dropped:
+ * frees on other CPUs release records while we look.
+ */
+void heap_profile_report()
+{
+    alloc_site_t* top[PROFILE_TOP_SITES];
+    alloc_site_t snapshot[PROFILE_TOP_SITES];
+    uint32_t oldest[PROFILE_TOP_SITES];
+    uint32_t count = 0;
+    uint32_t now = get_kticks();
+    uint32_t seconds;
+    uint32_t flags;
+    alloc_site_t* site;
+    uint32_t j;
+
+    flags = spin_lock_irqsave(&profile_lock);
+    for (uint32_t i = 0; i < PROFILE_SITE_HASH_SIZE; i++)
+    {
+        for (site = sites[i]; site; site = site->next)
+        {
+            /* Insertion into a small array kept sorted by live bytes */
+            for (j = count; j > 0 && top[j - 1]->live_bytes < site->live_bytes; j--)
+            {
+                if (j < PROFILE_TOP_SITES)
+                    top[j] = top[j - 1];
+            }
+            if (j < PROFILE_TOP_SITES)
+                top[j] = site;
+            if (count < PROFILE_TOP_SITES)
+                count++;
+        }
+    }
+    for (j = 0; j < count; j++)
+    {
+        snapshot[j] = *top[j];
+        oldest[j] = oldest_live(top[j], now);
+    }
+    spin_unlock_irqrestore(&profile_lock, flags);
+
+    printf("Top %d allocation sites by live bytes:\n", count);
+    for (j = 0; j < count; j++)
+    {
+        site = &snapshot[j];
+        seconds = (now - site->first_tick) / PIT_FREQUENCY;
+        printf("  %p: live=%z (%u objs) peak=%z allocs=%u frees=%u rate=%u/s oldest=%us\n",
+                site->caller, site->live_bytes, site->allocs - site->frees, site->peak_bytes,
+                site->allocs, site->frees, site->allocs / (seconds ? seconds : 1),
+                oldest[j]);
+    }
+}
+
+#endif
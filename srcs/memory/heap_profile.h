@@ -0,0 +1,29 @@
+#ifndef HEAP_PROFILE_H
+#define HEAP_PROFILE_H
+
+#include "../utils/stdint.h"
+
+/*
+ * Built with HEAP_PROFILE defined (make HEAP_PROFILE=1), every kmalloc()
+ * and vmalloc() records its caller, size and time, and the 'kprof'
+ * command reports the busiest call sites. Otherwise the hooks vanish.
+ */
+#ifdef HEAP_PROFILE
+
+void heap_profile_init();
+void heap_profile_alloc(void* ptr, size_t size, void* caller);
+void heap_profile_free(void* ptr);
+void heap_profile_report();
+
+#define HEAP_PROFILE_ALLOC(ptr, size) \
+    heap_profile_alloc(ptr, size, __builtin_return_address(0))
+#define HEAP_PROFILE_FREE(ptr) heap_profile_free(ptr)
+
+#else
+
+#define HEAP_PROFILE_ALLOC(ptr, size)
+#define HEAP_PROFILE_FREE(ptr)
+
+#endif
+
+#endif
@@ -4,19 +4,31 @@
 #include "memory.h"
 #include "../utils/utils.h"
 #include "pmm.h"
-
-extern uint32_t endkernel;
+#include "slab.h"
+#include "../utils/cpu.h"
+#include "../timers/timers.h"
+#include "../tasks/task.h"
+#include "../tasks/workqueue.h"
+#include "../utils/spinlock.h"
+#include "../smp/smp.h"
+#include "../ide/ext2_fileio.h"
+#include "page_cache.h"
+#include "heap_profile.h"
 
 /*############################################################################*/
 /*                                                                            */
 /*                           DEFINES                                          */
 /*                                                                            */
 /*############################################################################*/
-// #define HEAP_START ((uintptr_t)&endkernel + 0x4000) // Start heap 4 KB after kernel
-#define HEAP_START (ALIGN_4K((uintptr_t)&endkernel + 0x4000))
+/*
+ * The heap gets its own window above the direct map of RAM, so every heap
+ * page is a frame taken from the PMM rather than whatever follows the kernel.
+ */
+#define HEAP_START PMM_MEMORY_LIMIT
 #define HEAP_SIZE_  0x100000  /* 1 MB heap size */
 #define ALIGN_4K(x)  (((x) + 0xFFF) & ~0xFFF) /* 4 KB alignment */
 #define ALIGN_8(x)   (((x) + 0x7)   & ~0x7)   /* 8-byte alignment */
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((uintptr_t)(a) - 1))
 /* Maximum allowed heap expansion */
 #define MAX_HEAP_SIZE (4 * 1024 * 1024) /* 4 MB */
 
@@ -24,7 +36,8 @@ extern uint32_t endkernel;
  * Reserve a separate virtual region for vmalloc (immediately after the kernel heap).
  */
 #define VMALLOC_START (ALIGN_4K((uintptr_t)HEAP_START + MAX_HEAP_SIZE))
-#define VMALLOC_SIZE  (16 * 1024 * 1024)   /* 16 MB vmalloc region */
+#define VMALLOC_SIZE  (256 * 1024 * 1024)  /* 256 MB vmalloc region */
+#define VMAP_HASH_SIZE  64                 /* Buckets for live vmalloc areas */
 
 #define PAGE_PRESENT  0x1
 #define PAGE_RW       0x2
@@ -36,18 +49,76 @@ extern uint32_t endkernel;
 #define USER_PDE_FLAGS  (PAGE_PRESENT | PAGE_RW | PAGE_USER)
 #define USER_PTE_FLAGS  (PAGE_PRESENT | PAGE_RW | PAGE_USER)
 
+/*
+ * Heap chunk. 'size' covers the header and payload and carries the flags in
+ * its low bits; 'prev_size' is the boundary tag (footer) of the previous
+ * chunk and is only meaningful while BLOCK_PREV_FREE is set. The free-list
+ * links overlay the payload of free chunks.
+ */
 typedef struct block_header {
-    size_t size;               /* Size of the block (excluding header) */
-    struct block_header* next; /* Pointer to the next free block */
-    int free;                  /* Is this block free? (1 for yes, 0 for no) */
+    size_t prev_size;
+    size_t size;
+    struct block_header* next_free;
+    struct block_header* prev_free;
 } block_header_t;
 
-typedef struct vblock_header {
-    size_t size;               /* Size of the block (excluding header) */
-    struct vblock_header* next; /* Pointer to the next free block */
-    int free;                  /* Is this block free? (1 for yes, 0 for no) */
-    int is_user;               /* Is this block for user space? (1 for yes, 0 for no) */
-} vblock_header_t;
+#define BLOCK_FREE          0x1
+#define BLOCK_PREV_FREE     0x2
+#define BLOCK_FLAGS         (BLOCK_FREE | BLOCK_PREV_FREE)
+#define BLOCK_OVERHEAD      (2 * sizeof(size_t))
+#define BLOCK_MIN_SIZE      sizeof(block_header_t)
+#define BLOCK_SIZE(b)       ((b)->size & ~BLOCK_FLAGS)
+#define BLOCK_NEXT(b)       ((block_header_t*)((uintptr_t)(b) + BLOCK_SIZE(b)))
+#define BLOCK_PREV(b)       ((block_header_t*)((uintptr_t)(b) - (b)->prev_size))
+#define BLOCK_PAYLOAD(b)    ((void*)((uintptr_t)(b) + BLOCK_OVERHEAD))
+#define PAYLOAD_BLOCK(p)    ((block_header_t*)((uintptr_t)(p) - BLOCK_OVERHEAD))
+
+/*
+ * TLSF-style segregated free lists: the first level splits sizes by power of
+ * two, the second level splits each power of two into SL_COUNT classes.
+ * Sizes below SMALL_BLOCK_SIZE all live in first level 0.
+ */
+#define SL_INDEX_LOG2       4
+#define SL_COUNT            (1 << SL_INDEX_LOG2)
+#define FL_SHIFT            (SL_INDEX_LOG2 + 3)
+#define SMALL_BLOCK_SIZE    (1 << FL_SHIFT)
+#define FL_MAX              30
+#define FL_COUNT            (FL_MAX - FL_SHIFT + 1)
+
+/* Heap growth is rounded up to this to amortize kbrk() calls. */
+#define HEAP_GROW_MIN       (16 * 1024)
+
+/*
+ * Free runs at least this long give their pages back. A trimmed top keeps
+ * HEAP_TRIM_PAD of slack, so a free/alloc cycle around the threshold does
+ * not unmap and remap the same pages every time.
+ */
+#define HEAP_TRIM_THRESHOLD (64 * 1024)
+#define HEAP_TRIM_PAD       (2 * HEAP_GROW_MIN)
+
+/*
+ * A range of the vmalloc window. Free ranges sit on an address-sorted
+ * extent list, live ones in a hash keyed by start address.
+ */
+typedef struct vmap_area {
+    uintptr_t start;
+    size_t size;               /* Mapped bytes (free: extent length) */
+    size_t va_size;            /* Reserved bytes, guard page included */
+    int is_user;
+    struct vmap_area* next;
+} vmap_area_t;
+
+/*
+ * A dirty shared file page waiting to be written back. Pages are gathered
+ * under mm->lock with a reference on their frame, and written once it is
+ * dropped: disk I/O must not run under a spinlock.
+ */
+typedef struct writeback {
+    uint32_t inode;
+    uint32_t index;
+    uint32_t frame;
+    struct writeback* next;
+} writeback_t;
 
 typedef uint32_t page_directory_t[PAGE_DIRECTORY_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
 typedef uint32_t page_table_t[PAGE_TABLE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
@@ -63,11 +134,14 @@ static void m_force_page_fault_ro();
 static void dump_page_table();
 static void test_mem();
 static void test_dynamic_heap_growth();
+static void bench_heap();
 static void test_vmalloc();
 static void K2();
 static void show_user_allocations();
 static void show_kernel_allocations();
+static void show_heap_profile();
 static void test_kmalloc();
+static vmap_area_t* vmap_area_new(uintptr_t start, size_t size);
 void dump_page_directory();
 
 /*############################################################################*/
@@ -76,17 +150,29 @@ void dump_page_directory();
 /*                                                                            */
 /*############################################################################*/
 static page_directory_t page_directory __attribute__((aligned(PAGE_SIZE)));
+/* PAGE_GLOBAL once the CPU supports it, for kernel-only mappings */
+static uint32_t kernel_global;
 
 /* Heap for kmalloc */
-static block_header_t* free_list = NULL;
-static block_header_t* heap_started;
+static uint32_t fl_bitmap;
+static uint32_t sl_bitmap[FL_COUNT];
+static block_header_t* free_blocks[FL_COUNT][SL_COUNT];
+static block_header_t* heap_epilogue;   /* Zero-sized in-use chunk at the top */
 static void* heap_end;
-static size_t HEAP_SIZE;
+static size_t heap_resident;            /* Heap pages backed by a frame */
+static size_t heap_trimmed;             /* Pages handed back to the PMM so far */
 
-/* A separate free list for vmalloc blocks */
-static vblock_header_t* vblock_list = NULL;
-/* Bump pointer for new vmalloc mappings */
-static void* vmalloc_brk;
+/* Virtual ranges of the vmalloc window */
+static vmap_area_t* vmap_free = NULL;
+static vmap_area_t* vmap_busy[VMAP_HASH_SIZE];
+static kmem_cache_t* vmap_cache;
+
+/* Areas of the per-task user windows, and the address spaces holding them */
+static kmem_cache_t* vma_cache;
+static kmem_cache_t* mm_cache;
+static kmem_cache_t* writeback_cache;
+/* TLSF heap, vmalloc space and the kernel page tables behind them */
+static spinlock_t heap_lock = SPINLOCK_INIT;
 
 static command_t commands[] = {
     {"f pfw", "Force a page fault by writing to an unmapped address", m_force_page_fault_write},
@@ -95,11 +181,13 @@ static command_t commands[] = {
     {"dump pd", "Dump page directory", dump_page_directory},
     {"tmem", "Test memory allocation", test_mem},
     {"theap", "Test dynamic heap growth", test_dynamic_heap_growth},
+    {"bheap", "Benchmark kmalloc/kfree against the old first-fit heap", bench_heap},
     {"vmalloc", "Test vmalloc", test_vmalloc},
     {"kmalloc", "Test kmalloc", test_kmalloc},
     {"mem2", "Allocate 2 MB. No Free", K2},
     {"show alloc", "Show allocated memory", show_kernel_allocations},
     {"show user", "Show user allocated memory", show_user_allocations},
+    {"kprof", "Show heap fragmentation and top allocation sites", show_heap_profile},
     {NULL, NULL, NULL}
 };
 
@@ -124,6 +212,11 @@ static void map_page(uintptr_t virt_addr, uint32_t phys_addr, uint32_t flags)
         uint32_t pde_flags = (pt_frame & ~0xFFF) | (flags & PAGE_USER) | PAGE_PRESENT | PAGE_RW;
         page_directory[pd_index] = pde_flags;
     }
+    /* The table may have been created for kernel pages first */
+    page_directory[pd_index] |= flags & PAGE_USER;
+
+    if (page_directory[pd_index] & PAGE_PSE)
+        kernel_panic("map_page: address is inside a 4 MB page!\n");
 
     page_table_t* pt = (page_table_t*)(page_directory[pd_index] & ~0xFFF);
     (*pt)[pt_index] = (phys_addr & ~0xFFF) | (flags & 0xFFF);
@@ -132,14 +225,84 @@ static void map_page(uintptr_t virt_addr, uint32_t phys_addr, uint32_t flags)
     asm volatile("invlpg (%0)" :: "r"(virt_addr) : "memory");
 }
 
-void paging_init()
+/*
+ * Unmapped kernel frames go back to the PMM only once no other CPU can
+ * still reach them through a stale TLB entry: the PTEs are cleared first,
+ * then one shootdown covers the whole batch. The same goes for the user
+ * pages of an address space that threads share, whose frames are dropped
+ * a reference rather than freed.
+ */
+#define UNMAP_BATCH 32
+
+typedef struct unmap_batch
+{
+    uint32_t count;
+    bool user;                  /* Refcounted user frames */
+    uint32_t frames[UNMAP_BATCH];
+} unmap_batch_t;
+
+static void unmap_batch_flush(unmap_batch_t* batch)
+{
+    if (!batch->count)
+        return;
+    smp_flush_tlb_others();
+    while (batch->count)
+    {
+        if (batch->user)
+            frame_ref_dec(batch->frames[--batch->count]);
+        else
+            free_frame(batch->frames[--batch->count]);
+    }
+}
+
+static void unmap_batch_add(unmap_batch_t* batch, uint32_t frame)
+{
+    if (batch->count == UNMAP_BATCH)
+        unmap_batch_flush(batch);
+    batch->frames[batch->count++] = frame;
+}
+
+/**
+ * ioremap:
+ *   Identity maps the device page at 'phys' uncached, for the APICs. Must
+ *   run before the first task directory copies the kernel PDEs.
+ */
+void* ioremap(uint32_t phys)
+{
+    phys &= ~0xFFF;
+    map_page(phys, phys, PAGE_PRESENT | PAGE_RW | PAGE_PCD | PAGE_PWT);
+    return (void*)phys;
+}
+
+/**
+ * paging_init:
+ *   Identity-maps all usable RAM. When the CPU has PSE, every aligned 4 MB
+ *   is a single large-page PDE and only the unaligned tail gets a page
+ *   table. With PGE the direct map is global, so reloading CR3 keeps its
+ *   TLB entries.
+ */
+void paging_init(multiboot_info_t* mbi)
 {
-    pmm_init();
+    uint32_t features = cpuid_features_edx();
+    bool use_pse = (features & CPUID_EDX_PSE) != 0;
+
+    pmm_init(mbi);
     memset(page_directory, 0, sizeof(page_directory));
+    kernel_global = (features & CPUID_EDX_PGE) ? PAGE_GLOBAL : 0;
+    if (use_pse)
+        write_cr4(read_cr4() | CR4_PSE);
 
-    /* Identity-map the first 64MB (4KB per mapping) */
-    const uint32_t IDENTITY_LIMIT = MB(64);
-    for (uintptr_t addr = 0; addr < IDENTITY_LIMIT; addr += 0x1000)
+    const uint32_t IDENTITY_LIMIT = pmm_get_memory_end();
+    uintptr_t addr = 0;
+
+    if (use_pse)
+    {
+        for (; addr + LARGE_PAGE_SIZE <= IDENTITY_LIMIT; addr += LARGE_PAGE_SIZE)
+            page_directory[addr >> 22] = addr | PAGE_PRESENT | PAGE_RW | PAGE_PSE | kernel_global;
+    }
+
+    /* The rest (or everything, without PSE) is mapped 4KB per mapping */
+    for (; addr < IDENTITY_LIMIT; addr += 0x1000)
     {
         uint32_t pd_index = addr >> 22;
         uint32_t pt_index = (addr >> 12) & 0x3FF;
@@ -154,30 +317,64 @@ void paging_init()
         }
 
         page_table_t* table = (page_table_t*)(page_directory[pd_index] & ~0xFFF);
-        (*table)[pt_index] = (addr & ~0xFFF) | (PAGE_PRESENT | PAGE_RW);
+        (*table)[pt_index] = (addr & ~0xFFF) | (PAGE_PRESENT | PAGE_RW) | kernel_global;
+    }
+
+    /*
+     * The heap and vmalloc windows get their page tables now, so the kernel
+     * PDEs every task directory copies never change afterwards.
+     */
+    for (uint32_t pd_index = HEAP_START >> 22; pd_index < (VMALLOC_START + VMALLOC_SIZE) >> 22; pd_index++)
+    {
+        uint32_t pt_phys = allocate_frame();
+        if (!pt_phys) kernel_panic("paging_init: out of frames for PDE\n");
+
+        memset((void*)pt_phys, 0, PAGE_SIZE);
+        page_directory[pd_index] = pt_phys | USER_PDE_FLAGS;
     }
 
     asm volatile("mov %0, %%cr3" :: "r"(page_directory));
 
-    /* Enable paging (set PG bit in CR0) */
+    /* Enable paging (set PG bit in CR0); WP makes copy-on-write fault in ring 0 */
     uint32_t cr0;
     asm volatile("mov %%cr0, %0" : "=r"(cr0));
-    cr0 |= 0x80000000;
+    cr0 |= 0x80000000 | CR0_WP;
     asm volatile("mov %0, %%cr0" :: "r"(cr0));
+
+    /* Global pages can only be turned on once paging is */
+    if (kernel_global)
+        write_cr4(read_cr4() | CR4_PGE);
 }
 
 void heap_init()
 {
     /* Initialize kmalloc heap */
     heap_end = (void*)ALIGN_4K((uintptr_t)HEAP_START);
-    free_list = NULL;
-    heap_started = NULL;
-
-    /* Initialize vmalloc arena */
-    vmalloc_brk = (void*)VMALLOC_START;
-    vblock_list = NULL;
+    heap_epilogue = NULL;
+    heap_resident = 0;
+    heap_trimmed = 0;
+    fl_bitmap = 0;
+    memset(sl_bitmap, 0, sizeof(sl_bitmap));
+    memset(free_blocks, 0, sizeof(free_blocks));
 
     install_all_cmds(commands, MEMORY);
+    kmem_cache_init();
+#ifdef HEAP_PROFILE
+    heap_profile_init();
+#endif
+
+    /* Initialize vmalloc arena: one free extent spanning the window */
+    memset(vmap_busy, 0, sizeof(vmap_busy));
+    vmap_cache = kmem_cache_create("vmap_area", sizeof(vmap_area_t), 0, NULL);
+    vmap_free = vmap_cache ? vmap_area_new(VMALLOC_START, VMALLOC_SIZE) : NULL;
+    if (!vmap_free)
+        kernel_panic("heap_init: cannot set up the vmalloc window!\n");
+
+    vma_cache = kmem_cache_create("vm_area", sizeof(vm_area_t), 0, NULL);
+    mm_cache = kmem_cache_create("mm_t", sizeof(mm_t), 0, NULL);
+    writeback_cache = kmem_cache_create("writeback", sizeof(writeback_t), 0, NULL);
+    if (!vma_cache || !mm_cache || !writeback_cache)
+        kernel_panic("heap_init: cannot create the vm_area cache!\n");
 }
 
 // static void map_page_kernel(uintptr_t virt, uint32_t phys)
@@ -196,16 +393,11 @@ void heap_init()
 /*                                                                            */
 /*############################################################################*/
 
-void* kbrk(void* addr)
+/* Backs every page of [start, end) of the heap that has no frame yet. */
+static void heap_commit(uintptr_t start, uintptr_t end)
 {
-    if ((uintptr_t)addr > HEAP_START + MAX_HEAP_SIZE)
-    {
-        puts_color("WARNING: Heap exceeds maximum limit!\n", RED);
-        return (void*)-1;
-    }
-
-    uint32_t new_heap_end = ALIGN_4K((uintptr_t)addr);
-    uint32_t current_heap_end = ALIGN_4K((uintptr_t)heap_end);
+    uint32_t current_heap_end = start & ~0xFFF;
+    uint32_t new_heap_end = ALIGN_4K(end);
 
     while (current_heap_end < new_heap_end)
     {
@@ -227,310 +419,1604 @@ void* kbrk(void* addr)
             uint32_t phys_frame = allocate_frame();
             if (!phys_frame) kernel_panic("kbrk: Failed to allocate frame!");
 
-            (*table)[pt_index] = phys_frame | (PAGE_PRESENT | PAGE_RW);
+            (*table)[pt_index] = phys_frame | (PAGE_PRESENT | PAGE_RW) | kernel_global;
+            heap_resident++;
         }
 
         current_heap_end += PAGE_SIZE;
     }
+}
+
+/* Gives the frames behind the whole pages of [start, end) back to the PMM. */
+static void heap_decommit(uintptr_t start, uintptr_t end)
+{
+    unmap_batch_t batch;
+    uintptr_t va;
+
+    batch.count = 0;
+    batch.user = false;
+    for (va = ALIGN_4K(start); va + PAGE_SIZE <= end; va += PAGE_SIZE)
+    {
+        uint32_t pde = page_directory[va >> 22];
+        page_table_t* table;
+        uint32_t* pte;
+
+        if (!(pde & PAGE_PRESENT))
+            continue;
+        table = (page_table_t*)(pde & ~0xFFF);
+        pte = &(*table)[(va >> 12) & 0x3FF];
+        if (!(*pte & PAGE_PRESENT))
+            continue;
+
+        unmap_batch_add(&batch, *pte & ~0xFFF);
+        *pte = 0;
+        asm volatile("invlpg (%0)" :: "r"(va) : "memory");
+        heap_resident--;
+        heap_trimmed++;
+    }
+    unmap_batch_flush(&batch);
+}
+
+/**
+ * kbrk:
+ *   Moves the end of the heap to 'addr'. Growing maps fresh frames,
+ *   shrinking unmaps the pages above the new end and frees their frames.
+ */
+void* kbrk(void* addr)
+{
+    if ((uintptr_t)addr > HEAP_START + MAX_HEAP_SIZE || (uintptr_t)addr < HEAP_START)
+    {
+        puts_color("WARNING: Heap exceeds maximum limit!\n", RED);
+        return (void*)-1;
+    }
+
+    uint32_t new_heap_end = ALIGN_4K((uintptr_t)addr);
+    uint32_t current_heap_end = ALIGN_4K((uintptr_t)heap_end);
+
+    if (new_heap_end < current_heap_end)
+        heap_decommit(new_heap_end, current_heap_end);
+    else
+        heap_commit(current_heap_end, new_heap_end);
 
     heap_end = (void*)new_heap_end;
     return heap_end;
 }
 
-void* kmalloc(size_t size)
+static inline uint32_t bit_fls(uint32_t x)
 {
-    size = ALIGN_8(size);
-    block_header_t* current = free_list;
-    block_header_t* prev = NULL;
+    return 31 - __builtin_clz(x);
+}
 
-    while (current)
+static inline uint32_t bit_ffs(uint32_t x)
+{
+    return __builtin_ctz(x);
+}
+
+/* Free-list indices of the class that holds chunks of exactly 'size'. */
+static void mapping_insert(size_t size, uint32_t* fl, uint32_t* sl)
+{
+    uint32_t f;
+
+    if (size < SMALL_BLOCK_SIZE)
     {
-        if (current->free && current->size >= size)
+        *fl = 0;
+        *sl = size / (SMALL_BLOCK_SIZE / SL_COUNT);
+        return;
+    }
+    f = bit_fls(size);
+    *sl = (size >> (f - SL_INDEX_LOG2)) ^ SL_COUNT;
+    *fl = f - (FL_SHIFT - 1);
+}
+
+/* Same, rounded up to the next class so any chunk found there is big enough. */
+static void mapping_search(size_t size, uint32_t* fl, uint32_t* sl)
+{
+    if (size >= SMALL_BLOCK_SIZE)
+        size += (1 << (bit_fls(size) - SL_INDEX_LOG2)) - 1;
+    mapping_insert(size, fl, sl);
+}
+
+static void free_block_insert(block_header_t* block)
+{
+    uint32_t fl;
+    uint32_t sl;
+
+    mapping_insert(BLOCK_SIZE(block), &fl, &sl);
+    block->prev_free = NULL;
+    block->next_free = free_blocks[fl][sl];
+    if (block->next_free)
+        block->next_free->prev_free = block;
+    free_blocks[fl][sl] = block;
+    fl_bitmap |= 1U << fl;
+    sl_bitmap[fl] |= 1U << sl;
+}
+
+static void free_block_remove(block_header_t* block)
+{
+    uint32_t fl;
+    uint32_t sl;
+
+    mapping_insert(BLOCK_SIZE(block), &fl, &sl);
+    if (block->prev_free)
+        block->prev_free->next_free = block->next_free;
+    else
+        free_blocks[fl][sl] = block->next_free;
+    if (block->next_free)
+        block->next_free->prev_free = block->prev_free;
+
+    if (!free_blocks[fl][sl])
+    {
+        sl_bitmap[fl] &= ~(1U << sl);
+        if (!sl_bitmap[fl])
+            fl_bitmap &= ~(1U << fl);
+    }
+}
+
+/* Two bitmap scans: first in the requested first level, then above it. */
+static block_header_t* free_block_find(size_t size)
+{
+    uint32_t fl;
+    uint32_t sl;
+    uint32_t map;
+
+    mapping_search(size, &fl, &sl);
+    if (fl >= FL_COUNT)
+        return NULL;
+
+    map = sl_bitmap[fl] & (~0U << sl);
+    if (!map)
+    {
+        map = fl + 1 < FL_COUNT ? fl_bitmap & (~0U << (fl + 1)) : 0;
+        if (!map)
+            return NULL;
+        fl = bit_ffs(map);
+        map = sl_bitmap[fl];
+    }
+    sl = bit_ffs(map);
+    return free_blocks[fl][sl];
+}
+
+/**
+ * block_release:
+ *   Marks an in-use chunk free and merges it with its physical neighbours
+ *   in O(1): the next chunk is found from our size, the previous one from
+ *   the boundary tag we carry. Returns the merged chunk, already listed.
+ */
+static block_header_t* block_release(block_header_t* block)
+{
+    block_header_t* next = BLOCK_NEXT(block);
+    size_t size = BLOCK_SIZE(block);
+
+    if (next->size & BLOCK_FREE)
+    {
+        free_block_remove(next);
+        size += BLOCK_SIZE(next);
+    }
+    if (block->size & BLOCK_PREV_FREE)
+    {
+        block = BLOCK_PREV(block);
+        free_block_remove(block);
+        size += BLOCK_SIZE(block);
+    }
+
+    /* Free chunks never touch, so the one before us is in use. */
+    block->size = size | BLOCK_FREE;
+    next = BLOCK_NEXT(block);
+    next->prev_size = size;
+    next->size |= BLOCK_PREV_FREE;
+
+    free_block_insert(block);
+    return block;
+}
+
+/* Takes 'size' bytes off the front of an unlisted free chunk. */
+static void block_use(block_header_t* block, size_t size)
+{
+    size_t remainder = BLOCK_SIZE(block) - size;
+    block_header_t* rest;
+
+    if (remainder >= BLOCK_MIN_SIZE)
+    {
+        block->size = size | (block->size & BLOCK_PREV_FREE);
+        rest = BLOCK_NEXT(block);
+        rest->size = remainder | BLOCK_FREE;
+        BLOCK_NEXT(rest)->prev_size = remainder;
+        free_block_insert(rest);
+        return;
+    }
+
+    block->size &= ~BLOCK_FREE;
+    BLOCK_NEXT(block)->size &= ~BLOCK_PREV_FREE;
+}
+
+/**
+ * heap_grow:
+ *   Extends the heap with kbrk() so that a free chunk of at least 'size'
+ *   bytes ends at the top. The old epilogue becomes the header of the new
+ *   chunk and a fresh zero-sized epilogue is written at the new end.
+ */
+static block_header_t* heap_grow(size_t size)
+{
+    block_header_t* block;
+    uintptr_t limit = HEAP_START + MAX_HEAP_SIZE;
+    uintptr_t new_end;
+    size_t prev_free = 0;
+
+    if (heap_epilogue)
+    {
+        block = heap_epilogue;
+        prev_free = block->size & BLOCK_PREV_FREE;
+        /* A free chunk at the top only needs topping up. */
+        if (prev_free)
         {
-            current->free = 0;
-            /* Split block if there is extra space for a new block header plus minimal payload */
-            if (current->size > size + sizeof(block_header_t) + 8)
-            {
-                block_header_t* new_block = (block_header_t*)((uintptr_t)current + sizeof(block_header_t) + size);
-                new_block->size = current->size - size - sizeof(block_header_t);
-                new_block->free = 1;
-                new_block->next = current->next;
-                current->size = size;
-                current->next = new_block;
-            }
-            return (void*)((uintptr_t)current + sizeof(block_header_t));
+            if (block->prev_size >= size)
+                return BLOCK_PREV(block);
+            size -= block->prev_size;
         }
-        prev = current;
-        current = current->next;
+    }
+    else
+    {
+        block = (block_header_t*)HEAP_START;
     }
 
-    /* No free block found; expand the heap */
-    uintptr_t old_end = (uintptr_t)heap_end;
-    size_t new_size = size + sizeof(block_header_t);
-    uintptr_t new_heap_end = (uintptr_t)heap_end + new_size;
-    if (new_heap_end > HEAP_START + MAX_HEAP_SIZE)
+    if ((uintptr_t)block + size + BLOCK_OVERHEAD > limit)
     {
         puts_color("kmalloc: Out of memory (heap expansion)!\n", RED);
         return NULL;
     }
+    new_end = ALIGN_4K((uintptr_t)block + (size < HEAP_GROW_MIN ? HEAP_GROW_MIN : size) + BLOCK_OVERHEAD);
+    if (new_end > limit)
+        new_end = limit;
 
-    if (kbrk((void*)new_heap_end) == (void*)-1)
+    if (kbrk((void*)new_end) == (void*)-1)
     {
         puts_color("kmalloc: Failed to expand heap!\n", RED);
         return NULL;
     }
 
-    block_header_t* new_block = (block_header_t*)old_end;
-    new_block->size = size;
-    new_block->free = 0;
-    new_block->next = NULL;
+    block->size = (new_end - BLOCK_OVERHEAD - (uintptr_t)block) | prev_free;
+    heap_epilogue = (block_header_t*)(new_end - BLOCK_OVERHEAD);
+    heap_epilogue->size = 0;
 
-    if (prev)
-        prev->next = new_block;
+    return block_release(block);
+}
+
+/**
+ * heap_trim:
+ *   Hands the pages of a large, just released chunk back to the PMM. A
+ *   free top is cut off with kbrk() down to HEAP_TRIM_PAD; anywhere else
+ *   only the whole pages past the chunk header are unmapped, and the chunk
+ *   stays listed. Allocation maps them again through heap_commit().
+ */
+static void heap_trim(block_header_t* block)
+{
+    uintptr_t start = (uintptr_t)block;
+    uintptr_t end = start + BLOCK_SIZE(block);
+    uintptr_t new_end;
+
+    if (BLOCK_SIZE(block) < HEAP_TRIM_THRESHOLD)
+        return;
+
+    if ((block_header_t*)end == heap_epilogue)
+    {
+        new_end = ALIGN_4K(start + HEAP_TRIM_PAD + BLOCK_OVERHEAD);
+        /* The new epilogue may land on a page unmapped by an earlier trim */
+        heap_commit(start, new_end);
+
+        free_block_remove(block);
+        block->size = (new_end - BLOCK_OVERHEAD - start) | (block->size & BLOCK_FLAGS);
+        heap_epilogue = (block_header_t*)(new_end - BLOCK_OVERHEAD);
+        heap_epilogue->prev_size = BLOCK_SIZE(block);
+        heap_epilogue->size = BLOCK_PREV_FREE;
+        free_block_insert(block);
+
+        kbrk((void*)new_end);
+        return;
+    }
+
+    /* The header and list links stay mapped, and so does the next header */
+    heap_decommit(start + sizeof(block_header_t), end);
+}
+
+/* Maps back what heap_trim() took from the first 'used' bytes of a free
+ * chunk, plus the header block_use() writes after them. */
+static void heap_commit_chunk(block_header_t* block, size_t used)
+{
+    uintptr_t end = (uintptr_t)block + used + BLOCK_MIN_SIZE;
+
+    if (end > (uintptr_t)BLOCK_NEXT(block))
+        end = (uintptr_t)BLOCK_NEXT(block);
+    heap_commit((uintptr_t)block, end);
+}
+
+/* Good-fit allocation from the segregated lists, O(1) in the heap size. */
+static void* heap_alloc(size_t size)
+{
+    block_header_t* block;
+
+    if (size > MAX_HEAP_SIZE)
+        return NULL;
+    size = ALIGN_8(size) + BLOCK_OVERHEAD;
+    if (size < BLOCK_MIN_SIZE)
+        size = BLOCK_MIN_SIZE;
+
+    block = free_block_find(size);
+    if (!block)
+    {
+        block = heap_grow(size);
+        if (!block || BLOCK_SIZE(block) < size)
+            return NULL;
+    }
+
+    free_block_remove(block);
+    heap_commit_chunk(block, size);
+    block_use(block, size);
+    return BLOCK_PAYLOAD(block);
+}
+
+/*
+ * Like heap_alloc(), but the payload starts on an 'align' boundary. The
+ * chunk is found with enough slack to slide the payload up, and the
+ * slack in front is split off as a free chunk of its own, so nothing
+ * is lost beyond the usual rounding.
+ */
+static void* heap_alloc_aligned(size_t size, size_t align)
+{
+    block_header_t* block;
+    block_header_t* aligned;
+    uintptr_t payload;
+    size_t gap;
+
+    if (size > MAX_HEAP_SIZE || align > MAX_HEAP_SIZE)
+        return NULL;
+    size = ALIGN_8(size) + BLOCK_OVERHEAD;
+    if (size < BLOCK_MIN_SIZE)
+        size = BLOCK_MIN_SIZE;
+
+    block = free_block_find(size + align + BLOCK_MIN_SIZE);
+    if (!block)
+    {
+        block = heap_grow(size + align + BLOCK_MIN_SIZE);
+        if (!block || BLOCK_SIZE(block) < size + align + BLOCK_MIN_SIZE)
+            return NULL;
+    }
+    free_block_remove(block);
+
+    /* A gap in front must be able to hold a free chunk header */
+    payload = ALIGN_UP((uintptr_t)BLOCK_PAYLOAD(block), align);
+    if (payload != (uintptr_t)BLOCK_PAYLOAD(block) && payload - (uintptr_t)BLOCK_PAYLOAD(block) < BLOCK_MIN_SIZE)
+        payload = ALIGN_UP((uintptr_t)BLOCK_PAYLOAD(block) + BLOCK_MIN_SIZE, align);
+    gap = payload - (uintptr_t)BLOCK_PAYLOAD(block);
+    heap_commit_chunk(block, gap + size);
+
+    if (gap)
+    {
+        aligned = (block_header_t*)((uintptr_t)block + gap);
+        aligned->size = (BLOCK_SIZE(block) - gap) | BLOCK_FREE | BLOCK_PREV_FREE;
+        aligned->prev_size = gap;
+        block->size = gap | BLOCK_FREE | (block->size & BLOCK_PREV_FREE);
+        free_block_insert(block);
+        block = aligned;
+    }
+
+    block_use(block, size);
+    return BLOCK_PAYLOAD(block);
+}
+
+static void heap_free(void* ptr)
+{
+    block_header_t* block = PAYLOAD_BLOCK(ptr);
+
+    if (!heap_epilogue || block >= heap_epilogue || (block->size & BLOCK_FREE))
+    {
+        puts_color("kfree: invalid or double free!\n", RED);
+        return;
+    }
+    heap_trim(block_release(block));
+}
+
+void* kmalloc(size_t size)
+{
+    uint32_t flags;
+    void* ptr;
+
+    /* Small objects come from the slab size classes in O(1) */
+    if (size <= KMALLOC_MAX_CACHE_SIZE)
+        ptr = kmalloc_small(size);
     else
     {
-        free_list = new_block;
-        heap_started = free_list;
+        flags = spin_lock_irqsave(&heap_lock);
+        ptr = heap_alloc(size);
+        spin_unlock_irqrestore(&heap_lock, flags);
     }
+    HEAP_PROFILE_ALLOC(ptr, size);
+    return ptr;
+}
+
+/**
+ * kmalloc_aligned:
+ *   kmalloc() whose result is a multiple of 'align', a power of two.
+ *   The pointer is freed with kfree() as usual.
+ */
+void* kmalloc_aligned(size_t size, size_t align)
+{
+    uint32_t flags;
+    void* ptr;
 
-    return (void*)((uintptr_t)new_block + sizeof(block_header_t));
+    if (!align || (align & (align - 1)))
+        return NULL;
+    /* Every allocator already gives 8-byte alignment */
+    if (align <= 8 && size <= KMALLOC_MAX_CACHE_SIZE)
+        ptr = kmalloc_small(size);
+    else
+    {
+        flags = spin_lock_irqsave(&heap_lock);
+        ptr = align > 8 ? heap_alloc_aligned(size, align) : heap_alloc(size);
+        spin_unlock_irqrestore(&heap_lock, flags);
+    }
+    HEAP_PROFILE_ALLOC(ptr, size);
+    return ptr;
 }
 
 void kfree(void* ptr)
 {
+    uint32_t flags;
+
     if (!ptr) return;
-    block_header_t* block = (block_header_t*)((uintptr_t)ptr - sizeof(block_header_t));
-    block->free = 1;
+    if ((uintptr_t)ptr < HEAP_START)
+    {
+        HEAP_PROFILE_FREE(ptr);
+        kfree_small(ptr);
+    }
+    /* Stacks may come from either allocator; let kfree() take both. */
+    else if ((uintptr_t)ptr >= VMALLOC_START)
+    {
+        vfree(ptr);
+    }
+    else
+    {
+        HEAP_PROFILE_FREE(ptr);
+        flags = spin_lock_irqsave(&heap_lock);
+        heap_free(ptr);
+        spin_unlock_irqrestore(&heap_lock, flags);
+    }
+}
+
+size_t ksize(void* ptr)
+{
+    if (!ptr) return 0;
+    if ((uintptr_t)ptr < HEAP_START)
+        return ksize_small(ptr);
+    if ((uintptr_t)ptr >= VMALLOC_START)
+        return vsize(ptr);
+
+    return BLOCK_SIZE(PAYLOAD_BLOCK(ptr)) - BLOCK_OVERHEAD;
+}
+
+/*
+ * Non-zero when [ptr, ptr + len) lies in the kmalloc heap or the vmalloc
+ * window, where an allocation stays mapped until it is freed. memcpy()
+ * only uses SSE there: a copy that faults must not hold the FPU.
+ */
+int is_heap_range(const void* ptr, size_t len)
+{
+    uintptr_t start = (uintptr_t)ptr;
+
+    return start >= HEAP_START && start + len >= start
+        && start + len <= VMALLOC_START + VMALLOC_SIZE;
+}
+
+/**
+ * alloc_pages_contig:
+ *   'count' physically contiguous, zeroed pages, reached through the direct
+ *   map so the pointer is also the physical address. The buddy block is
+ *   rounded up to a power of two and the pages past 'count' are given back.
+ */
+void* alloc_pages_contig(size_t count)
+{
+    uint32_t order = 0;
+    uint32_t phys;
+
+    if (!count)
+        return NULL;
+    while ((1U << order) < count)
+        order++;
+
+    phys = alloc_frames(order);
+    if (!phys)
+        return NULL;
+    for (uint32_t i = count; i < (1U << order); i++)
+        free_frames(phys + i * PAGE_SIZE, 0);
+
+    memset((void*)phys, 0, count * PAGE_SIZE);
+    return (void*)phys;
+}
+
+void free_pages_contig(void* ptr, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        free_frames((uint32_t)ptr + i * PAGE_SIZE, 0);
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           VMALLOC                                          */
+/*                                                                            */
+/*############################################################################*/
+
+static vmap_area_t* vmap_area_new(uintptr_t start, size_t size)
+{
+    vmap_area_t* area = kmem_cache_alloc(vmap_cache);
+
+    if (!area)
+        return NULL;
+    area->start = start;
+    area->size = size;
+    area->va_size = size;
+    area->is_user = 0;
+    area->next = NULL;
+    return area;
+}
+
+/* First fit by address over the sorted free extents. */
+static vmap_area_t* vmap_alloc_va(size_t size)
+{
+    vmap_area_t* current = vmap_free;
+    vmap_area_t* prev = NULL;
+    vmap_area_t* area;
+
+    while (current && current->size < size)
+    {
+        prev = current;
+        current = current->next;
+    }
+    if (!current)
+        return NULL;
+
+    if (current->size == size)
+    {
+        if (prev)
+            prev->next = current->next;
+        else
+            vmap_free = current->next;
+        current->va_size = size;
+        current->next = NULL;
+        return current;
+    }
+
+    area = vmap_area_new(current->start, size);
+    if (!area)
+        return NULL;
+    current->start += size;
+    current->size -= size;
+    return area;
+}
+
+/* Carves exactly [start, start + size) out of the free extents. */
+static vmap_area_t* vmap_reserve_va(uintptr_t start, size_t size)
+{
+    vmap_area_t* current = vmap_free;
+    vmap_area_t* prev = NULL;
+    vmap_area_t* area;
+    vmap_area_t* tail;
+    uintptr_t end = start + size;
+    size_t head_size;
+    size_t tail_size;
+
+    while (current && current->start + current->size < end)
+    {
+        prev = current;
+        current = current->next;
+    }
+    if (!current || current->start > start)
+        return NULL;
+
+    area = vmap_area_new(start, size);
+    if (!area)
+        return NULL;
+
+    head_size = start - current->start;
+    tail_size = current->start + current->size - end;
+    if (head_size && tail_size)
+    {
+        tail = vmap_area_new(end, tail_size);
+        if (!tail)
+        {
+            kmem_cache_free(vmap_cache, area);
+            return NULL;
+        }
+        tail->next = current->next;
+        current->next = tail;
+        current->size = head_size;
+    }
+    else if (head_size)
+    {
+        current->size = head_size;
+    }
+    else if (tail_size)
+    {
+        current->start = end;
+        current->size = tail_size;
+    }
+    else
+    {
+        if (prev)
+            prev->next = current->next;
+        else
+            vmap_free = current->next;
+        kmem_cache_free(vmap_cache, current);
+    }
+    return area;
+}
+
+/* Puts a range back in address order and merges it with its neighbours. */
+static void vmap_free_va(vmap_area_t* area)
+{
+    vmap_area_t* current = vmap_free;
+    vmap_area_t* prev = NULL;
+    vmap_area_t* next;
+
+    area->size = area->va_size;
+    while (current && current->start < area->start)
+    {
+        prev = current;
+        current = current->next;
+    }
+
+    area->next = current;
+    if (prev)
+        prev->next = area;
+    else
+        vmap_free = area;
+
+    next = area->next;
+    if (next && area->start + area->size == next->start)
+    {
+        area->size += next->size;
+        area->next = next->next;
+        kmem_cache_free(vmap_cache, next);
+    }
+    if (prev && prev->start + prev->size == area->start)
+    {
+        prev->size += area->size;
+        prev->next = area->next;
+        kmem_cache_free(vmap_cache, area);
+    }
+}
+
+static inline uint32_t vmap_hash(uintptr_t start)
+{
+    return (start / PAGE_SIZE) % VMAP_HASH_SIZE;
+}
+
+static void vmap_busy_insert(vmap_area_t* area)
+{
+    uint32_t bucket = vmap_hash(area->start);
+
+    area->next = vmap_busy[bucket];
+    vmap_busy[bucket] = area;
+}
+
+/* Unlinks and returns the busy area starting at 'start', if any. */
+static vmap_area_t* vmap_busy_remove(uintptr_t start)
+{
+    vmap_area_t** link = &vmap_busy[vmap_hash(start)];
+    vmap_area_t* area;
+
+    for (area = *link; area; link = &area->next, area = area->next)
+    {
+        if (area->start == start)
+        {
+            *link = area->next;
+            return area;
+        }
+    }
+    return NULL;
+}
+
+static vmap_area_t* vmap_busy_find(uintptr_t start)
+{
+    vmap_area_t* area;
+
+    for (area = vmap_busy[vmap_hash(start)]; area; area = area->next)
+    {
+        if (area->start == start)
+            return area;
+    }
+    return NULL;
+}
+
+/* Clears a PTE; its frame goes back to the PMM with the batch. */
+static void unmap_page(unmap_batch_t* batch, uintptr_t virt_addr)
+{
+    uint32_t pd_index = virt_addr >> 22;
+    uint32_t pt_index = (virt_addr >> 12) & 0x3FF;
+    page_table_t* pt;
+
+    if (!(page_directory[pd_index] & PAGE_PRESENT))
+        return;
+
+    pt = (page_table_t*)(page_directory[pd_index] & ~0xFFF);
+    if ((*pt)[pt_index] & PAGE_PRESENT)
+        unmap_batch_add(batch, (*pt)[pt_index] & ~0xFFF);
+    (*pt)[pt_index] = 0;
+    asm volatile("invlpg (%0)" :: "r"(virt_addr) : "memory");
+}
+
+static void vmap_unmap(uintptr_t start, size_t size)
+{
+    unmap_batch_t batch;
+
+    batch.count = 0;
+    batch.user = false;
+    for (uintptr_t va = start; va < start + size; va += PAGE_SIZE)
+        unmap_page(&batch, va);
+    unmap_batch_flush(&batch);
+}
+
+/* Backs [start, start + size) with frames, which need not be contiguous. */
+static int vmap_map(uintptr_t start, size_t size, uint32_t flags)
+{
+    uint32_t frame;
+
+    for (uintptr_t va = start; va < start + size; va += PAGE_SIZE)
+    {
+        frame = allocate_frame();
+        if (!frame)
+        {
+            vmap_unmap(start, va - start);
+            return -1;
+        }
+        map_page(va, frame, flags);
+    }
+    return 0;
+}
+
+/**
+ * vmalloc:
+ *   Reserves page-aligned virtual space in the vmalloc window, followed by
+ *   an unmapped guard page, and maps a fresh frame behind every page.
+ *   Nothing is carved from the kmalloc heap, so the size is only bounded
+ *   by VMALLOC_SIZE and free frames.
+ */
+void* vmalloc(size_t size, int is_user)
+{
+    vmap_area_t* area;
+    uint32_t flags = PAGE_PRESENT | PAGE_RW;
+    uint32_t irq_flags;
+
+    if (!size || size > VMALLOC_SIZE)
+        return NULL;
+    size = ALIGN_4K(size);
+
+    irq_flags = spin_lock_irqsave(&heap_lock);
+    area = vmap_alloc_va(size + PAGE_SIZE);
+    if (!area)
+    {
+        spin_unlock_irqrestore(&heap_lock, irq_flags);
+        puts_color("vmalloc: Out of vmalloc space!\n", RED);
+        return NULL;
+    }
+    area->size = size;
+    area->is_user = is_user;
+
+    if (is_user)
+        flags |= PAGE_USER;
+    if (vmap_map(area->start, size, flags) < 0)
+    {
+        puts_color("vmalloc: Out of physical frames!\n", RED);
+        vmap_free_va(area);
+        spin_unlock_irqrestore(&heap_lock, irq_flags);
+        return NULL;
+    }
+
+    vmap_busy_insert(area);
+    spin_unlock_irqrestore(&heap_lock, irq_flags);
+    HEAP_PROFILE_ALLOC((void*)area->start, size);
+    return (void*)area->start;
+}
+
+void vfree(void* ptr)
+{
+    vmap_area_t* area;
+    uint32_t flags;
+
+    if (!ptr) return;
+    HEAP_PROFILE_FREE(ptr);
+    flags = spin_lock_irqsave(&heap_lock);
+    area = vmap_busy_remove((uintptr_t)ptr);
+    if (area)
+    {
+        vmap_unmap(area->start, area->size);
+        vmap_free_va(area);
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
+    if (!area)
+        puts_color("vfree: not a vmalloc address!\n", RED);
+}
+
+size_t vsize(void* ptr)
+{
+    vmap_area_t* area;
+    uint32_t flags;
+    size_t size;
+
+    if (!ptr) return 0;
+    flags = spin_lock_irqsave(&heap_lock);
+    area = vmap_busy_find((uintptr_t)ptr);
+    size = area ? area->size : 0;
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return size;
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           ADDRESS SPACES                                   */
+/*                                                                            */
+/*############################################################################*/
+
+/*
+ * Every task has its own page directory. All PDEs outside the user window
+ * are copied from the kernel directory and point at the same page tables,
+ * which are all created at boot, so kernel mappings are shared for free.
+ * The user window [USER_SPACE_START, USER_SPACE_END) is private.
+ */
+#define USER_PDE_START  (USER_SPACE_START >> 22)
+#define USER_PDE_END    (USER_SPACE_END >> 22)
+
+static inline bool is_user_pde(uint32_t pd_index)
+{
+    return pd_index >= USER_PDE_START && pd_index < USER_PDE_END;
+}
+
+static inline uint32_t read_cr3()
+{
+    uint32_t cr3;
+
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+uint32_t vmm_kernel_directory()
+{
+    return (uint32_t)page_directory;
+}
+
+uint32_t vmm_create_directory()
+{
+    uint32_t* dir = (uint32_t*)allocate_frame();
+
+    if (!dir)
+        return 0;
+    for (uint32_t i = 0; i < PAGE_DIRECTORY_ENTRIES; i++)
+        dir[i] = is_user_pde(i) ? 0 : page_directory[i];
+    return (uint32_t)dir;
+}
+
+/* PTE slot of a user address, creating its page table when asked to. */
+static uint32_t* user_pte(uint32_t dir, uintptr_t va, bool create)
+{
+    uint32_t* pd = (uint32_t*)dir;
+    uint32_t pd_index = va >> 22;
+    uint32_t pt_phys;
+
+    if (!is_user_pde(pd_index))
+        return NULL;
+    if (!(pd[pd_index] & PAGE_PRESENT))
+    {
+        if (!create)
+            return NULL;
+        pt_phys = allocate_frame();
+        if (!pt_phys)
+            return NULL;
+        memset((void*)pt_phys, 0, PAGE_SIZE);
+        pd[pd_index] = pt_phys | USER_PDE_FLAGS;
+    }
+    return &((uint32_t*)(pd[pd_index] & ~0xFFF))[(va >> 12) & 0x3FF];
+}
+
+/* Installs 'frame' at 'va' of 'dir'; the mapping owns one frame reference. */
+static int vmm_map_user_frame(uint32_t dir, uintptr_t va, uint32_t frame, uint32_t flags)
+{
+    uint32_t* pte = user_pte(dir, va, true);
+
+    if (!pte || (*pte & PAGE_PRESENT))
+        return -1;
+    *pte = frame | (flags & 0xFFF) | PAGE_PRESENT | PAGE_USER;
+    if (dir == read_cr3())
+        asm volatile("invlpg (%0)" :: "r"(va) : "memory");
+    return 0;
+}
+
+/**
+ * vmm_map_user_page:
+ *   Backs a user page of 'dir' with a zeroed frame.
+ *   Returns the frame, reachable through the direct map, or 0.
+ */
+uint32_t vmm_map_user_page(uint32_t dir, uintptr_t va, uint32_t flags)
+{
+    uint32_t frame = allocate_frame();
+
+    if (!frame)
+        return 0;
+    memset((void*)frame, 0, PAGE_SIZE);
+    if (vmm_map_user_frame(dir, va, frame, flags) < 0)
+    {
+        free_frame(frame);
+        return 0;
+    }
+    return frame;
+}
+
+void vmm_unmap_user_page(uint32_t dir, uintptr_t va)
+{
+    uint32_t* pte = user_pte(dir, va, false);
+
+    if (!pte || !(*pte & PAGE_PRESENT))
+        return;
+    frame_ref_dec(*pte & ~0xFFF);
+    *pte = 0;
+    if (dir == read_cr3())
+        asm volatile("invlpg (%0)" :: "r"(va) : "memory");
+}
+
+/* Physical address behind 'va' in 'dir', or 0 when unmapped. */
+uint32_t vmm_virt_to_phys(uint32_t dir, uintptr_t va)
+{
+    uint32_t pde = ((uint32_t*)dir)[va >> 22];
+    uint32_t pte;
+
+    if (!(pde & PAGE_PRESENT))
+        return 0;
+    if (pde & PAGE_PSE)
+        return (pde & ~(LARGE_PAGE_SIZE - 1)) | (va & (LARGE_PAGE_SIZE - 1));
+    pte = ((uint32_t*)(pde & ~0xFFF))[(va >> 12) & 0x3FF];
+    if (!(pte & PAGE_PRESENT))
+        return 0;
+    return (pte & ~0xFFF) | (va & 0xFFF);
+}
+
+/* Physical address of any kernel pointer, or 0 when it is not mapped. */
+uint32_t virt_to_phys(const void* ptr)
+{
+    uintptr_t va = (uintptr_t)ptr;
+
+    if (va < pmm_get_memory_end())
+        return va;
+    return vmm_virt_to_phys(read_cr3(), va);
+}
+
+/**
+ * vmm_clone_directory:
+ *   Duplicates the user window of 'src' for fork(). Pages inside
+ *   [copy_start, copy_end) - the live stack, which the CPU writes while
+ *   handling faults - are copied right away. Every other page is shared
+ *   read-only with PAGE_COW in both directories and one more frame
+ *   reference, so the cost does not depend on how much the parent maps.
+ */
+uint32_t vmm_clone_directory(uint32_t src, uintptr_t copy_start, uintptr_t copy_end)
+{
+    uint32_t* src_pd = (uint32_t*)src;
+    uint32_t dst = vmm_create_directory();
+    uint32_t* src_pt;
+    uint32_t* dst_pt;
+    uint32_t frame;
+    uintptr_t va;
+
+    if (!dst)
+        return 0;
+
+    for (uint32_t i = USER_PDE_START; i < USER_PDE_END; i++)
+    {
+        if (!(src_pd[i] & PAGE_PRESENT))
+            continue;
+        src_pt = (uint32_t*)(src_pd[i] & ~0xFFF);
+        dst_pt = (uint32_t*)allocate_frame();
+        if (!dst_pt)
+        {
+            vmm_destroy_directory(dst);
+            return 0;
+        }
+        memset(dst_pt, 0, PAGE_SIZE);
+        ((uint32_t*)dst)[i] = (uint32_t)dst_pt | (src_pd[i] & 0xFFF);
+
+        for (uint32_t j = 0; j < PAGE_TABLE_ENTRIES; j++)
+        {
+            if (!(src_pt[j] & PAGE_PRESENT))
+                continue;
+            va = (i << 22) | (j << 12);
+            if (va >= copy_start && va < copy_end)
+            {
+                frame = allocate_frame();
+                if (!frame)
+                {
+                    vmm_destroy_directory(dst);
+                    return 0;
+                }
+                memcpy((void*)frame, (void*)(src_pt[j] & ~0xFFF), PAGE_SIZE);
+                dst_pt[j] = frame | (src_pt[j] & 0xFFF);
+                continue;
+            }
+            if ((src_pt[j] & (PAGE_RW | PAGE_SHARED)) == PAGE_RW)
+                src_pt[j] = (src_pt[j] & ~PAGE_RW) | PAGE_COW;
+            dst_pt[j] = src_pt[j];
+            frame_ref_inc(src_pt[j] & ~0xFFF);
+        }
+    }
+
+    /* User pages are not global: reloading CR3 drops the stale RW entries */
+    if (src == read_cr3())
+        asm volatile("mov %0, %%cr3" :: "r"(src) : "memory");
+    return dst;
+}
+
+/* Releases the user window of 'dir', its page tables and the directory. */
+void vmm_destroy_directory(uint32_t dir)
+{
+    uint32_t* pd = (uint32_t*)dir;
+    uint32_t* pt;
+
+    if (!dir || dir == (uint32_t)page_directory)
+        return;
+
+    for (uint32_t i = USER_PDE_START; i < USER_PDE_END; i++)
+    {
+        if (!(pd[i] & PAGE_PRESENT))
+            continue;
+        pt = (uint32_t*)(pd[i] & ~0xFFF);
+        for (uint32_t j = 0; j < PAGE_TABLE_ENTRIES; j++)
+        {
+            if (pt[j] & PAGE_PRESENT)
+                frame_ref_dec(pt[j] & ~0xFFF);
+        }
+        free_frame((uint32_t)pt);
+    }
+    free_frame(dir);
+}
+
+/**
+ * vmm_handle_cow:
+ *   Called on a write fault. If the page is copy-on-write, the faulting
+ *   task gets a private copy (or keeps the frame when it is the last
+ *   sharer) and 1 is returned so the write can be retried.
+ */
+static int vmm_handle_cow(uint32_t dir, uintptr_t addr)
+{
+    uint32_t* pte = user_pte(dir, addr, false);
+    uint32_t old_frame;
+    uint32_t frame;
+
+    if (!pte || (*pte & (PAGE_PRESENT | PAGE_COW)) != (PAGE_PRESENT | PAGE_COW))
+        return 0;
+
+    old_frame = *pte & ~0xFFF;
+    if (frame_ref_count(old_frame) > 1)
+    {
+        frame = allocate_frame();
+        if (!frame)
+            return 0;
+        memcpy((void*)frame, (void*)old_frame, PAGE_SIZE);
+        *pte = frame | (*pte & 0xFFF);
+        frame_ref_dec(old_frame);
+    }
+    *pte = (*pte | PAGE_RW) & ~PAGE_COW;
+    asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
+    return 1;
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           VIRTUAL MEMORY AREAS                             */
+/*                                                                            */
+/*############################################################################*/
+
+/*
+ * The user window is described by each task's VMA list rather than by its
+ * page tables: mmap() only records a range, and frames are handed out one
+ * page at a time by the page fault handler on first touch.
+ */
+#define USER_MMAP_END   (USER_STACK_TOP - USER_STACK_MAX)
+
+static vm_area_t* vma_new(uintptr_t start, uintptr_t end, uint32_t flags)
+{
+    vm_area_t* vma = kmem_cache_alloc(vma_cache);
+
+    if (!vma)
+        return NULL;
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->inode = 0;
+    vma->pgoff = 0;
+    vma->next = NULL;
+    return vma;
+}
+
+static inline uint32_t vma_pgoff(vm_area_t* vma, uintptr_t va)
+{
+    return vma->pgoff + ((va - vma->start) >> 12);
+}
+
+/*
+ * Drops 'va' from every CPU that may have it cached. Only CPUs running a
+ * thread of 'mm' can: any other reloaded CR3 when it switched away.
+ */
+static void mm_flush_page(mm_t* mm, uintptr_t va)
+{
+    if (mm->pgdir == read_cr3())
+        asm volatile("invlpg (%0)" :: "r"(va) : "memory");
+    if (mm->users > 1)
+        smp_flush_tlb_others();
+}
+
+/*
+ * Queues a shared file page on 'list' if the CPU saw it written since the
+ * last time. Without memory for the entry the page just stays dirty.
+ */
+static void vma_sync_page(mm_t* mm, vm_area_t* vma, uintptr_t va, writeback_t** list)
+{
+    uint32_t* pte = user_pte(mm->pgdir, va, false);
+    writeback_t* wb;
+
+    if (!pte || (*pte & (PAGE_PRESENT | PAGE_DIRTY)) != (PAGE_PRESENT | PAGE_DIRTY))
+        return;
+    wb = kmem_cache_alloc(writeback_cache);
+    if (!wb)
+        return;
+    *pte &= ~PAGE_DIRTY;
+    /* Before the write-back, so a write from now on dirties it again */
+    mm_flush_page(mm, va);
+
+    wb->inode = vma->inode;
+    wb->index = vma_pgoff(vma, va);
+    wb->frame = *pte & ~0xFFF;
+    /* Keeps the frame alive if the page is unmapped before the write */
+    frame_ref_inc(wb->frame);
+    wb->next = *list;
+    *list = wb;
+}
+
+static void vma_sync_range(mm_t* mm, vm_area_t* vma, uintptr_t start, uintptr_t end, writeback_t** list)
+{
+    if (!(vma->flags & VM_SHARED))
+        return;
+    for (uintptr_t va = vma->start < start ? start : vma->start;
+         va < vma->end && va < end; va += PAGE_SIZE)
+        vma_sync_page(mm, vma, va, list);
+}
+
+/* Writes the pages gathered by vma_sync_range() back. No spinlock is held. */
+static void writeback_pages(writeback_t* list)
+{
+    writeback_t* next;
+
+    for (; list; list = next)
+    {
+        next = list->next;
+        page_cache_write(list->inode, list->index, list->frame);
+        frame_ref_dec(list->frame);
+        kmem_cache_free(writeback_cache, list);
+    }
+}
+
+/* First area ending above 'addr': the one holding it, or the next one up. */
+static vm_area_t* vma_find(mm_t* mm, uintptr_t addr, vm_area_t** prev)
+{
+    vm_area_t* vma = mm->vmas;
+
+    *prev = NULL;
+    while (vma && vma->end <= addr)
+    {
+        *prev = vma;
+        vma = vma->next;
+    }
+    return vma;
+}
+
+/* Lowest free range of 'length' bytes in the mmap part of the window. mm->lock is held. */
+static uintptr_t vma_find_unmapped(mm_t* mm, size_t length)
+{
+    uintptr_t start = USER_SPACE_START;
+
+    for (vm_area_t* vma = mm->vmas; vma && vma->start < USER_MMAP_END; vma = vma->next)
+    {
+        if (vma->start - start >= length)
+            break;
+        start = vma->end;
+    }
+    if (start >= USER_MMAP_END || USER_MMAP_END - start < length)
+        return 0;
+    return start;
+}
+
+/* Inserts the area, mm->lock is held. */
+static int vma_insert(mm_t* mm, uintptr_t start, size_t length, uint32_t flags)
+{
+    uintptr_t end = start + ALIGN_4K(length);
+    vm_area_t* prev;
+    vm_area_t* next;
+    vm_area_t* vma;
+
+    if ((start & 0xFFF) || start < USER_SPACE_START || end <= start || end > USER_SPACE_END)
+        return -1;
+
+    next = vma_find(mm, start, &prev);
+    if (next && next->start < end)
+        return -1;
+
+    vma = vma_new(start, end, flags);
+    if (!vma)
+        return -1;
+    vma->next = next;
+    if (prev)
+        prev->next = vma;
+    else
+        mm->vmas = vma;
+    return 0;
+}
+
+/*
+ * Releases the pages of [start, end) in 'vma'. While other threads may
+ * run on the space, the frames wait for a shootdown like kernel ones.
+ */
+static void vma_release_pages(mm_t* mm, vm_area_t* vma, uintptr_t start, uintptr_t end)
+{
+    unmap_batch_t batch;
+    uint32_t* pte;
+
+    batch.count = 0;
+    batch.user = true;
+    for (uintptr_t va = vma->start < start ? start : vma->start;
+         va < vma->end && va < end; va += PAGE_SIZE)
+    {
+        if (mm->users < 2)
+        {
+            vmm_unmap_user_page(mm->pgdir, va);
+            continue;
+        }
+        pte = user_pte(mm->pgdir, va, false);
+        if (!pte || !(*pte & PAGE_PRESENT))
+            continue;
+        unmap_batch_add(&batch, *pte & ~0xFFF);
+        *pte = 0;
+        if (mm->pgdir == read_cr3())
+            asm volatile("invlpg (%0)" :: "r"(va) : "memory");
+    }
+    unmap_batch_flush(&batch);
+}
+
+/**
+ * vma_map:
+ *   Records [start, start + length) as a new area of 'mm'. Nothing is
+ *   mapped yet. Returns -1 if the range overlaps another area.
+ */
+int vma_map(mm_t* mm, uintptr_t start, size_t length, uint32_t flags)
+{
+    uint32_t irq = spin_lock_irqsave(&mm->lock);
+    int ret = vma_insert(mm, start, length, flags);
+
+    spin_unlock_irqrestore(&mm->lock, irq);
+    return ret;
+}
+
+/* A new area of 'length' bytes wherever mmap() would put it. Its start, or 0. */
+uintptr_t vma_alloc(mm_t* mm, size_t length, uint32_t flags)
+{
+    uint32_t irq = spin_lock_irqsave(&mm->lock);
+    uintptr_t start = vma_find_unmapped(mm, ALIGN_4K(length));
+
+    if (start && vma_insert(mm, start, length, flags) < 0)
+        start = 0;
+    spin_unlock_irqrestore(&mm->lock, irq);
+    return start;
+}
+
+static int vmm_fault_locked(mm_t* mm, uintptr_t addr, uint32_t err_code, uint32_t* irq);
+
+/*
+ * Backs every page of [start, start + length) as a write to it would,
+ * for stacks ring 0 runs on: it cannot take a fault on its own stack.
+ */
+int vma_populate(mm_t* mm, uintptr_t start, size_t length)
+{
+    uint32_t irq = spin_lock_irqsave(&mm->lock);
+    int ret = 0;
+
+    for (uintptr_t va = start & ~0xFFF; va < start + length && !ret; va += PAGE_SIZE)
+    {
+        if (!vmm_fault_locked(mm, va, PAGE_RW, &irq))
+            ret = -1;
+    }
+    spin_unlock_irqrestore(&mm->lock, irq);
+    return ret;
+}
+
+/**
+ * vma_unmap:
+ *   Releases the pages of [start, start + length) and cuts the range out
+ *   of the areas covering it, splitting one in two when needed.
+ */
+int vma_unmap(mm_t* mm, uintptr_t start, size_t length)
+{
+    uintptr_t end = start + ALIGN_4K(length);
+    vm_area_t* prev;
+    vm_area_t* vma;
+    vm_area_t* tail;
+    writeback_t* dirty = NULL;
+    uint32_t irq;
+
+    if ((start & 0xFFF) || end <= start)
+        return -1;
+
+    irq = spin_lock_irqsave(&mm->lock);
+    vma = vma_find(mm, start, &prev);
+    while (vma && vma->start < end)
+    {
+        if (vma->start < start && vma->end > end)
+        {
+            tail = vma_new(end, vma->end, vma->flags);
+            if (!tail)
+            {
+                spin_unlock_irqrestore(&mm->lock, irq);
+                writeback_pages(dirty);
+                return -1;
+            }
+            tail->inode = vma->inode;
+            tail->pgoff = vma_pgoff(vma, end);
+            tail->next = vma->next;
+            vma->next = tail;
+        }
 
-    /* Merge with next block if contiguous */
-    if (block->next && block->next->free)
-    {
-        uintptr_t block_end = (uintptr_t)block + sizeof(block_header_t) + block->size;
-        if (block_end == (uintptr_t)block->next)
+        vma_sync_range(mm, vma, start, end, &dirty);
+        vma_release_pages(mm, vma, start, end);
+
+        if (vma->start >= start && vma->end <= end)
         {
-            block->size += sizeof(block_header_t) + block->next->size;
-            block->next = block->next->next;
+            if (prev)
+                prev->next = vma->next;
+            else
+                mm->vmas = vma->next;
+            kmem_cache_free(vma_cache, vma);
+            vma = prev ? prev->next : mm->vmas;
+            continue;
         }
-    }
 
-    /* Merge with previous block if contiguous */
-    block_header_t* current = heap_started;
-    block_header_t* prev = NULL;
-    while (current && current != block)
-    {
-        prev = current;
-        current = current->next;
-    }
-    if (prev && prev->free)
-    {
-        uintptr_t prev_end = (uintptr_t)prev + sizeof(block_header_t) + prev->size;
-        if (prev_end == (uintptr_t)block)
+        if (vma->start < start)
+            vma->end = start;
+        else
         {
-            prev->size += sizeof(block_header_t) + block->size;
-            prev->next = block->next;
+            vma->pgoff = vma_pgoff(vma, end);
+            vma->start = end;
         }
+        prev = vma;
+        vma = vma->next;
     }
+    spin_unlock_irqrestore(&mm->lock, irq);
+    writeback_pages(dirty);
+    return 0;
 }
 
-size_t ksize(void* ptr)
+/*
+ * Drops the area list, queueing dirty shared file pages on 'list' for the
+ * caller to write back. The pages themselves go away with the directory.
+ */
+static void vma_free_all(mm_t* mm, writeback_t** list)
 {
-    if (!ptr) return 0;
+    vm_area_t* next;
 
-    block_header_t* block = (block_header_t*)((uintptr_t)ptr - sizeof(block_header_t));
-    return block->size;
+    for (vm_area_t* vma = mm->vmas; vma; vma = next)
+    {
+        next = vma->next;
+        vma_sync_range(mm, vma, vma->start, vma->end, list);
+        kmem_cache_free(vma_cache, vma);
+    }
+    mm->vmas = NULL;
 }
 
-/*############################################################################*/
-/*                                                                            */
-/*                           VMALLOC                                          */
-/*                                                                            */
-/*############################################################################*/
-
-// void* vmalloc(size_t size, int is_user)
-// {
-//     /* Round up payload size and add header */
-//     size_t aligned_size = ALIGN_4K(size);
-//     size_t total_size = ALIGN_4K(aligned_size + sizeof(vblock_header_t));
-
-//     vblock_header_t* current = vblock_list;
-//     vblock_header_t* prev = NULL;
-//     while (current)
-//     {
-//         if (current->free && current->size >= total_size)
-//         {
-//             current->free = 0;
-//             current->is_user = is_user;
-//             /* Split block if possible */
-//             if (current->size > total_size + sizeof(vblock_header_t) + PAGE_SIZE)
-//             {
-//                 vblock_header_t* new_block = (vblock_header_t*)((uintptr_t)current + total_size);
-//                 new_block->size = current->size - total_size;
-//                 new_block->free = 1;
-//                 new_block->next = current->next;
-//                 new_block->is_user = 0;
-//                 current->size = total_size;
-//                 current->next = new_block;
-//             }
-//             return (void*)((uintptr_t)current + sizeof(vblock_header_t));
-//         }
-//         prev = current;
-//         current = current->next;
-//     }
-
-//     uintptr_t old_brk = (uintptr_t)vmalloc_brk;
-//     uintptr_t new_brk = old_brk + total_size;
-//     if (new_brk > VMALLOC_START + VMALLOC_SIZE)
-//     {
-//         puts_color("vmalloc: Out of vmalloc space!\n", RED);
-//         return NULL;
-//     }
-
-//     /* Map each page in the new region */
-//     for (uintptr_t addr = old_brk; addr < new_brk; addr += PAGE_SIZE)
-//     {
-//         uint32_t phys_frame = allocate_frame();
-//         if (!phys_frame)
-//         {
-//             puts_color("vmalloc: Out of physical frames!\n", RED);
-//             return NULL;
-//         }
-//         uint32_t flags = PAGE_PRESENT | PAGE_RW;
-//         if (is_user)
-//             flags |= PAGE_USER;
-//         map_page(addr, phys_frame, flags);
-//     }
-//     vmalloc_brk = (void*)new_brk;
-
-//     /* Create the new block header */
-//     vblock_header_t* new_block = (vblock_header_t*)old_brk;
-//     new_block->size = total_size;
-//     new_block->free = 0;
-//     new_block->next = NULL;
-//     new_block->is_user = is_user;
-
-//     if (prev)
-//         prev->next = new_block;
-//     else
-//         vblock_list = new_block;
-
-//     return (void*)((uintptr_t)new_block + sizeof(vblock_header_t));
-// }
-
-void* vmalloc(size_t size, int is_user)
+/* Gives 'dst' a copy of the areas of 'src', for fork(). */
+static int vma_clone(mm_t* dst, mm_t* src)
 {
-    size = ALIGN_8(size);
-
-    vblock_header_t* current = vblock_list;
-    vblock_header_t* prev = NULL;
+    vm_area_t** link = &dst->vmas;
+    vm_area_t* next;
 
-    while (current)
+    for (vm_area_t* vma = src->vmas; vma; vma = vma->next)
     {
-        if (current->free && current->size >= size)
+        *link = vma_new(vma->start, vma->end, vma->flags);
+        if (!*link)
         {
-            current->free = 0;
-            current->is_user = is_user;
-
-            if (current->size > size + sizeof(vblock_header_t))
+            /* Nothing ran on the copy: the parent still has every dirty bit */
+            for (vma = dst->vmas; vma; vma = next)
             {
-                vblock_header_t* new_block = (vblock_header_t*)ALIGN_8((uintptr_t)current + sizeof(vblock_header_t) + size);
-                new_block->size = current->size - size - sizeof(vblock_header_t);
-                new_block->free = 1;
-                new_block->next = current->next;
-                new_block->is_user = is_user;
-
-                current->size = size;
-                current->next = new_block;
+                next = vma->next;
+                kmem_cache_free(vma_cache, vma);
             }
-
-            void* allocated_mem = (char*)current + sizeof(vblock_header_t);
-            return allocated_mem;
+            dst->vmas = NULL;
+            return -1;
         }
-
-        prev = current;
-        current = current->next;
+        (*link)->inode = vma->inode;
+        (*link)->pgoff = vma->pgoff;
+        link = &(*link)->next;
     }
+    return 0;
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           ADDRESS SPACES                                   */
+/*                                                                            */
+/*############################################################################*/
 
-    uintptr_t old_end = (uintptr_t)heap_end;
-    size_t new_size = size + sizeof(vblock_header_t);
-    uintptr_t new_heap_end = (uintptr_t)heap_end + new_size;
+static mm_t* mm_alloc(uint32_t pgdir)
+{
+    mm_t* mm;
 
-    if (new_heap_end > HEAP_START + MAX_HEAP_SIZE)
+    if (!pgdir)
+        return NULL;
+    mm = kmem_cache_alloc(mm_cache);
+    if (!mm)
     {
-        puts_color("vmalloc: Out of memory (heap expansion)!\n", RED);
+        vmm_destroy_directory(pgdir);
         return NULL;
     }
+    mm->pgdir = pgdir;
+    mm->vmas = NULL;
+    mm->users = 1;
+    spin_lock_init(&mm->lock);
+    return mm;
+}
+
+/* An empty user window, with one user. NULL when out of memory. */
+mm_t* mm_create()
+{
+    return mm_alloc(vmm_create_directory());
+}
+
+/* Copy-on-write copy of 'src' for fork(), see vmm_clone_directory(). */
+mm_t* mm_fork(mm_t* src, uintptr_t copy_start, uintptr_t copy_end)
+{
+    uint32_t irq = spin_lock_irqsave(&src->lock);
+    mm_t* mm = mm_alloc(vmm_clone_directory(src->pgdir, copy_start, copy_end));
 
-    if (kbrk((void*)new_heap_end) == (void*)-1)
+    /* The pages it now shares read-only may be writable in other TLBs */
+    if (mm && src->users > 1)
+        smp_flush_tlb_others();
+    if (mm && vma_clone(mm, src) < 0)
     {
-        puts_color("vmalloc: Failed to expand heap!\n", RED);
-        return NULL;
+        vmm_destroy_directory(mm->pgdir);
+        kmem_cache_free(mm_cache, mm);
+        mm = NULL;
     }
+    spin_unlock_irqrestore(&src->lock, irq);
+    return mm;
+}
 
-    vblock_header_t* new_block = (vblock_header_t*)old_end;
-    new_block->size = size;
-    new_block->free = 0;
-    new_block->next = NULL;
-    new_block->is_user = is_user;
+void mm_get(mm_t* mm)
+{
+    __atomic_fetch_add(&mm->users, 1, __ATOMIC_RELAXED);
+}
 
-    if (prev)
+/* The last user writes shared file pages back and frees it all. */
+void mm_put(mm_t* mm)
+{
+    writeback_t* dirty = NULL;
+
+    if (!mm || __atomic_sub_fetch(&mm->users, 1, __ATOMIC_ACQ_REL))
+        return;
+    vma_free_all(mm, &dirty);
+    vmm_destroy_directory(mm->pgdir);
+    kmem_cache_free(mm_cache, mm);
+    writeback_pages(dirty);
+}
+
+/*
+ * Maps the page cache frame itself. A private writable area gets it
+ * copy-on-write: the cache keeps a reference, so the first write always
+ * takes a private copy. mm->lock is dropped around the page cache lookup,
+ * which may read the disk, so the area and the PTE are checked again
+ * afterwards; if they changed, the access is simply retried.
+ */
+static int vma_fault_file(mm_t* mm, vm_area_t* vma, uintptr_t va, uint32_t* irq)
+{
+    uint32_t inode = vma->inode;
+    uint32_t index = vma_pgoff(vma, va);
+    uint32_t flags = 0;
+    uint32_t frame;
+    vm_area_t* prev;
+    uint32_t* pte;
+
+    spin_unlock_irqrestore(&mm->lock, *irq);
+    frame = page_cache_get(inode, index);
+    *irq = spin_lock_irqsave(&mm->lock);
+    if (!frame)
+        return 0;
+
+    vma = vma_find(mm, va, &prev);
+    pte = user_pte(mm->pgdir, va, false);
+    if (!vma || va < vma->start || vma->inode != inode || vma_pgoff(vma, va) != index ||
+        (pte && (*pte & PAGE_PRESENT)))
     {
-        prev->next = new_block;
+        frame_ref_dec(frame);
+        return 1;
     }
-    else
+
+    if (vma->flags & VM_SHARED)
+        flags = PAGE_SHARED | ((vma->flags & VM_WRITE) ? PAGE_RW : 0);
+    else if (vma->flags & VM_WRITE)
+        flags = PAGE_COW;
+
+    if (vmm_map_user_frame(mm->pgdir, va, frame, flags) < 0)
     {
-        vblock_list = new_block;
+        frame_ref_dec(frame);
+        return 0;
     }
-
-    void* allocated_mem = (char*)new_block + sizeof(vblock_header_t);
-    return allocated_mem;
+    return 1;
 }
 
-void vfree(void* ptr)
+/* vmm_handle_fault() with mm->lock held, taken with '*irq'. */
+static int vmm_fault_locked(mm_t* mm, uintptr_t addr, uint32_t err_code, uint32_t* irq)
 {
-    if (!ptr) return;
-    vblock_header_t* block = (vblock_header_t*)((uintptr_t)ptr - sizeof(vblock_header_t));
-    block->free = 1;
+    uint32_t* pte = user_pte(mm->pgdir, addr, false);
+    vm_area_t* prev;
+    vm_area_t* vma;
 
-    vblock_header_t* current = vblock_list;
-    vblock_header_t* prev = NULL;
-    while (current)
+    if (pte && (*pte & PAGE_PRESENT))
     {
-        if (current->free)
+        /* Another thread mapped it, or made it writable, since the fault */
+        if ((err_code & PAGE_RW) ? (*pte & PAGE_RW) != 0 : !(err_code & PAGE_PRESENT))
         {
-            /* Merge with next block if physically contiguous */
-            if (current->next && current->next->free)
-            {
-                uintptr_t current_end = (uintptr_t)current + sizeof(vblock_header_t) + current->size;
-                if (current_end == (uintptr_t)current->next)
-                {
-                    current->size += sizeof(vblock_header_t) + current->next->size;
-                    current->next = current->next->next;
-                    continue; // re-check current->next
-                }
-            }
-            /* Merge with previous block if physically contiguous */
-            if (prev && prev->free)
-            {
-                uintptr_t prev_end = (uintptr_t)prev + sizeof(vblock_header_t) + prev->size;
-                if (prev_end == (uintptr_t)current)
-                {
-                    prev->size += sizeof(vblock_header_t) + current->size;
-                    prev->next = current->next;
-                    current = prev; // set current to merged block
-                    continue;
-                }
-            }
+            asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
+            return 1;
         }
-        prev = current;
-        current = current->next;
+        if (!(err_code & PAGE_RW) || !vmm_handle_cow(mm->pgdir, addr))
+            return 0;
+        /* The old frame may still be in the TLBs of other threads */
+        if (mm->users > 1)
+            smp_flush_tlb_others();
+        return 1;
+    }
+    if (err_code & PAGE_PRESENT)
+        return 0;
+
+    vma = vma_find(mm, addr, &prev);
+    if (!vma)
+        return 0;
+    if (addr < vma->start)
+    {
+        if (!(vma->flags & VM_GROWSDOWN) || addr < vma->end - USER_STACK_MAX)
+            return 0;
+        vma->start = addr & ~0xFFF;
     }
+    if ((err_code & PAGE_RW) && !(vma->flags & VM_WRITE))
+        return 0;
+
+    if (vma->inode)
+        return vma_fault_file(mm, vma, addr & ~0xFFF, irq);
+    return vmm_map_user_page(mm->pgdir, addr & ~0xFFF, (vma->flags & VM_WRITE) ? PAGE_RW : 0) != 0;
 }
 
-size_t vsize(void* ptr)
+/**
+ * vmm_handle_fault:
+ *   Page fault entry point for the user window of the current task.
+ *   - write to a present page: copy-on-write;
+ *   - missing page inside an area: a zeroed frame is mapped, or the page
+ *     cache page for file areas (copy-on-write unless VM_SHARED);
+ *   - missing page just below a VM_GROWSDOWN area: the stack grows down,
+ *     up to USER_STACK_MAX.
+ *   Returns 1 when the faulting access can be retried, 0 otherwise.
+ */
+int vmm_handle_fault(uintptr_t addr, uint32_t err_code)
 {
-    if (!ptr) return 0;
-    vblock_header_t* block = (vblock_header_t*)((uintptr_t)ptr - sizeof(vblock_header_t));
-    return block->size;
+    task_t* task = get_current_task();
+    uint32_t irq;
+    int ret;
+
+    if (!task || !task->mm || addr < USER_SPACE_START || addr >= USER_SPACE_END)
+        return 0;
+
+    irq = spin_lock_irqsave(&task->mm->lock);
+    ret = vmm_fault_locked(task->mm, addr, err_code, &irq);
+    spin_unlock_irqrestore(&task->mm->lock, irq);
+    return ret;
 }
 
 /*############################################################################*/
@@ -538,46 +2024,82 @@ size_t vsize(void* ptr)
 /*                           MMAP                                             */
 /*                                                                            */
 /*############################################################################*/
-static int region_is_free_in_vblocks(uintptr_t start, size_t length)
+
+/*
+ * User mappings live in the calling task's private window, backed on
+ * demand. With a file, 'fd' is one of the task's open files and 'offset'
+ * a page aligned offset in it.
+ */
+static void* mmap_user(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
-    uintptr_t end = start + length;
-    vblock_header_t* current = vblock_list;
+    task_t* task = get_current_task();
+    size_t aligned_length = ALIGN_4K(length);
+    uint32_t vm_flags = prot & (VM_READ | VM_WRITE | VM_EXEC);
+    ext2_FILE* file = NULL;
+    uintptr_t start;
+    vm_area_t* prev;
+    vm_area_t* vma;
+    uint32_t irq;
+
+    if (!task || !task->mm || !aligned_length)
+        return (void*)-1;
 
-    while (current)
+    if (!(flags & MAP_ANONYMOUS))
     {
-        if (!current->free)
+        if (fd >= 0 && fd < TASK_MAX_FILES)
+            file = task->files[fd];
+        if (!file || offset < 0 || (offset & 0xFFF))
         {
-            uintptr_t block_start = (uintptr_t)current + sizeof(vblock_header_t);
-            uintptr_t block_end   = block_start + current->size;
-
-            if (end > block_start && start < block_end)
+            puts_color("mmap: bad file descriptor or offset!\n", RED);
+            return (void*)-1;
+        }
+        if (flags & MAP_SHARED)
+        {
+            if ((prot & PROT_WRITE) && file->mode != 1)
             {
-                return 0;
+                puts_color("mmap: file is not open for writing!\n", RED);
+                return (void*)-1;
             }
+            vm_flags |= VM_SHARED;
         }
-        current = current->next;
     }
-    return 1;
-}
 
-static void insert_fixed_vblock(uintptr_t start, size_t length, int is_user)
-{
-    vblock_header_t* block = (vblock_header_t*)start;
+    /* Other threads may be mapping too: find and take the range at once */
+    irq = spin_lock_irqsave(&task->mm->lock);
+    if (flags & MAP_FIXED)
+    {
+        start = (uintptr_t)addr & ~0xFFF;
+        if (start < USER_SPACE_START || start >= USER_MMAP_END || aligned_length > USER_MMAP_END - start)
+            start = 0;
+    }
+    else
+        start = vma_find_unmapped(task->mm, aligned_length);
 
-    block->size    = length - sizeof(vblock_header_t);
-    block->free    = 0;
-    block->is_user = is_user;
+    if (!start || vma_insert(task->mm, start, aligned_length, vm_flags) < 0)
+    {
+        spin_unlock_irqrestore(&task->mm->lock, irq);
+        puts_color("mmap: region is NOT free!\n", RED);
+        return (void*)-1;
+    }
 
-    block->next = vblock_list;
-    vblock_list = block;
+    if (file)
+    {
+        vma = vma_find(task->mm, start, &prev);
+        vma->inode = file->inode_num;
+        vma->pgoff = (uint32_t)offset >> 12;
+    }
+    spin_unlock_irqrestore(&task->mm->lock, irq);
+    return (void*)start;
 }
 
-
 void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
+    if (prot & PROT_USER)
+        return mmap_user(addr, length, prot, flags, fd, offset);
+
     if (!(flags & MAP_ANONYMOUS))
     {
-        puts_color("mmap: Only MAP_ANONYMOUS is supported!\n", RED);
+        puts_color("mmap: files can only be mapped in user space!\n", RED);
         return (void*)-1;
     }
 
@@ -585,33 +2107,42 @@ void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
 
     if (flags & MAP_FIXED)
     {
-        uintptr_t fixed_addr   = ALIGN_4K((uintptr_t)addr);
+        uintptr_t fixed_addr   = (uintptr_t)addr & ~0xFFF;
         size_t aligned_length  = ALIGN_4K(length);
-        uintptr_t fixed_end    = fixed_addr + aligned_length;
+        vmap_area_t* area;
+        uint32_t irq_flags;
+
+        if (!aligned_length)
+        {
+            puts_color("mmap: region is NOT free!\n", RED);
+            return (void*)-1;
+        }
 
-        if (!region_is_free_in_vblocks(fixed_addr, aligned_length))
+        /* Fixed mappings must fall in a free part of the vmalloc window. */
+        irq_flags = spin_lock_irqsave(&heap_lock);
+        area = vmap_reserve_va(fixed_addr, aligned_length);
+        if (!area)
         {
+            spin_unlock_irqrestore(&heap_lock, irq_flags);
             puts_color("mmap: region is NOT free!\n", RED);
             return (void*)-1;
         }
+        area->is_user = is_user;
 
         uint32_t page_flags = PAGE_PRESENT;
         if (prot & PROT_WRITE) page_flags |= PAGE_RW;
         if (prot & PROT_USER)  page_flags |= PAGE_USER;
 
-        for (uintptr_t va = fixed_addr; va < fixed_end; va += PAGE_SIZE)
+        if (vmap_map(fixed_addr, aligned_length, page_flags) < 0)
         {
-            uint32_t frame = allocate_frame();
-            if (!frame)
-            {
-                puts_color("mmap: out of physical frames!\n", RED);
-                return (void*)-1;
-            }
-            map_page(va, frame, page_flags);
+            vmap_free_va(area);
+            spin_unlock_irqrestore(&heap_lock, irq_flags);
+            puts_color("mmap: out of physical frames!\n", RED);
+            return (void*)-1;
         }
 
-        insert_fixed_vblock(fixed_addr, aligned_length, is_user);
-
+        vmap_busy_insert(area);
+        spin_unlock_irqrestore(&heap_lock, irq_flags);
         return (void*)fixed_addr;
     }
     else
@@ -628,12 +2159,80 @@ void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
 
 int munmap(void* addr, size_t length)
 {
+    uintptr_t start = (uintptr_t)addr & ~0xFFF;
+
     if (!addr) return -1;
 
+    if (start >= USER_SPACE_START && start < USER_SPACE_END)
+    {
+        if (!get_current_task() || !get_current_task()->mm)
+            return -1;
+        return vma_unmap(get_current_task()->mm, start, (uintptr_t)addr + length - start);
+    }
+
     vfree(addr);
     return 0;
 }
 
+/* An MS_ASYNC msync(), written back by a worker */
+typedef struct msync_work
+{
+    work_t work;
+    mm_t* mm;
+    uintptr_t start;
+    uintptr_t end;
+} msync_work_t;
+
+static void msync_range(mm_t* mm, uintptr_t start, uintptr_t end)
+{
+    uint32_t irq = spin_lock_irqsave(&mm->lock);
+    writeback_t* dirty = NULL;
+    vm_area_t* prev;
+
+    for (vm_area_t* vma = vma_find(mm, start, &prev); vma && vma->start < end; vma = vma->next)
+        vma_sync_range(mm, vma, start, end, &dirty);
+    spin_unlock_irqrestore(&mm->lock, irq);
+    writeback_pages(dirty);
+}
+
+static void msync_worker(void* data)
+{
+    msync_work_t* work = data;
+
+    msync_range(work->mm, work->start, work->end);
+    mm_put(work->mm);
+    kfree(work);
+}
+
+/*
+ * Writes the dirty MAP_SHARED pages of the range back to their files.
+ * MS_ASYNC only queues the write-back, unless there is no memory for it.
+ */
+int msync(void* addr, size_t length, int flags)
+{
+    task_t* task = get_current_task();
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = start + length;
+    msync_work_t* work;
+
+    if (!task || !task->mm || (start & 0xFFF) || end < start)
+        return -1;
+
+    if ((flags & MS_ASYNC) && (work = kmalloc(sizeof(msync_work_t))))
+    {
+        /* The space stays alive until the worker is done with it */
+        mm_get(task->mm);
+        work->mm = task->mm;
+        work->start = start;
+        work->end = end;
+        init_work(&work->work, msync_worker, work);
+        queue_work(&work->work);
+        return 0;
+    }
+    msync_range(task->mm, start, end);
+    return 0;
+}
+
 
 void make_page_user(uintptr_t addr)
 {
@@ -642,9 +2241,18 @@ void make_page_user(uintptr_t addr)
     if (page_directory[pd_index] & PAGE_PRESENT)
     {
         page_directory[pd_index] |= PAGE_USER;
+        if (page_directory[pd_index] & PAGE_PSE)
+        {
+            /* A user page must not stay global */
+            page_directory[pd_index] &= ~PAGE_GLOBAL;
+            asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
+            smp_flush_tlb_others();
+            return;
+        }
         page_table_t* pt = (page_table_t*)(page_directory[pd_index] & ~0xFFF);
-        (*pt)[pt_index] |= PAGE_USER;
+        (*pt)[pt_index] = ((*pt)[pt_index] | PAGE_USER) & ~PAGE_GLOBAL;
         asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
+        smp_flush_tlb_others();
     }
 }
 
@@ -656,7 +2264,7 @@ void make_page_user(uintptr_t addr)
 
 static void m_force_page_fault_write()
 {
-    uint32_t *invalid_addr = (uint32_t*)0xC0000000; // High address not mapped
+    uint32_t *invalid_addr = (uint32_t*)0xF0000000; // High address not mapped
     *invalid_addr = 0xDEADBEEF; // Attempt to write
 }
 
@@ -687,6 +2295,11 @@ static void print_pde_flags(uint32_t entry)
     else
         putc('K');
 
+    if (entry & PAGE_PSE)
+        putc('L');
+    if (entry & PAGE_GLOBAL)
+        putc('G');
+
     putc(']');
 }
 
@@ -760,6 +2373,169 @@ void K2()
     kmalloc(2 * 1024 * 1024);
 }
 
+#define BENCH_SLOTS 256
+#define BENCH_OPS   200000
+#define BENCH_ARENA MB(4)
+
+/*
+ * The heap as it was before the boundary tags: one address-ordered list,
+ * first-fit allocation, and a free that walks the list from the start to
+ * find the block before it. Kept only so "bheap" can show the difference,
+ * it carves its blocks out of a private vmalloc() arena.
+ */
+typedef struct ff_block {
+    size_t size;
+    struct ff_block* next;
+    int free;
+} ff_block_t;
+
+static ff_block_t* ff_list;
+static uintptr_t ff_top;
+static uintptr_t ff_end;
+
+static void* ff_alloc(size_t size)
+{
+    ff_block_t* current = ff_list;
+    ff_block_t* prev = NULL;
+    ff_block_t* block;
+
+    size = ALIGN_8(size);
+    while (current)
+    {
+        if (current->free && current->size >= size)
+        {
+            current->free = 0;
+            if (current->size > size + sizeof(ff_block_t) + 8)
+            {
+                block = (ff_block_t*)((uintptr_t)current + sizeof(ff_block_t) + size);
+                block->size = current->size - size - sizeof(ff_block_t);
+                block->free = 1;
+                block->next = current->next;
+                current->size = size;
+                current->next = block;
+            }
+            return (void*)((uintptr_t)current + sizeof(ff_block_t));
+        }
+        prev = current;
+        current = current->next;
+    }
+
+    if (ff_top + sizeof(ff_block_t) + size > ff_end)
+        return NULL;
+    block = (ff_block_t*)ff_top;
+    ff_top += sizeof(ff_block_t) + size;
+    block->size = size;
+    block->free = 0;
+    block->next = NULL;
+    if (prev)
+        prev->next = block;
+    else
+        ff_list = block;
+    return (void*)((uintptr_t)block + sizeof(ff_block_t));
+}
+
+static void ff_free(void* ptr)
+{
+    ff_block_t* block = (ff_block_t*)((uintptr_t)ptr - sizeof(ff_block_t));
+    ff_block_t* current = ff_list;
+    ff_block_t* prev = NULL;
+
+    block->free = 1;
+    if (block->next && block->next->free
+        && (uintptr_t)block + sizeof(ff_block_t) + block->size == (uintptr_t)block->next)
+    {
+        block->size += sizeof(ff_block_t) + block->next->size;
+        block->next = block->next->next;
+    }
+
+    while (current && current != block)
+    {
+        prev = current;
+        current = current->next;
+    }
+    if (prev && prev->free
+        && (uintptr_t)prev + sizeof(ff_block_t) + prev->size == (uintptr_t)block)
+    {
+        prev->size += sizeof(ff_block_t) + block->size;
+        prev->next = block->next;
+    }
+}
+
+/*
+ * Random alloc/free of 2 KB..8 KB (the heap path, not the slabs) over
+ * BENCH_SLOTS live slots, timed with the PIT. Both allocators see the
+ * same sequence. Returns the number of ops done.
+ */
+static uint32_t bench_heap_run(void* (*alloc)(size_t), void (*release)(void*), uint32_t* ticks)
+{
+    static void* slots[BENCH_SLOTS];
+    uint32_t seed = 7;
+    uint32_t start;
+    uint32_t i;
+    uint32_t slot;
+
+    memset(slots, 0, sizeof(slots));
+    start = get_kticks();
+    for (i = 0; i < BENCH_OPS; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        slot = (seed >> 8) % BENCH_SLOTS;
+        if (slots[slot])
+        {
+            release(slots[slot]);
+            slots[slot] = NULL;
+            continue;
+        }
+        seed = seed * 1103515245 + 12345;
+        slots[slot] = alloc(KMALLOC_MAX_CACHE_SIZE + 1 + (seed >> 8) % KB(6));
+        if (!slots[slot])
+        {
+            puts_color("bheap: allocation failed!\n", RED);
+            break;
+        }
+    }
+    *ticks = get_kticks() - start;
+
+    for (slot = 0; slot < BENCH_SLOTS; slot++)
+    {
+        if (slots[slot])
+            release(slots[slot]);
+    }
+    return i;
+}
+
+static void bench_heap_report(const char* name, uint32_t ops, uint32_t ticks)
+{
+    printf("bheap: %s: %d ops in %d ticks, ", name, ops, ticks);
+    if (ticks)
+        printf("%z ops/sec\n", (size_t)ops * PIT_FREQUENCY / ticks);
+    else
+        printf("more than %z ops/sec\n", (size_t)ops * PIT_FREQUENCY);
+}
+
+/* The old first-fit list against kmalloc(), on the same workload. */
+static void bench_heap()
+{
+    void* arena = vmalloc(BENCH_ARENA, false);
+    uint32_t ticks;
+    uint32_t ops;
+
+    if (arena)
+    {
+        ff_list = NULL;
+        ff_top = (uintptr_t)arena;
+        ff_end = ff_top + BENCH_ARENA;
+        ops = bench_heap_run(ff_alloc, ff_free, &ticks);
+        vfree(arena);
+        bench_heap_report("first-fit", ops, ticks);
+    }
+    else
+        puts_color("bheap: no memory for the first-fit arena!\n", RED);
+
+    ops = bench_heap_run(kmalloc, kfree, &ticks);
+    bench_heap_report("kmalloc", ops, ticks);
+}
+
 /* A big test. */
 static void test_dynamic_heap_growth()
 {
@@ -854,7 +2630,11 @@ void debug_page_mapping(uint32_t address)
     printf(" PDE index: %d, PDE entry: %x\n", 
             pd_index, page_directory[pd_index]);
 
-    if (page_directory[pd_index] & PAGE_PRESENT)
+    if (page_directory[pd_index] & PAGE_PSE)
+    {
+        printf("  4 MB page at %x\n", page_directory[pd_index] & ~(LARGE_PAGE_SIZE - 1));
+    }
+    else if (page_directory[pd_index] & PAGE_PRESENT)
     {
         pt = (page_table_t*)(page_directory[pd_index] & ~0xFFF);
         printf("  PTE index: %d, PTE entry: 0x%x\n", 
@@ -1010,28 +2790,89 @@ static void test_vmalloc()
 static void show_kernel_allocations()
 {
     printf("Kernel Allocations (kmalloc):\n");
-    block_header_t* current = free_list;
-    while (current)
+    if (!heap_epilogue)
+        return;
+
+    block_header_t* current = (block_header_t*)HEAP_START;
+    while (current != heap_epilogue)
     {
-        printf("  Block at %p: size=%z, free=%d\n", 
-                (void*)current, current->size, current->free);
-        current = current->next;
+        printf("  Block at %p: size=%z, free=%d\n",
+                (void*)current, BLOCK_SIZE(current), current->size & BLOCK_FREE);
+        current = BLOCK_NEXT(current);
+    }
+}
+
+/* Share of the free space outside the largest free piece, in percent. */
+static uint32_t fragmentation(size_t largest, size_t total)
+{
+    while (total > 0xFFFFFFFF / 100)
+    {
+        largest >>= 1;
+        total >>= 1;
+    }
+    return total ? 100 - largest * 100 / total : 0;
+}
+
+static void show_heap_profile()
+{
+    block_header_t* block;
+    vmap_area_t* area;
+    size_t total = 0;
+    size_t largest = 0;
+    size_t chunks = 0;
+
+    for (uint32_t fl = 0; fl < FL_COUNT; fl++)
+    {
+        for (uint32_t sl = 0; sl < SL_COUNT; sl++)
+        {
+            for (block = free_blocks[fl][sl]; block; block = block->next_free)
+            {
+                total += BLOCK_SIZE(block);
+                if (BLOCK_SIZE(block) > largest)
+                    largest = BLOCK_SIZE(block);
+                chunks++;
+            }
+        }
     }
+    printf("kmalloc heap: %z bytes, %z free in %z chunks, largest free %z, fragmentation %u%c\n",
+            heap_epilogue ? (size_t)((uintptr_t)heap_epilogue - HEAP_START) : (size_t)0,
+            total, chunks, largest, fragmentation(largest, total), '%');
+    printf("  resident: %z pages, %z pages trimmed back to the PMM\n", heap_resident, heap_trimmed);
+
+    total = largest = chunks = 0;
+    for (area = vmap_free; area; area = area->next)
+    {
+        total += area->size;
+        if (area->size > largest)
+            largest = area->size;
+        chunks++;
+    }
+    printf("vmalloc window: %z free in %z ranges, largest free %z, fragmentation %u%c\n",
+            total, chunks, largest, fragmentation(largest, total), '%');
+
+#ifdef HEAP_PROFILE
+    heap_profile_report();
+#else
+    printf("Call-site profiling is off, build with HEAP_PROFILE=1\n");
+#endif
 }
 
 static void show_user_allocations()
 {
+    vmap_area_t* area;
+    uint32_t i;
+
     printf("User Allocations (vmalloc):\n");
-    vblock_header_t* current = vblock_list;
-    while (current)
+    for (i = 0; i < VMAP_HASH_SIZE; i++)
     {
-        printf("  Block at %p: size=%z, free=%d\n",
-                (void*)current, current->size, current->free);
-        current = current->next;
+        for (area = vmap_busy[i]; area; area = area->next)
+            printf("  Area at %p: size=%z, user=%d\n", (void*)area->start, area->size, area->is_user);
     }
+    printf("Free vmalloc ranges:\n");
+    for (area = vmap_free; area; area = area->next)
+        printf("  %p: size=%z\n", (void*)area->start, area->size);
 }
 
-#include "../tasks/task.h"
 void debug_task_stack(task_t *task)
 {
     // uint32_t pd_index = (uintptr_t)task->stack >> 22;
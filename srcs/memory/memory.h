@@ -2,6 +2,8 @@
 #define MEMORY_H
 
 #include "../utils/stdint.h"
+#include "../boot/multiboot.h"
+#include "../utils/spinlock.h"
 
 typedef int off_t;
 
@@ -12,6 +14,23 @@ typedef int off_t;
 #define PAGE_WRITE              0x2
 #define PAGE_RW                 0x2
 #define PAGE_USER               0x4
+#define PAGE_PWT                0x8     /* Write-through */
+#define PAGE_PCD                0x10    /* Cache disabled, for MMIO */
+#define PAGE_DIRTY              0x40    /* Set by the CPU on a write */
+#define PAGE_PSE                0x80    /* PDE maps a 4 MB page */
+#define PAGE_GLOBAL             0x100   /* Kept in the TLB across CR3 loads */
+#define LARGE_PAGE_SIZE         0x400000 /* 4 MB */
+#define PAGE_COW                0x200   /* Available bit: shared until written */
+#define PAGE_SHARED             0x400   /* Available bit: MAP_SHARED, never COW */
+
+/*
+ * Per-task part of the address space. Everything else is the kernel's and
+ * is the same in every page directory.
+ */
+#define USER_SPACE_START        0xE0000000
+#define USER_SPACE_END          0xF0000000
+#define USER_STACK_TOP          USER_SPACE_END
+#define USER_STACK_MAX          0x100000  /* Reserved below USER_STACK_TOP */
 
 #define PROT_READ               0x1
 #define PROT_WRITE              0x2
@@ -19,15 +38,64 @@ typedef int off_t;
 
 #define PROT_USER               0x8
 
+#define MAP_SHARED              0x01
+#define MAP_PRIVATE             0x02
 #define MAP_ANONYMOUS           0x20
 #define MAP_FIXED               0x40
 
-void paging_init();
+#define MS_ASYNC                0x1
+#define MS_INVALIDATE           0x2
+#define MS_SYNC                 0x4
+
+/* vm_area_t flags. The low bits are the PROT_* the area was mapped with. */
+#define VM_READ                 PROT_READ
+#define VM_WRITE                PROT_WRITE
+#define VM_EXEC                 PROT_EXEC
+#define VM_GROWSDOWN            0x100   /* Stack: extends down on faults */
+#define VM_SHARED               0x200   /* File writes reach the file */
+
+/*
+ * A range of a task's user window. Pages inside it are only backed by
+ * frames once touched; the list is sorted by address. File areas map
+ * page cache pages of 'inode' starting at page 'pgoff' of the file.
+ */
+typedef struct vm_area
+{
+    uintptr_t start;
+    uintptr_t end;
+    uint32_t flags;
+    uint32_t inode;     /* 0 for anonymous memory */
+    uint32_t pgoff;
+    struct vm_area* next;
+} vm_area_t;
+
+/*
+ * A user address space: the page directory and the areas in it. Threads
+ * made with CLONE_VM share one; it goes away with its last user. 'lock'
+ * covers the area list and the user page tables.
+ */
+typedef struct mm
+{
+    uint32_t pgdir;
+    vm_area_t* vmas;            /* Sorted by address */
+    volatile uint32_t users;
+    spinlock_t lock;
+} mm_t;
+
+struct task_struct;
+
+void paging_init(multiboot_info_t* mbi);
 
 void* kbrk(void* addr);
 void kfree(void* ptr);
 void* kmalloc(size_t size);
 size_t ksize(void* ptr);
+int is_heap_range(const void* ptr, size_t len);
+void* kmalloc_aligned(size_t size, size_t align);
+void* alloc_pages_contig(size_t count);
+void free_pages_contig(void* ptr, size_t count);
+uint32_t virt_to_phys(const void* ptr);
+void* ioremap(uint32_t phys);
 void heap_init();
 
 void dump_page_directory();
@@ -39,9 +107,29 @@ size_t vsize(void* ptr);
 
 void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset);
 int munmap(void* addr, size_t length);
+int msync(void* addr, size_t length, int flags);
 
 void* vstrdup(const char *s);
 
 void make_page_user(uintptr_t addr);
 
+uint32_t vmm_kernel_directory();
+uint32_t vmm_create_directory();
+uint32_t vmm_clone_directory(uint32_t src, uintptr_t copy_start, uintptr_t copy_end);
+void vmm_destroy_directory(uint32_t dir);
+uint32_t vmm_map_user_page(uint32_t dir, uintptr_t va, uint32_t flags);
+void vmm_unmap_user_page(uint32_t dir, uintptr_t va);
+uint32_t vmm_virt_to_phys(uint32_t dir, uintptr_t va);
+int vmm_handle_fault(uintptr_t addr, uint32_t err_code);
+
+mm_t* mm_create();
+mm_t* mm_fork(mm_t* src, uintptr_t copy_start, uintptr_t copy_end);
+void mm_get(mm_t* mm);
+void mm_put(mm_t* mm);
+
+int vma_map(mm_t* mm, uintptr_t start, size_t length, uint32_t flags);
+int vma_unmap(mm_t* mm, uintptr_t start, size_t length);
+uintptr_t vma_alloc(mm_t* mm, size_t length, uint32_t flags);
+int vma_populate(mm_t* mm, uintptr_t start, size_t length);
+
 #endif // MEMORY_H
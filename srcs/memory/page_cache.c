@@ -0,0 +1,218 @@
+#include "../utils/stdint.h"
+#include "../utils/utils.h"
+#include "../utils/spinlock.h"
+#include "../display/display.h"
+#include "../kshell/kshell.h"
+#include "../ide/ext2_fileio.h"
+#include "memory.h"
+#include "pmm.h"
+#include "slab.h"
+#include "page_cache.h"
+
+/*############################################################################*/
+/*                                                                            */
+/*                           DEFINES                                          */
+/*                                                                            */
+/*############################################################################*/
+#define PAGE_CACHE_HASH_SIZE 256
+
+/*############################################################################*/
+/*                                                                            */
+/*                           LOCALS                                           */
+/*                                                                            */
+/*############################################################################*/
+static void show_page_cache();
+static void drop_page_cache();
+
+/* Guards the buckets and the counters; never held across disk I/O */
+static spinlock_t page_cache_lock = SPINLOCK_INIT;
+static page_cache_entry_t* page_cache[PAGE_CACHE_HASH_SIZE];
+static kmem_cache_t* page_cache_entry_cache;
+static uint32_t nr_pages;
+static uint32_t hits;
+static uint32_t misses;
+
+static command_t commands[] = {
+    {"pcache", "Show page cache usage", show_page_cache},
+    {"pcache drop", "Drop unmapped page cache pages", drop_page_cache},
+    {NULL, NULL, NULL}
+};
+
+/*############################################################################*/
+/*                                                                            */
+/*                           FUNCTIONS                                        */
+/*                                                                            */
+/*############################################################################*/
+
+static inline uint32_t page_cache_hash(uint32_t inode, uint32_t index)
+{
+    return (inode * 31 + index) % PAGE_CACHE_HASH_SIZE;
+}
+
+void page_cache_init()
+{
+    memset(page_cache, 0, sizeof(page_cache));
+    nr_pages = 0;
+    hits = 0;
+    misses = 0;
+    page_cache_entry_cache = kmem_cache_create("page_cache", sizeof(page_cache_entry_t), 0, NULL);
+    if (!page_cache_entry_cache)
+        kernel_panic("page_cache_init: cannot create the entry cache!\n");
+    install_all_cmds(commands, MEMORY);
+}
+
+/* Entry for (inode, index) in 'bucket', with page_cache_lock held. */
+static page_cache_entry_t* page_cache_lookup(page_cache_entry_t* bucket, uint32_t inode, uint32_t index)
+{
+    for (; bucket; bucket = bucket->next)
+    {
+        if (bucket->inode == inode && bucket->index == index)
+            return bucket;
+    }
+    return NULL;
+}
+
+/**
+ * page_cache_get:
+ *   Frame holding page 'index' of 'inode', read from disk on a miss.
+ *   The caller gets its own reference and drops it with frame_ref_dec().
+ *   Returns 0 when out of memory. The read is done without the cache
+ *   lock, so the caller must not hold a spinlock either; if another CPU
+ *   filled the same page meanwhile, its frame wins and ours is dropped.
+ */
+uint32_t page_cache_get(uint32_t inode, uint32_t index)
+{
+    page_cache_entry_t** bucket = &page_cache[page_cache_hash(inode, index)];
+    page_cache_entry_t* entry;
+    page_cache_entry_t* found;
+    uint32_t frame;
+    uint32_t flags;
+
+    flags = spin_lock_irqsave(&page_cache_lock);
+    found = page_cache_lookup(*bucket, inode, index);
+    if (found)
+    {
+        hits++;
+        frame_ref_inc(found->frame);
+        spin_unlock_irqrestore(&page_cache_lock, flags);
+        return found->frame;
+    }
+    misses++;
+    spin_unlock_irqrestore(&page_cache_lock, flags);
+
+    entry = kmem_cache_alloc(page_cache_entry_cache);
+    frame = entry ? allocate_frame() : 0;
+    if (!frame)
+    {
+        if (entry)
+            kmem_cache_free(page_cache_entry_cache, entry);
+        return 0;
+    }
+    ext2_read_page(inode, index * PAGE_SIZE, (void*)frame);
+
+    flags = spin_lock_irqsave(&page_cache_lock);
+    found = page_cache_lookup(*bucket, inode, index);
+    if (found)
+    {
+        frame_ref_inc(found->frame);
+        spin_unlock_irqrestore(&page_cache_lock, flags);
+        free_frame(frame);
+        kmem_cache_free(page_cache_entry_cache, entry);
+        return found->frame;
+    }
+    entry->inode = inode;
+    entry->index = index;
+    entry->frame = frame;
+    entry->next = *bucket;
+    *bucket = entry;
+    nr_pages++;
+
+    frame_ref_inc(frame);
+    spin_unlock_irqrestore(&page_cache_lock, flags);
+    return frame;
+}
+
+/* Writes a (dirty) cached page back to its file. */
+void page_cache_write(uint32_t inode, uint32_t index, uint32_t frame)
+{
+    ext2_write_page(inode, index * PAGE_SIZE, (void*)frame);
+}
+
+/*
+ * Forgets the pages of 'inode' after the file changed behind the cache.
+ * Mapped frames stay alive until their last mapping goes away.
+ */
+void page_cache_invalidate(uint32_t inode)
+{
+    page_cache_entry_t** link;
+    page_cache_entry_t* entry;
+    uint32_t flags;
+
+    if (!page_cache_entry_cache)
+        return;
+    flags = spin_lock_irqsave(&page_cache_lock);
+    for (uint32_t i = 0; i < PAGE_CACHE_HASH_SIZE; i++)
+    {
+        link = &page_cache[i];
+        while ((entry = *link))
+        {
+            if (entry->inode != inode)
+            {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            frame_ref_dec(entry->frame);
+            kmem_cache_free(page_cache_entry_cache, entry);
+            nr_pages--;
+        }
+    }
+    spin_unlock_irqrestore(&page_cache_lock, flags);
+}
+
+/* Frees the cached pages nobody maps. Returns how many were freed. */
+uint32_t page_cache_shrink()
+{
+    page_cache_entry_t** link;
+    page_cache_entry_t* entry;
+    uint32_t freed = 0;
+    uint32_t flags;
+
+    flags = spin_lock_irqsave(&page_cache_lock);
+    for (uint32_t i = 0; i < PAGE_CACHE_HASH_SIZE; i++)
+    {
+        link = &page_cache[i];
+        while ((entry = *link))
+        {
+            if (frame_ref_count(entry->frame) > 1)
+            {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            frame_ref_dec(entry->frame);
+            kmem_cache_free(page_cache_entry_cache, entry);
+            nr_pages--;
+            freed++;
+        }
+    }
+    spin_unlock_irqrestore(&page_cache_lock, flags);
+    return freed;
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           TESTS                                            */
+/*                                                                            */
+/*############################################################################*/
+
+static void show_page_cache()
+{
+    printf("Page cache: %u pages (%u KB), %u hits, %u misses\n",
+            nr_pages, nr_pages * (PAGE_SIZE / 1024), hits, misses);
+}
+
+static void drop_page_cache()
+{
+    printf("Dropped %u pages\n", page_cache_shrink());
+}
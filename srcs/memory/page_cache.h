@@ -0,0 +1,25 @@
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include "../utils/stdint.h"
+
+/*
+ * File pages cached in whole frames, keyed by (inode, page index). The
+ * cache owns one reference on each frame and every mapping of it another
+ * one, so a frame can be shared by all tasks mapping the same file page.
+ */
+typedef struct page_cache_entry
+{
+    uint32_t inode;
+    uint32_t index;
+    uint32_t frame;
+    struct page_cache_entry* next;
+} page_cache_entry_t;
+
+void page_cache_init();
+uint32_t page_cache_get(uint32_t inode, uint32_t index);
+void page_cache_write(uint32_t inode, uint32_t index, uint32_t frame);
+void page_cache_invalidate(uint32_t inode);
+uint32_t page_cache_shrink();
+
+#endif
@@ -1,13 +1,81 @@
 #include "../utils/stdint.h"
 #include "../utils/utils.h"
 #include "../display/display.h"
+#include "../kshell/kshell.h"
+#include "../boot/multiboot.h"
+#include "pmm.h"
+#include "../utils/spinlock.h"
+#include "../smp/smp.h"
 
 #define PAGE_SIZE   0x1000
-#define MAX_FRAMES 1024 * 1024  // Increase to support larger memory allocations
+#define ALIGN_4K(x) (((x) + 0xFFF) & ~0xFFF)
+/* Used when the bootloader gives us no memory information at all. */
+#define PMM_DEFAULT_MEMORY MB(64)
 
-static uint8_t frame_bitmap[MAX_FRAMES / 8]; 
-// 1 bit per frame, so each bit says: used(1)/free(0). 
-// For 256K frames, that’s 32 KB of bitmap.
+/* frame_order[] flag: the frame heads a free block of the stored order. */
+#define FRAME_FREE      0x80
+
+/* Frames moved between a magazine and the buddy lists at a time. */
+#define FRAME_MAG_BATCH 16
+#define FRAME_MAG_SIZE  (2 * FRAME_MAG_BATCH)
+
+/* Free blocks are linked through their own (identity-mapped) memory. */
+typedef struct free_block
+{
+    struct free_block* next;
+    struct free_block* prev;
+} free_block_t;
+
+typedef struct
+{
+    free_block_t* head;
+    uint32_t count;
+} free_area_t;
+
+/*
+ * Single frames are served from a small magazine in front of the buddy
+ * lists. It is a stack: the most recently freed frame, the one most
+ * likely still in the CPU cache, is handed out first, and the coldest
+ * frames at the bottom go back to the buddy lists when it overflows.
+ * There is one magazine per CPU so the fast path never needs the buddy
+ * allocator. Its lock is only contended while a CPU out of memory drains
+ * everyone's magazines; it is taken before buddy_lock.
+ */
+typedef struct
+{
+    spinlock_t lock;
+    uint32_t count;
+    uint32_t frames[FRAME_MAG_SIZE];
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t refills;
+    uint32_t drains;
+} frame_magazine_t;
+
+extern uint32_t endkernel;
+
+/* Both arrays live right after the kernel image and are sized at boot. */
+static uint8_t* frame_bitmap;
+// 1 bit per frame, so each bit says: used(1)/free(0).
+// For 3 GB of RAM that's 96 KB of bitmap.
+
+static uint8_t* frame_order;
+/* Mappings per frame, so copy-on-write pages know when they are shared. */
+static uint16_t* frame_refs;
+static uint32_t max_frames;
+static uint32_t memory_end;
+static uint32_t reserved_end;
+static free_area_t free_area[PMM_MAX_ORDER];
+static frame_magazine_t frame_magazines[PMM_MAX_CPUS];
+/* Free lists, frame_bitmap and the frame_order of free blocks */
+static spinlock_t buddy_lock = SPINLOCK_INIT;
+
+static void show_pmm();
+
+static command_t commands[] = {
+    {"memory", "Show free blocks per buddy order", show_pmm},
+    {NULL, NULL, NULL}
+};
 
 static inline void set_frame_used(uint32_t frame_number) {
     frame_bitmap[frame_number / 8] |=  (1 << (frame_number % 8));
@@ -19,59 +87,483 @@ static inline bool is_frame_used(uint32_t frame_number) {
     return (frame_bitmap[frame_number / 8] & (1 << (frame_number % 8))) != 0;
 }
 
+static void free_area_push(uint32_t frame_number, uint32_t order)
+{
+    free_block_t* block = (free_block_t*)(frame_number * PAGE_SIZE);
+
+    block->prev = NULL;
+    block->next = free_area[order].head;
+    if (block->next)
+        block->next->prev = block;
+    free_area[order].head = block;
+    free_area[order].count++;
+    frame_order[frame_number] = order | FRAME_FREE;
+}
+
+static void free_area_remove(uint32_t frame_number, uint32_t order)
+{
+    free_block_t* block = (free_block_t*)(frame_number * PAGE_SIZE);
+
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        free_area[order].head = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+    free_area[order].count--;
+    frame_order[frame_number] = order;
+}
+
+/* Merges a block with its free buddies and puts the result on its list. */
+static void buddy_free(uint32_t frame_number, uint32_t order)
+{
+    uint32_t buddy;
+
+    while (order < PMM_MAX_ORDER - 1)
+    {
+        buddy = frame_number ^ (1 << order);
+        if (buddy + (1 << order) > max_frames)
+            break;
+        if (frame_order[buddy] != (order | FRAME_FREE))
+            break;
+
+        free_area_remove(buddy, order);
+        frame_number &= ~(1 << order);
+        order++;
+    }
+    free_area_push(frame_number, order);
+}
+
+/* Releases [start, end) into the buddy lists as the largest aligned blocks. */
+static void pmm_free_range(uint32_t start, uint32_t end)
+{
+    uint32_t frame_number = start / PAGE_SIZE;
+    uint32_t last = end / PAGE_SIZE;
+    uint32_t order;
+
+    while (frame_number < last)
+    {
+        order = PMM_MAX_ORDER - 1;
+        while ((frame_number & ((1 << order) - 1)) || frame_number + (1 << order) > last)
+            order--;
+
+        for (uint32_t f = frame_number; f < frame_number + (1 << order); f++)
+            set_frame_free(f);
+        buddy_free(frame_number, order);
+        frame_number += 1 << order;
+    }
+}
+
+/* Clamps a multiboot region to what the direct map can reach. */
+static bool clamp_region(uint64_t addr, uint64_t len, uint32_t* start, uint32_t* end)
+{
+    uint64_t region_end = addr + len;
+
+    if (addr >= PMM_MEMORY_LIMIT)
+        return false;
+    if (region_end > PMM_MEMORY_LIMIT)
+        region_end = PMM_MEMORY_LIMIT;
+
+    *start = ALIGN_4K((uint32_t)addr);
+    *end = (uint32_t)region_end & ~0xFFF;
+    return *start < *end;
+}
+
+/* Highest usable address reported by the bootloader. */
+static uint32_t find_memory_end(multiboot_info_t* mbi)
+{
+    multiboot_mmap_entry_t* entry;
+    uintptr_t mmap_end;
+    uint32_t start;
+    uint32_t end;
+    uint32_t top = 0;
+
+    if (!mbi)
+        return PMM_DEFAULT_MEMORY;
+
+    if (mbi->flags & MULTIBOOT_INFO_MEM_MAP)
+    {
+        entry = (multiboot_mmap_entry_t*)mbi->mmap_addr;
+        mmap_end = mbi->mmap_addr + mbi->mmap_length;
+        while ((uintptr_t)entry < mmap_end)
+        {
+            if (entry->type == MULTIBOOT_MEMORY_AVAILABLE &&
+                clamp_region(entry->addr, entry->len, &start, &end) && end > top)
+                top = end;
+            entry = (multiboot_mmap_entry_t*)((uintptr_t)entry + entry->size + sizeof(entry->size));
+        }
+        return top;
+    }
+
+    if (mbi->flags & MULTIBOOT_INFO_MEMORY)
+    {
+        clamp_region(0x100000, (uint64_t)mbi->mem_upper * 1024, &start, &end);
+        return end;
+    }
+
+    return PMM_DEFAULT_MEMORY;
+}
+
+/* Frees every available range above the kernel image and the PMM metadata. */
+static void free_available_memory(multiboot_info_t* mbi)
+{
+    multiboot_mmap_entry_t* entry;
+    uintptr_t mmap_end;
+    uint32_t start;
+    uint32_t end;
+
+    if (!mbi || !(mbi->flags & MULTIBOOT_INFO_MEM_MAP))
+    {
+        pmm_free_range(reserved_end, memory_end);
+        return;
+    }
+
+    entry = (multiboot_mmap_entry_t*)mbi->mmap_addr;
+    mmap_end = mbi->mmap_addr + mbi->mmap_length;
+    while ((uintptr_t)entry < mmap_end)
+    {
+        if (entry->type == MULTIBOOT_MEMORY_AVAILABLE &&
+            clamp_region(entry->addr, entry->len, &start, &end))
+        {
+            if (start < reserved_end)
+                start = reserved_end;
+            if (start < end)
+                pmm_free_range(start, end);
+        }
+        entry = (multiboot_mmap_entry_t*)((uintptr_t)entry + entry->size + sizeof(entry->size));
+    }
+}
+
 /**
- * Example PMM init:
- *   - All frames default to used
- *   - Mark only a certain region as free, or parse BIOS map to free them properly
+ * PMM init:
+ *   - The frame bitmap and order table are placed right after the kernel
+ *     image and sized for the highest usable address of the memory map.
+ *   - All frames default to used; only the available regions of the
+ *     multiboot memory map above the kernel (and that metadata) are handed
+ *     to the buddy allocator.
+ */
+void pmm_init(multiboot_info_t* mbi)
+{
+    uintptr_t metadata;
+
+    memory_end = find_memory_end(mbi);
+    if (memory_end < MB(4))
+        kernel_panic("pmm_init: not enough memory!\n");
+    max_frames = memory_end / PAGE_SIZE;
+
+    metadata = ALIGN_4K((uintptr_t)&endkernel);
+    frame_bitmap = (uint8_t*)metadata;
+    frame_order = (uint8_t*)(metadata + (max_frames + 7) / 8);
+    frame_refs = (uint16_t*)(((uintptr_t)frame_order + max_frames + 1) & ~1);
+    reserved_end = ALIGN_4K((uintptr_t)(frame_refs + max_frames));
+    if (reserved_end < 0x100000)
+        reserved_end = 0x100000;
+
+    memset(frame_bitmap, 0xFF, (max_frames + 7) / 8);
+    memset(frame_order, 0, max_frames);
+    memset(frame_refs, 0, max_frames * sizeof(uint16_t));
+    memset(free_area, 0, sizeof(free_area));
+    memset(frame_magazines, 0, sizeof(frame_magazines));
+
+    free_available_memory(mbi);
+
+    install_all_cmds(commands, MEMORY);
+}
+
+uint32_t pmm_get_memory_end()
+{
+    return memory_end;
+}
+
+uint32_t pmm_get_reserved_end()
+{
+    return reserved_end;
+}
+
+/* Magazine of the CPU we run on. Interrupts must be off until it is locked. */
+static inline frame_magazine_t* this_cpu_magazine()
+{
+    return &frame_magazines[smp_processor_id()];
+}
+
+/*
+ * Takes the smallest free block of at least 2^order frames and splits it
+ * down, handing the upper halves back to the lower order lists. The block
+ * is marked used. Returns its first frame number, 0 when out of memory.
  */
-void pmm_init()
+static uint32_t buddy_alloc(uint32_t order)
 {
-    /* Mark everything used by default */
-    for (uint32_t f = 0; f < (0x100000 / PAGE_SIZE); f++)
+    uint32_t current;
+    uint32_t frame_number;
+
+    for (current = order; current < PMM_MAX_ORDER; current++)
+    {
+        if (free_area[current].head)
+            break;
+    }
+    if (current == PMM_MAX_ORDER)
+        return 0;
+
+    frame_number = (uint32_t)free_area[current].head / PAGE_SIZE;
+    free_area_remove(frame_number, current);
+
+    while (current > order)
     {
+        current--;
+        free_area_push(frame_number + (1 << current), current);
+    }
+
+    frame_order[frame_number] = order;
+    for (uint32_t f = frame_number; f < frame_number + (1 << order); f++)
         set_frame_used(f);
+    return frame_number;
+}
+
+/*
+ * Magazine frames stay marked used with no reference, so the buddy lists
+ * cannot merge them and a second free of one is still caught.
+ */
+static void magazine_drain(frame_magazine_t* mag, uint32_t count)
+{
+    uint32_t frame_number;
+
+    if (count > mag->count)
+        count = mag->count;
+    spin_lock(&buddy_lock);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        frame_number = mag->frames[i];
+        set_frame_free(frame_number);
+        buddy_free(frame_number, 0);
     }
+    spin_unlock(&buddy_lock);
+    mag->count -= count;
+    memmove(mag->frames, mag->frames + count, mag->count * sizeof(uint32_t));
+    mag->drains++;
+}
+
+static void magazine_refill(frame_magazine_t* mag)
+{
+    uint32_t frame_number;
 
-    /* Initialize the rest as free
-    */
-    for (uint32_t f = (0x100000 / PAGE_SIZE); f < (MB(64) / PAGE_SIZE); f++)
+    spin_lock(&buddy_lock);
+    while (mag->count < FRAME_MAG_BATCH)
     {
-        set_frame_free(f);
+        frame_number = buddy_alloc(0);
+        if (!frame_number)
+            break;
+        mag->frames[mag->count++] = frame_number;
     }
+    spin_unlock(&buddy_lock);
+    mag->refills++;
+}
 
-    /* TODO:
-     * Maybe I must parse BIOS memory map to free all the regions that are free
-     * and mark the used regions as used. So for now it is ok but not correct.
-     */
-    for (uint32_t f = 0x100000 / PAGE_SIZE; f < 0x120000 / PAGE_SIZE; f++)
+/* Gives every cached frame back, so the buddy lists can merge them again. */
+static void drain_all_magazines()
+{
+    frame_magazine_t* mag;
+
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++)
     {
-        set_frame_used(f);
+        mag = &frame_magazines[cpu];
+        spin_lock(&mag->lock);
+        if (mag->count)
+            magazine_drain(mag, mag->count);
+        spin_unlock(&mag->lock);
     }
 }
 
 /**
- * allocate_frame:
- *   Finds the first free bit in the bitmap, sets it to used,
- *   returns physical address of that frame * PAGE_SIZE.
+ * alloc_frames:
+ *   Takes a free block of 2^order frames from the buddy lists. Frames held
+ *   by the magazines are flushed back once before giving up.
+ *   Returns the physical address of the first frame, 0 when out of memory.
+ */
+uint32_t alloc_frames(uint32_t order)
+{
+    uint32_t frame_number;
+    uint32_t flags;
+
+    if (order >= PMM_MAX_ORDER)
+        return 0;
+
+    flags = spin_lock_irqsave(&buddy_lock);
+    frame_number = buddy_alloc(order);
+    if (!frame_number)
+    {
+        /* Magazine locks come first */
+        spin_unlock(&buddy_lock);
+        drain_all_magazines();
+        spin_lock(&buddy_lock);
+        frame_number = buddy_alloc(order);
+    }
+    if (!frame_number)
+    {
+        spin_unlock_irqrestore(&buddy_lock, flags);
+        puts_color("pmm: out of memory!\n", RED);
+        return 0;
+    }
+
+    for (uint32_t f = frame_number; f < frame_number + (1 << order); f++)
+        frame_refs[f] = 1;
+    spin_unlock_irqrestore(&buddy_lock, flags);
+
+    return frame_number * PAGE_SIZE;  // physical addr
+}
+
+void free_frames(uint32_t phys_addr, uint32_t order)
+{
+    uint32_t frame_number = phys_addr / PAGE_SIZE;
+    uint32_t flags;
+
+    if (order >= PMM_MAX_ORDER || frame_number + (1 << order) > max_frames)
+        return;
+    if (frame_number & ((1 << order) - 1))
+    {
+        puts_color("pmm: unaligned free!\n", RED);
+        return;
+    }
+    if (!is_frame_used(frame_number) || !frame_refs[frame_number])
+    {
+        puts_color("pmm: double free!\n", RED);
+        return;
+    }
+
+    flags = spin_lock_irqsave(&buddy_lock);
+    for (uint32_t f = frame_number; f < frame_number + (1 << order); f++)
+    {
+        set_frame_free(f);
+        frame_refs[f] = 0;
+    }
+    buddy_free(frame_number, order);
+    spin_unlock_irqrestore(&buddy_lock, flags);
+}
+
+/*
+ * Single frame, hottest first, from the magazine of the current CPU.
+ * Interrupts stay off while the magazine is in use.
  */
 uint32_t allocate_frame()
 {
-    for (uint32_t frame_number = 0; frame_number < MAX_FRAMES; frame_number++)
+    frame_magazine_t* mag;
+    uint32_t frame_number;
+    uint32_t flags;
+
+    flags = irq_save();
+    mag = this_cpu_magazine();
+    spin_lock(&mag->lock);
+    if (mag->count)
+        mag->hits++;
+    else
     {
-        if (!is_frame_used(frame_number))
+        mag->misses++;
+        magazine_refill(mag);
+        if (!mag->count)
         {
-            set_frame_used(frame_number);
-            return frame_number * PAGE_SIZE;  // physical addr
+            spin_unlock_irqrestore(&mag->lock, flags);
+            return alloc_frames(0);
         }
     }
 
-    puts_color("vmalloc: out of memory!\n", RED);
-    /* Out of memory! */
-    return 0;
+    frame_number = mag->frames[--mag->count];
+    frame_refs[frame_number] = 1;
+    spin_unlock_irqrestore(&mag->lock, flags);
+    return frame_number * PAGE_SIZE;
+}
+
+static void magazine_free(uint32_t frame_number)
+{
+    uint32_t flags = irq_save();
+    frame_magazine_t* mag = this_cpu_magazine();
+
+    spin_lock(&mag->lock);
+    frame_refs[frame_number] = 0;
+    frame_order[frame_number] = 0;
+    if (mag->count == FRAME_MAG_SIZE)
+        magazine_drain(mag, FRAME_MAG_BATCH);
+    mag->frames[mag->count++] = frame_number;
+    spin_unlock_irqrestore(&mag->lock, flags);
 }
 
 void free_frame(uint32_t phys_addr)
 {
     uint32_t frame_number = phys_addr / PAGE_SIZE;
-    set_frame_free(frame_number);
+
+    if (frame_number >= max_frames)
+        return;
+    if (!is_frame_used(frame_number) || !frame_refs[frame_number])
+    {
+        puts_color("pmm: double free!\n", RED);
+        return;
+    }
+    magazine_free(frame_number);
+}
+
+/* A frame starts with one reference when allocated; sharers take more. */
+void frame_ref_inc(uint32_t phys_addr)
+{
+    uint32_t frame_number = phys_addr / PAGE_SIZE;
+
+    if (frame_number < max_frames && frame_refs[frame_number])
+        __atomic_add_fetch(&frame_refs[frame_number], 1, __ATOMIC_RELAXED);
+}
+
+/* Drops a reference and frees the frame with the last one. */
+uint32_t frame_ref_dec(uint32_t phys_addr)
+{
+    uint32_t frame_number = phys_addr / PAGE_SIZE;
+    uint32_t refs;
+
+    if (frame_number >= max_frames || !frame_refs[frame_number])
+        return 0;
+    /* Two sharers may drop theirs at once: only one sees it reach 0 */
+    refs = __atomic_sub_fetch(&frame_refs[frame_number], 1, __ATOMIC_ACQ_REL);
+    if (refs == 0)
+    {
+        frame_refs[frame_number] = 1;
+        free_frame(frame_number * PAGE_SIZE);
+    }
+    return refs;
+}
+
+uint32_t frame_ref_count(uint32_t phys_addr)
+{
+    uint32_t frame_number = phys_addr / PAGE_SIZE;
+
+    return frame_number < max_frames ? frame_refs[frame_number] : 0;
+}
+
+static void show_pmm()
+{
+    frame_magazine_t* mag;
+    uint32_t total = 0;
+    uint32_t requests;
+    uint32_t hits;
+
+    printf("Buddy allocator free lists:\n");
+    for (uint32_t order = 0; order < PMM_MAX_ORDER; order++)
+    {
+        printf("  order %d (%z KB): %z free\n", order,
+                (size_t)(PAGE_SIZE << order) / 1024, (size_t)free_area[order].count);
+        total += free_area[order].count << order;
+    }
+    for (uint32_t cpu = 0; cpu < cpu_count; cpu++)
+    {
+        mag = &frame_magazines[cpu];
+        hits = mag->hits;
+        requests = mag->hits + mag->misses;
+        /* No 64-bit division here: scale down before taking the percentage */
+        while (requests > 0xFFFFFFFF / 100)
+        {
+            hits >>= 1;
+            requests >>= 1;
+        }
+        printf("  magazine cpu%d: %z cached, %z hits, %z misses (%z%c hit), %z refills, %z drains\n",
+                cpu, (size_t)mag->count, (size_t)mag->hits, (size_t)mag->misses,
+                (size_t)(requests ? hits * 100 / requests : 0), '%',
+                (size_t)mag->refills, (size_t)mag->drains);
+        total += mag->count;
+    }
+    printf("Free frames: %z of %z (%z KB)\n", (size_t)total, (size_t)max_frames,
+            (size_t)total * (PAGE_SIZE / 1024));
 }
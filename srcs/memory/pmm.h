@@ -2,9 +2,27 @@
 #define PMM_H
 
 #include "../utils/stdint.h"
+#include "../boot/multiboot.h"
+#include "../smp/smp.h"
 
-void pmm_init();
+/* Orders 0..PMM_MAX_ORDER-1, i.e. blocks from 4 KB up to 4 MB. */
+#define PMM_MAX_ORDER 11
+
+/* Magazines of single frames kept in front of the buddy lists, one per CPU. */
+#define PMM_MAX_CPUS MAX_CPUS
+
+/* RAM above this is left alone: the kernel windows live past it. */
+#define PMM_MEMORY_LIMIT 0xC0000000
+
+void pmm_init(multiboot_info_t* mbi);
+uint32_t pmm_get_memory_end();
+uint32_t pmm_get_reserved_end();
+uint32_t alloc_frames(uint32_t order);
+void free_frames(uint32_t phys_addr, uint32_t order);
 uint32_t allocate_frame();
 void free_frame(uint32_t phys_addr);
+void frame_ref_inc(uint32_t phys_addr);
+uint32_t frame_ref_dec(uint32_t phys_addr);
+uint32_t frame_ref_count(uint32_t phys_addr);
 
-#endif
\ No newline at end of file
+#endif
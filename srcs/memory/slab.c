@@ -0,0 +1,307 @@
+#include "../utils/stdint.h"
+#include "../utils/utils.h"
+#include "../display/display.h"
+#include "../kshell/kshell.h"
+#include "pmm.h"
+#include "slab.h"
+#include "../utils/spinlock.h"
+
+/*############################################################################*/
+/*                                                                            */
+/*                           DEFINES                                          */
+/*                                                                            */
+/*############################################################################*/
+#define ALIGN_UP(x, a)  (((x) + (a) - 1) & ~((a) - 1))
+#define SLAB_DEFAULT_ALIGN  8
+/* Cached empty slabs kept per cache before frames go back to the PMM. */
+#define SLAB_MAX_EMPTY  1
+
+#define KMALLOC_MIN_SHIFT   4  /* 16 bytes */
+#define KMALLOC_CLASSES     8  /* 16 ... 2048 bytes */
+
+/*############################################################################*/
+/*                                                                            */
+/*                           LOCALS                                           */
+/*                                                                            */
+/*############################################################################*/
+static void slabinfo();
+
+static kmem_cache_t cache_cache;
+static kmem_cache_t* cache_chain = NULL;
+static spinlock_t chain_lock = SPINLOCK_INIT;
+static kmem_cache_t* kmalloc_caches[KMALLOC_CLASSES];
+
+static const char* kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+static command_t commands[] = {
+    {"slabinfo", "Show slab cache usage", slabinfo},
+    {NULL, NULL, NULL}
+};
+
+/*############################################################################*/
+/*                                                                            */
+/*                           FUNCTIONS                                        */
+/*                                                                            */
+/*############################################################################*/
+
+static void slab_list_push(kmem_slab_t** head, kmem_slab_t* slab)
+{
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head)
+        (*head)->prev = slab;
+    *head = slab;
+}
+
+static void slab_list_remove(kmem_slab_t** head, kmem_slab_t* slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *head = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+/* Objects of a cache with a constructor keep their free-list link after
+ * the payload, so constructed state survives a free/alloc round trip.
+ */
+static inline void** object_link(kmem_cache_t* cache, void* obj)
+{
+    return (void**)((uintptr_t)obj + (cache->ctor ? ALIGN_UP(cache->object_size, sizeof(void*)) : 0));
+}
+
+static size_t object_stride(kmem_cache_t* cache)
+{
+    size_t stride = cache->object_size;
+
+    if (cache->ctor)
+        stride = ALIGN_UP(stride, sizeof(void*)) + sizeof(void*);
+    if (stride < sizeof(void*))
+        stride = sizeof(void*);
+    return ALIGN_UP(stride, cache->align);
+}
+
+static kmem_slab_t* slab_create(kmem_cache_t* cache)
+{
+    kmem_slab_t* slab;
+    uintptr_t obj;
+    size_t stride;
+    uint32_t i;
+
+    slab = (kmem_slab_t*)alloc_frames(SLAB_ORDER);
+    if (!slab)
+        return NULL;
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free_objects = NULL;
+
+    stride = object_stride(cache);
+    obj = ALIGN_UP((uintptr_t)slab + sizeof(kmem_slab_t), cache->align) + stride * (cache->objects_per_slab - 1);
+    for (i = 0; i < cache->objects_per_slab; i++, obj -= stride)
+    {
+        if (cache->ctor)
+            cache->ctor((void*)obj);
+        *object_link(cache, (void*)obj) = slab->free_objects;
+        slab->free_objects = (void*)obj;
+    }
+
+    cache->nr_slabs++;
+    return slab;
+}
+
+static void slab_destroy(kmem_cache_t* cache, kmem_slab_t* slab)
+{
+    cache->nr_slabs--;
+    free_frames((uint32_t)slab, SLAB_ORDER);
+}
+
+static void cache_setup(kmem_cache_t* cache, const char* name, size_t size, size_t align, kmem_ctor_t ctor)
+{
+    uint32_t flags;
+
+    memset(cache, 0, sizeof(kmem_cache_t));
+    if (align < SLAB_DEFAULT_ALIGN)
+        align = SLAB_DEFAULT_ALIGN;
+
+    cache->name = name;
+    cache->object_size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+    cache->objects_per_slab = (SLAB_SIZE - ALIGN_UP(sizeof(kmem_slab_t), align)) / object_stride(cache);
+
+    flags = spin_lock_irqsave(&chain_lock);
+    cache->next = cache_chain;
+    cache_chain = cache;
+    spin_unlock_irqrestore(&chain_lock, flags);
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor)
+{
+    kmem_cache_t* cache;
+
+    /* Alignment must be a power of two and objects must fit a slab. */
+    if ((align & (align - 1)) || size == 0 || size > SLAB_SIZE / 2)
+        return NULL;
+
+    cache = kmem_cache_alloc(&cache_cache);
+    if (!cache)
+        return NULL;
+
+    cache_setup(cache, name, size, align, ctor);
+    return cache;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache)
+{
+    kmem_slab_t* slab;
+    uint32_t flags;
+    void* obj;
+
+    flags = spin_lock_irqsave(&cache->lock);
+    slab = cache->partial;
+    if (!slab)
+    {
+        slab = cache->empty;
+        if (slab)
+        {
+            slab_list_remove(&cache->empty, slab);
+            cache->nr_empty--;
+        }
+        else
+        {
+            slab = slab_create(cache);
+            if (!slab)
+            {
+                spin_unlock_irqrestore(&cache->lock, flags);
+                puts_color("kmem_cache_alloc: out of frames!\n", RED);
+                return NULL;
+            }
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    obj = slab->free_objects;
+    slab->free_objects = *object_link(cache, obj);
+    slab->inuse++;
+    cache->active_objects++;
+
+    if (slab->inuse == cache->objects_per_slab)
+    {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj)
+{
+    kmem_slab_t* slab;
+    uint32_t flags;
+
+    if (!obj)
+        return;
+
+    slab = (kmem_slab_t*)((uintptr_t)obj & ~(SLAB_SIZE - 1));
+    if (slab->cache != cache)
+    {
+        puts_color("kmem_cache_free: object does not belong to cache!\n", RED);
+        return;
+    }
+
+    flags = spin_lock_irqsave(&cache->lock);
+    if (slab->inuse == cache->objects_per_slab)
+    {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    *object_link(cache, obj) = slab->free_objects;
+    slab->free_objects = obj;
+    slab->inuse--;
+    cache->active_objects--;
+
+    if (slab->inuse == 0)
+    {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->nr_empty < SLAB_MAX_EMPTY)
+        {
+            slab_list_push(&cache->empty, slab);
+            cache->nr_empty++;
+        }
+        else
+        {
+            slab_destroy(cache, slab);
+        }
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+void kmem_cache_init()
+{
+    uint32_t i;
+
+    cache_chain = NULL;
+    cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0, NULL);
+
+    for (i = 0; i < KMALLOC_CLASSES; i++)
+    {
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], 1 << (KMALLOC_MIN_SHIFT + i), 0, NULL);
+        if (!kmalloc_caches[i])
+            kernel_panic("kmem_cache_init: cannot create kmalloc caches!\n");
+    }
+
+    install_all_cmds(commands, MEMORY);
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           KMALLOC SIZE CLASSES                             */
+/*                                                                            */
+/*############################################################################*/
+
+void* kmalloc_small(size_t size)
+{
+    uint32_t i = 0;
+
+    while ((1U << (KMALLOC_MIN_SHIFT + i)) < size)
+        i++;
+    return kmem_cache_alloc(kmalloc_caches[i]);
+}
+
+void kfree_small(void* ptr)
+{
+    kmem_slab_t* slab = (kmem_slab_t*)((uintptr_t)ptr & ~(SLAB_SIZE - 1));
+    kmem_cache_free(slab->cache, ptr);
+}
+
+size_t ksize_small(void* ptr)
+{
+    kmem_slab_t* slab = (kmem_slab_t*)((uintptr_t)ptr & ~(SLAB_SIZE - 1));
+    return slab->cache->object_size;
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           TESTS                                            */
+/*                                                                            */
+/*############################################################################*/
+
+static void slabinfo()
+{
+    kmem_cache_t* cache;
+
+    printf("Slab caches:\n");
+    for (cache = cache_chain; cache; cache = cache->next)
+    {
+        printf("  %s: size=%z active=%z per_slab=%z slabs=%z empty=%z\n", cache->name, cache->object_size,
+                (size_t)cache->active_objects, (size_t)cache->objects_per_slab,
+                (size_t)cache->nr_slabs, (size_t)cache->nr_empty);
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "../utils/stdint.h"
+#include "../utils/spinlock.h"
+
+/* Every slab is one 2^SLAB_ORDER frame buddy block, aligned to its size. */
+#define SLAB_ORDER      2
+#define SLAB_SIZE       (0x1000 << SLAB_ORDER)
+
+/* kmalloc() serves sizes up to this from the size-class caches. */
+#define KMALLOC_MAX_CACHE_SIZE 2048
+
+typedef void (*kmem_ctor_t)(void* obj);
+
+typedef struct kmem_slab
+{
+    struct kmem_slab* next;
+    struct kmem_slab* prev;
+    struct kmem_cache* cache;
+    void* free_objects;         /* Singly linked through the free objects */
+    uint32_t inuse;
+} kmem_slab_t;
+
+typedef struct kmem_cache
+{
+    const char* name;
+    spinlock_t lock;            /* Slab lists and counters */
+    size_t object_size;
+    size_t align;
+    uint32_t objects_per_slab;
+    kmem_ctor_t ctor;
+    kmem_slab_t* partial;
+    kmem_slab_t* full;
+    kmem_slab_t* empty;
+    uint32_t nr_slabs;
+    uint32_t nr_empty;
+    uint32_t active_objects;
+    struct kmem_cache* next;    /* All caches, for 'slabinfo' */
+} kmem_cache_t;
+
+void kmem_cache_init();
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor);
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+void* kmalloc_small(size_t size);
+void kfree_small(void* ptr);
+size_t ksize_small(void* ptr);
+
+#endif
@@ -0,0 +1,73 @@
+; AP startup trampoline. smp_init() copies it to AP_TRAMPOLINE and fills in
+; ap_params; each AP then starts here in real mode, at CS:IP = 0x0800:0000.
+; Only the copy ever runs, so addresses go through REL().
+[BITS 16]
+
+AP_TRAMPOLINE equ 0x8000
+%define REL(x) (AP_TRAMPOLINE + (x) - ap_trampoline_start)
+
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_params
+
+ap_trampoline_start:
+	cli
+	cld
+	xor ax, ax
+	mov ds, ax
+	lgdt [REL(ap_gdt_ptr)]
+
+	mov eax, cr0
+	or eax, 1               ; Protected mode
+	mov cr0, eax
+	jmp dword 0x08:REL(ap_protected)
+
+[BITS 32]
+ap_protected:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+
+	; Paging as the BSP has it: PSE before paging, PGE only after
+	mov eax, [REL(ap_params) + 4]
+	and eax, ~0x80
+	mov cr4, eax
+	mov eax, [REL(ap_params)]
+	mov cr3, eax
+	mov eax, cr0
+	or eax, 0x80010000      ; PG | WP
+	mov cr0, eax
+	mov eax, [REL(ap_params) + 4]
+	mov cr4, eax
+
+	mov esp, [REL(ap_params) + 8]
+	push dword [REL(ap_params) + 16]    ; CPU index
+	call [REL(ap_params) + 12]          ; ap_main(), never returns
+.hang:
+	cli
+	hlt
+	jmp .hang
+
+; Flat code and data at the selectors the kernel GDT uses
+align 8
+ap_gdt:
+	dq 0
+	dq 0x00CF9A000000FFFF
+	dq 0x00CF92000000FFFF
+ap_gdt_ptr:
+	dw ap_gdt_ptr - ap_gdt - 1
+	dd REL(ap_gdt)
+
+; Same layout as ap_params_t in smp.c
+ap_params:
+	dd 0                    ; cr3
+	dd 0                    ; cr4
+	dd 0                    ; stack top
+	dd 0                    ; entry
+	dd 0                    ; CPU index
+ap_trampoline_end:
+
+section .note.GNU-stack noalloc noexec nowrite progbits
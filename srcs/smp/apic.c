@@ -0,0 +1,261 @@
+#include "apic.h"
+#include "smp.h"
+#include "../io/io.h"
+#include "../memory/memory.h"
+#include "../timers/timers.h"
+#include "../keyboard/idt.h"
+#include "../utils/cpu.h"
+
+/*############################################################################*/
+/*                                                                            */
+/*                           DEFINES                                          */
+/*                                                                            */
+/*############################################################################*/
+#define PIC1_DATA       0x21
+#define PIC2_COMMAND    0xA0
+#define PIC2_DATA       0xA1
+#define PIC_READ_IRR    0x0A
+
+/* Interrupt mode configuration register, on boards that have one */
+#define IMCR_SELECT     0x22
+#define IMCR_DATA       0x23
+#define IMCR_APIC       0x01
+
+/* PIT ticks the LAPIC timer is measured against */
+#define CALIBRATE_TICKS 5
+
+/*############################################################################*/
+/*                                                                            */
+/*                           LOCALS                                           */
+/*                                                                            */
+/*############################################################################*/
+static volatile uint32_t* lapic = NULL;
+static volatile uint32_t* ioapic = NULL;
+static bool ioapic_active = false;
+static uint32_t lapic_timer_count = 0;  /* LAPIC timer counts per tick */
+/* IO-APIC input of each ISA IRQ, identity unless the MP tables say else */
+static uint8_t irq_pin[ISA_IRQS] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+
+/*############################################################################*/
+/*                                                                            */
+/*                           LOCAL APIC                                       */
+/*                                                                            */
+/*############################################################################*/
+
+static inline uint32_t lapic_read(uint32_t reg)
+{
+    return lapic[reg / sizeof(uint32_t)];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value)
+{
+    lapic[reg / sizeof(uint32_t)] = value;
+    (void)lapic_read(LAPIC_ID);   /* Wait for the write to land */
+}
+
+void lapic_map(uint32_t phys)
+{
+    lapic = ioremap(phys);
+}
+
+/* Run on every CPU. LINT0 is the PIC's line, the IO-APIC replaces it. */
+void lapic_init()
+{
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    /* Cleared by back to back writes */
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | SPURIOUS_VECTOR);
+    lapic_write(LAPIC_EOI, 0);
+}
+
+uint32_t lapic_id()
+{
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi()
+{
+    lapic_write(LAPIC_EOI, 0);
+}
+
+/* 'icr' is the low ICR word: delivery mode, level and vector. */
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr)
+{
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+        __asm__ __volatile__("pause");
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+        __asm__ __volatile__("pause");
+}
+
+/**
+ * lapic_timer_calibrate:
+ *   Counts how far the LAPIC timer gets in a few PIT ticks, on the BSP
+ *   with the PIT running. Every LAPIC runs off the same bus clock, so the
+ *   result holds for the APs too.
+ */
+void lapic_timer_calibrate()
+{
+    uint32_t start;
+
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+
+    /* Start on a tick edge */
+    start = get_kticks();
+    while (get_kticks() == start)
+        __asm__ __volatile__("hlt");
+    start = get_kticks();
+
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    while (get_kticks() - start < CALIBRATE_TICKS)
+        __asm__ __volatile__("hlt");
+    lapic_timer_count = (0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR)) / CALIBRATE_TICKS;
+    lapic_write(LAPIC_TIMER_INIT, 0);
+}
+
+/* Periodic scheduler tick of an AP, at PIT_FREQUENCY like the BSP's. */
+void lapic_timer_start()
+{
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+}
+
+/**
+ * lapic_timer_oneshot:
+ *   Tickless idle on an AP: the periodic tick becomes a single IRQ 'ticks'
+ *   ticks away, until lapic_timer_start() puts it back. The count is 32
+ *   bits, so unlike the PIT it reaches seconds away. Interrupts are off.
+ */
+void lapic_timer_oneshot(uint32_t ticks)
+{
+    if (!lapic_timer_count)
+        return;
+    if (ticks > 0xFFFFFFFF / lapic_timer_count)
+        ticks = 0xFFFFFFFF / lapic_timer_count;
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, ticks * lapic_timer_count);
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           IO APIC                                          */
+/*                                                                            */
+/*############################################################################*/
+
+static uint32_t ioapic_read(uint32_t reg)
+{
+    ioapic[IOAPIC_REGSEL / sizeof(uint32_t)] = reg;
+    return ioapic[IOAPIC_WIN / sizeof(uint32_t)];
+}
+
+static void ioapic_write(uint32_t reg, uint32_t value)
+{
+    ioapic[IOAPIC_REGSEL / sizeof(uint32_t)] = reg;
+    ioapic[IOAPIC_WIN / sizeof(uint32_t)] = value;
+}
+
+void ioapic_map(uint32_t phys)
+{
+    ioapic = ioremap(phys);
+}
+
+/* An MP table override, like the PIT on pin 2. */
+void ioapic_set_pin(uint8_t irq, uint8_t pin)
+{
+    if (irq < ISA_IRQS)
+        irq_pin[irq] = pin;
+}
+
+/* Edge triggered, active high, fixed delivery to one CPU, vector 32 + irq. */
+static void ioapic_route(uint32_t irq, uint32_t apic_id)
+{
+    uint32_t pin = irq_pin[irq];
+
+    ioapic_write(IOAPIC_REDTBL(pin) + 1, apic_id << 24);
+    ioapic_write(IOAPIC_REDTBL(pin), 32 + irq);
+}
+
+/**
+ * ioapic_enable:
+ *   Moves the IRQs we use from the PIC to the IO-APIC, all delivered to
+ *   the BSP. From here on irq_eoi() acknowledges the local APIC.
+ */
+void ioapic_enable(uint32_t bsp_apic_id, bool imcr)
+{
+    uint32_t flags = irq_save();
+    uint32_t pins;
+    uint32_t pin;
+
+    if (!ioapic)
+    {
+        irq_restore(flags);
+        return;
+    }
+    pins = ((ioapic_read(IOAPIC_VER) >> 16) & 0xFF) + 1;
+    for (pin = 0; pin < pins; pin++)
+        ioapic_write(IOAPIC_REDTBL(pin), LAPIC_LVT_MASKED);
+
+    if (imcr)
+    {
+        outb(IMCR_SELECT, 0x70);
+        outb(IMCR_DATA, IMCR_APIC);
+    }
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+
+    ioapic_route(0, bsp_apic_id);   /* PIT */
+    ioapic_route(1, bsp_apic_id);   /* Keyboard */
+    ioapic_route(14, bsp_apic_id);  /* Primary ATA */
+    ioapic_active = true;
+    irq_restore(flags);
+}
+
+bool ioapic_enabled()
+{
+    return ioapic_active;
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           IRQ HELPERS                                      */
+/*                                                                            */
+/*############################################################################*/
+
+/* 'irq' as irq_handler() numbers them: ISA ones, then the LAPIC ones. */
+void irq_eoi(uint32_t irq)
+{
+    if (ioapic_active || irq >= ISA_IRQS)
+    {
+        lapic_eoi();
+        return;
+    }
+    if (irq >= 8)
+        outb(PIC2_COMMAND, PIC_EOI);
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+/* Raised and not yet taken, for the BSP's ISA IRQs. */
+bool irq_is_pending(uint32_t irq)
+{
+    uint32_t vector = 32 + irq;
+
+    if (ioapic_active)
+        return (lapic_read(LAPIC_IRR + 0x10 * (vector / 32)) & (1U << (vector % 32))) != 0;
+    if (irq >= 8)
+    {
+        outb(PIC2_COMMAND, PIC_READ_IRR);
+        return (inb(PIC2_COMMAND) & (1 << (irq - 8))) != 0;
+    }
+    outb(PIC1_COMMAND, PIC_READ_IRR);
+    return (inb(PIC1_COMMAND) & (1 << irq)) != 0;
+}
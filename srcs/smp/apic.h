@@ -0,0 +1,61 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include "../utils/stdint.h"
+#include "../utils/utils.h"
+
+/* https://wiki.osdev.org/APIC */
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080   /* Task priority */
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0   /* Spurious vector, bit 8 enables */
+#define LAPIC_ESR           0x280   /* Error status */
+#define LAPIC_IRR           0x200   /* 8 registers, 0x10 apart */
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_LVT_ERROR     0x370
+#define LAPIC_TIMER_INIT    0x380
+#define LAPIC_TIMER_CUR     0x390
+#define LAPIC_TIMER_DIV     0x3E0
+
+#define LAPIC_SVR_ENABLE    0x100
+#define LAPIC_LVT_MASKED    0x10000
+#define LAPIC_LVT_NMI       0x400
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_DIV16   0x3
+
+#define LAPIC_ICR_FIXED     0x00000
+#define LAPIC_ICR_INIT      0x00500
+#define LAPIC_ICR_STARTUP   0x00600
+#define LAPIC_ICR_PENDING   0x01000 /* Delivery status */
+#define LAPIC_ICR_ASSERT    0x04000
+
+/* IO-APIC: an index register and a data window */
+#define IOAPIC_REGSEL       0x00
+#define IOAPIC_WIN          0x10
+#define IOAPIC_VER          0x01
+#define IOAPIC_REDTBL(pin)  (0x10 + 2 * (pin))
+
+#define ISA_IRQS            16
+
+void lapic_map(uint32_t phys);
+void lapic_init();
+uint32_t lapic_id();
+void lapic_eoi();
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr);
+void lapic_timer_calibrate();
+void lapic_timer_start();
+void lapic_timer_oneshot(uint32_t ticks);
+
+void ioapic_map(uint32_t phys);
+void ioapic_set_pin(uint8_t irq, uint8_t pin);
+void ioapic_enable(uint32_t bsp_apic_id, bool imcr);
+bool ioapic_enabled();
+
+void irq_eoi(uint32_t irq);
+bool irq_is_pending(uint32_t irq);
+
+#endif
@@ -0,0 +1,472 @@
+#include "smp.h"
+#include "apic.h"
+#include "../utils/cpu.h"
+#include "../utils/spinlock.h"
+#include "../display/display.h"
+#include "../kshell/kshell.h"
+#include "../memory/memory.h"
+#include "../gdt/gdt.h"
+#include "../keyboard/idt.h"
+#include "../timers/timers.h"
+#include "../tasks/task.h"
+#include "../tasks/fpu.h"
+
+/*############################################################################*/
+/*                                                                            */
+/*                           DEFINES                                          */
+/*                                                                            */
+/*############################################################################*/
+/* https://wiki.osdev.org/Symmetric_Multiprocessing */
+#define MP_FLOATING_SIGNATURE   0x5F504D5F  /* "_MP_" */
+#define MP_CONFIG_SIGNATURE     0x504D4350  /* "PCMP" */
+
+#define MP_ENTRY_PROCESSOR      0
+#define MP_ENTRY_BUS            1
+#define MP_ENTRY_IOAPIC         2
+#define MP_ENTRY_IO_INT         3
+#define MP_ENTRY_LOCAL_INT      4
+
+#define MP_CPU_ENABLED          0x01
+#define MP_CPU_BSP              0x02
+#define MP_IOAPIC_ENABLED       0x01
+#define MP_INT_VECTORED         0
+#define MP_FEATURE2_IMCR        0x80
+
+/* BIOS data area: EBDA segment and base memory size in KB */
+#define BDA_EBDA_SEGMENT        0x40E
+#define BDA_BASE_MEMORY         0x413
+#define BIOS_ROM_START          0xF0000
+#define BIOS_ROM_END            0x100000
+
+#define AP_STACK_PAGES          4
+/* Ticks an AP gets to check in before we give up on it */
+#define AP_BOOT_TIMEOUT         PIT_FREQUENCY
+
+typedef struct __attribute__((packed)) mp_floating
+{
+    uint32_t signature;
+    uint32_t config;        /* Physical address of the config table */
+    uint8_t length;         /* In 16 byte units */
+    uint8_t spec_rev;
+    uint8_t checksum;
+    uint8_t feature1;       /* Non zero: a default config, no table */
+    uint8_t feature2;
+    uint8_t reserved[3];
+} mp_floating_t;
+
+typedef struct __attribute__((packed)) mp_config
+{
+    uint32_t signature;
+    uint16_t length;
+    uint8_t spec_rev;
+    uint8_t checksum;
+    char oem[8];
+    char product[12];
+    uint32_t oem_table;
+    uint16_t oem_size;
+    uint16_t entry_count;
+    uint32_t lapic_addr;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} mp_config_t;
+
+typedef struct __attribute__((packed)) mp_processor
+{
+    uint8_t type;
+    uint8_t apic_id;
+    uint8_t apic_version;
+    uint8_t flags;
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+} mp_processor_t;
+
+typedef struct __attribute__((packed)) mp_bus
+{
+    uint8_t type;
+    uint8_t bus_id;
+    char name[6];
+} mp_bus_t;
+
+typedef struct __attribute__((packed)) mp_ioapic
+{
+    uint8_t type;
+    uint8_t apic_id;
+    uint8_t version;
+    uint8_t flags;
+    uint32_t addr;
+} mp_ioapic_t;
+
+typedef struct __attribute__((packed)) mp_io_int
+{
+    uint8_t type;
+    uint8_t int_type;
+    uint16_t flags;
+    uint8_t src_bus;
+    uint8_t src_irq;
+    uint8_t dst_apic;
+    uint8_t dst_pin;
+} mp_io_int_t;
+
+/* Filled in the trampoline copy before each AP is started, see ap_boot.asm */
+typedef struct __attribute__((packed)) ap_params
+{
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t stack;
+    uint32_t entry;
+    uint32_t cpu;
+} ap_params_t;
+
+/*############################################################################*/
+/*                                                                            */
+/*                           LOCALS                                           */
+/*                                                                            */
+/*############################################################################*/
+static void show_cpus();
+
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_params[];
+
+cpu_t cpus[MAX_CPUS];
+uint32_t cpu_count = 1;
+volatile uint32_t cpus_online = 1;
+
+static uint32_t lapic_addr = 0;
+static uint32_t ioapic_addr = 0;
+static bool imcr_present = false;
+
+static command_t commands[] = {
+    {"cpus", "Show the CPUs and what they run", show_cpus},
+    {NULL, NULL, NULL}
+};
+
+/*############################################################################*/
+/*                                                                            */
+/*                           LOCKS AND IPIS                                   */
+/*                                                                            */
+/*############################################################################*/
+
+/* Drops every TLB entry of this CPU, global ones included. */
+static void flush_tlb_local()
+{
+    uint32_t cr4 = read_cr4();
+    uint32_t cr3;
+
+    if (cr4 & CR4_PGE)
+    {
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+        return;
+    }
+    __asm__ __volatile__("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) :: "memory");
+}
+
+/* Answers a shootdown aimed at us, for CPUs that spin with interrupts off. */
+static inline void smp_poll_tlb()
+{
+    cpu_t* cpu = this_cpu();
+
+    if (cpu->tlb_flush)
+    {
+        flush_tlb_local();
+        cpu->tlb_flush = false;
+    }
+}
+
+/*
+ * A CPU waiting here may have interrupts off, and the lock holder may be
+ * waiting on it for a TLB shootdown: keep answering those.
+ */
+void spin_wait(spinlock_t* lock, uint16_t ticket)
+{
+    while (lock->owner != ticket)
+    {
+        smp_poll_tlb();
+        cpu_relax();
+    }
+}
+
+void smp_send_reschedule(uint32_t cpu)
+{
+    lapic_send_ipi(cpus[cpu].apic_id, LAPIC_ICR_FIXED | LAPIC_ICR_ASSERT | IPI_VECTOR);
+}
+
+/* IPI_VECTOR. A reschedule needs nothing more than the interrupt itself. */
+void smp_handle_ipi()
+{
+    smp_poll_tlb();
+}
+
+/**
+ * smp_flush_tlb_others:
+ *   Makes every other online CPU drop its TLB, after kernel mappings were
+ *   removed or narrowed, and waits until they all did. Only then may the
+ *   frames behind the old mappings be reused.
+ */
+void smp_flush_tlb_others()
+{
+    uint32_t flags;
+    uint32_t self;
+    uint32_t i;
+
+    if (cpus_online < 2)
+        return;
+    flags = irq_save();
+    self = smp_processor_id();
+    for (i = 0; i < cpu_count; i++)
+    {
+        if (i == self || !cpus[i].online)
+            continue;
+        cpus[i].tlb_flush = true;
+        smp_send_reschedule(i);
+    }
+    for (i = 0; i < cpu_count; i++)
+    {
+        /* Two CPUs may be shooting at each other */
+        while (cpus[i].tlb_flush && i != self)
+        {
+            smp_poll_tlb();
+            cpu_relax();
+        }
+    }
+    irq_restore(flags);
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           MP TABLES                                        */
+/*                                                                            */
+/*############################################################################*/
+
+static bool mp_checksum(void* addr, uint32_t length)
+{
+    uint8_t* bytes = addr;
+    uint8_t sum = 0;
+
+    while (length--)
+        sum += *bytes++;
+    return sum == 0;
+}
+
+static mp_floating_t* mp_search(uint32_t start, uint32_t length)
+{
+    mp_floating_t* mpf;
+
+    for (uint32_t addr = start; addr + sizeof(mp_floating_t) <= start + length; addr += 16)
+    {
+        mpf = (mp_floating_t*)addr;
+        if (mpf->signature == MP_FLOATING_SIGNATURE && mpf->length == 1
+            && mp_checksum(mpf, sizeof(mp_floating_t)))
+            return mpf;
+    }
+    return NULL;
+}
+
+/* In asm: GCC flags any C dereference of a constant low address as out of bounds */
+static inline uint16_t bda_read16(uint32_t addr)
+{
+    uint32_t value;
+
+    __asm__ __volatile__("movzwl (%1), %0" : "=r"(value) : "r"(addr) : "memory");
+    return value;
+}
+
+/* In the first KB of the EBDA, the last KB of base memory or the BIOS ROM. */
+static mp_floating_t* mp_find()
+{
+    uint32_t ebda = (uint32_t)bda_read16(BDA_EBDA_SEGMENT) << 4;
+    uint32_t base = (uint32_t)bda_read16(BDA_BASE_MEMORY) * 1024;
+    mp_floating_t* mpf = NULL;
+
+    if (ebda)
+        mpf = mp_search(ebda, 1024);
+    if (!mpf && base)
+        mpf = mp_search(base - 1024, 1024);
+    if (!mpf)
+        mpf = mp_search(BIOS_ROM_START, BIOS_ROM_END - BIOS_ROM_START);
+    return mpf;
+}
+
+static uint32_t mp_entry_size(uint8_t type)
+{
+    return type == MP_ENTRY_PROCESSOR ? sizeof(mp_processor_t) : 8;
+}
+
+/* Fills cpus[] and finds the APICs. */
+static bool mp_parse(mp_config_t* config)
+{
+    uint8_t* entry = (uint8_t*)(config + 1);
+    mp_processor_t* proc;
+    mp_ioapic_t* io;
+    mp_io_int_t* irq;
+    int isa_bus = -1;
+
+    if (config->signature != MP_CONFIG_SIGNATURE || !mp_checksum(config, config->length))
+        return false;
+    lapic_addr = config->lapic_addr;
+
+    for (uint32_t i = 0; i < config->entry_count; i++)
+    {
+        switch (*entry)
+        {
+            case MP_ENTRY_PROCESSOR:
+                proc = (mp_processor_t*)entry;
+                if (!(proc->flags & MP_CPU_ENABLED))
+                    break;
+                if (proc->flags & MP_CPU_BSP)
+                    cpus[0].apic_id = proc->apic_id;
+                else if (cpu_count < MAX_CPUS)
+                    cpus[cpu_count++].apic_id = proc->apic_id;
+                break;
+            case MP_ENTRY_BUS:
+                if (!memcmp(((mp_bus_t*)entry)->name, "ISA", 3))
+                    isa_bus = ((mp_bus_t*)entry)->bus_id;
+                break;
+            case MP_ENTRY_IOAPIC:
+                io = (mp_ioapic_t*)entry;
+                /* The first one has the ISA IRQs */
+                if ((io->flags & MP_IOAPIC_ENABLED) && !ioapic_addr)
+                    ioapic_addr = io->addr;
+                break;
+            case MP_ENTRY_IO_INT:
+                irq = (mp_io_int_t*)entry;
+                if (irq->int_type == MP_INT_VECTORED && irq->src_bus == isa_bus)
+                    ioapic_set_pin(irq->src_irq, irq->dst_pin);
+                break;
+            case MP_ENTRY_LOCAL_INT:
+                break;
+            default:
+                return false;
+        }
+        entry += mp_entry_size(*entry);
+    }
+    return lapic_addr && ioapic_addr;
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           AP STARTUP                                       */
+/*                                                                            */
+/*############################################################################*/
+
+static void smp_delay(uint32_t ticks)
+{
+    uint32_t start = get_kticks();
+
+    /* The first tick may be about to land: wait one more */
+    while (get_kticks() - start <= ticks)
+        __asm__ __volatile__("hlt");
+}
+
+/* Where the trampoline copy starts each AP, in 32-bit mode with paging on. */
+static void ap_main(uint32_t id)
+{
+    /* memcpy() may use SSE once the BSP turned it on */
+    fpu_init_cpu();
+    gdt_init_cpu(id);
+    register_idt();
+    lapic_init();
+    sched_init_cpu();
+    lapic_timer_start();
+
+    __atomic_add_fetch(&cpus_online, 1, __ATOMIC_SEQ_CST);
+    cpus[id].online = true;
+    enable_interrupts();
+    cpu_idle();
+}
+
+/* INIT, then the startup IPI twice as the MP spec wants. */
+static bool ap_boot(uint32_t id)
+{
+    ap_params_t* params = (ap_params_t*)(AP_TRAMPOLINE + (ap_params - ap_trampoline_start));
+    uint8_t* stack = alloc_pages_contig(AP_STACK_PAGES);
+    uint32_t start;
+
+    if (!stack)
+        return false;
+    params->cr3 = vmm_kernel_directory();
+    params->cr4 = read_cr4();
+    params->stack = (uint32_t)(stack + AP_STACK_PAGES * PAGE_SIZE);
+    params->entry = (uint32_t)ap_main;
+    params->cpu = id;
+
+    lapic_send_ipi(cpus[id].apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    smp_delay(1);
+    for (int i = 0; i < 2 && !cpus[id].online; i++)
+    {
+        lapic_send_ipi(cpus[id].apic_id, LAPIC_ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+        smp_delay(1);
+    }
+
+    start = get_kticks();
+    while (!cpus[id].online && get_kticks() - start < AP_BOOT_TIMEOUT)
+        __asm__ __volatile__("hlt");
+    if (!cpus[id].online)
+    {
+        /* It may still wake up on that stack: leave it be */
+        printf("SMP: cpu%u (APIC %u) did not start\n", id, cpus[id].apic_id);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * smp_init:
+ *   Finds the CPUs in the MP tables. With more than one, the IRQs move to
+ *   the IO-APIC and the APs are started one at a time, each ending up in
+ *   its own idle task. Uniprocessor machines keep the PIC and PIT setup.
+ *   Runs after scheduler_init() with interrupts on, before task creation.
+ */
+void smp_init()
+{
+    mp_floating_t* mpf;
+
+    cpus[0].online = true;
+    install_all_cmds(commands, TASKS);
+
+    mpf = mp_find();
+    if (!mpf || mpf->feature1 || !mpf->config || !mp_parse((mp_config_t*)mpf->config))
+    {
+        cpu_count = 1;
+        return;
+    }
+    imcr_present = (mpf->feature2 & MP_FEATURE2_IMCR) != 0;
+    if (cpu_count < 2)
+        return;
+
+    lapic_map(lapic_addr);
+    ioapic_map(ioapic_addr);
+    lapic_init();
+    cpus[0].apic_id = lapic_id();
+    lapic_timer_calibrate();
+    ioapic_enable(cpus[0].apic_id, imcr_present);
+
+    memcpy((void*)AP_TRAMPOLINE, ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+    for (uint32_t id = 1; id < cpu_count; id++)
+        ap_boot(id);
+    printf("SMP: %u of %u CPUs online\n", cpus_online, cpu_count);
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           TESTS                                            */
+/*                                                                            */
+/*############################################################################*/
+
+static void show_cpus()
+{
+    task_t* task;
+
+    printf("CPUs: %u online of %u\n", cpus_online, cpu_count);
+    for (uint32_t i = 0; i < cpu_count; i++)
+    {
+        task = cpus[i].current;
+        printf("  cpu%u: APIC %u, %s", i, cpus[i].apic_id, cpus[i].online ? "online" : "offline");
+        if (task)
+            printf(", running '%s' (PID %d)", task->name, task->pid);
+        printf("\n");
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "../utils/stdint.h"
+#include "../utils/utils.h"
+
+#define MAX_CPUS        8
+
+/* Real mode page the APs start in, below the boot stack and the GDT users */
+#define AP_TRAMPOLINE   0x8000
+
+/* Vectors of the local APIC interrupts, past the PIC ones and the syscall */
+#define LAPIC_TIMER_VECTOR  0x40
+#define IPI_VECTOR          0x41    /* Reschedule and TLB shootdown */
+#define SPURIOUS_VECTOR     0xFF
+
+struct task_struct;
+
+/*
+ * Per-CPU data. Every CPU has %gs based on its own entry, so this_cpu()
+ * is a single load whatever CPU it runs on. 'self' must stay first.
+ */
+typedef struct cpu
+{
+    struct cpu* self;
+    uint32_t id;                    /* Index in cpus[], 0 is the BSP */
+    uint32_t apic_id;
+    volatile bool online;
+    volatile bool tlb_flush;        /* Set by others, cleared once flushed */
+    struct task_struct* current;
+    struct task_struct* idle;       /* Runs when nothing else can */
+    bool in_kernel_fpu;             /* Between kernel_fpu_begin() and _end() */
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern uint32_t cpu_count;          /* Found in the MP tables, at least 1 */
+extern volatile uint32_t cpus_online;
+
+static inline cpu_t* this_cpu()
+{
+    cpu_t* cpu;
+
+    __asm__ __volatile__("movl %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+static inline uint32_t smp_processor_id()
+{
+    return this_cpu()->id;
+}
+
+/* Halted or about to, with nothing queued. */
+static inline bool cpu_is_idle(uint32_t cpu)
+{
+    return cpus[cpu].current == cpus[cpu].idle;
+}
+
+void smp_init();
+void smp_send_reschedule(uint32_t cpu);
+void smp_flush_tlb_others();
+void smp_handle_ipi();
+
+#endif
@@ -6,31 +6,29 @@
 #define DEFAULT_SOCKET_BUFFER_SIZE 1024
 
 static kernel_socket_t socket_table[MAX_SOCKETS];
-
-static void notify_task(int target_pid)
-{
-    task_t *target_task = get_task_by_pid(target_pid);
-    if (target_task)
-    {
-        target_task->state = TASK_READY;
-    }
-}
+static spinlock_t socket_table_lock = SPINLOCK_INIT;
 
 int _socket()
 {
     int source_pid = get_current_task()->pid;
+    uint32_t flags = spin_lock_irqsave(&socket_table_lock);
+
     for (int i = 0; i < MAX_SOCKETS; i++)
     {
         if (!socket_table[i].is_bound)
         {
+            spin_lock_init(&socket_table[i].lock);
             socket_table[i].socket_id = i;
             socket_table[i].source_pid = source_pid;
             socket_table[i].buffer = kmalloc(DEFAULT_SOCKET_BUFFER_SIZE);
             socket_table[i].buffer_size = DEFAULT_SOCKET_BUFFER_SIZE;
             socket_table[i].is_bound = 1;
+            wait_queue_init(&socket_table[i].readers);
+            spin_unlock_irqrestore(&socket_table_lock, flags);
             return i;
         }
     }
+    spin_unlock_irqrestore(&socket_table_lock, flags);
     return -1;
 }
 
@@ -49,28 +47,32 @@ int socket_connect(int socket_id)
 int socket_send(int socket_id, char *data, size_t length)
 {
     kernel_socket_t *sock = &socket_table[socket_id];
+    uint32_t flags;
+
     if (!sock->is_connected) return -1;
     if (length > sock->buffer_size) return -1;
 
+    flags = spin_lock_irqsave(&sock->lock);
     memcpy(sock->buffer, data, length);
+    spin_unlock_irqrestore(&sock->lock, flags);
 
-    notify_task(sock->target_pid);
+    wake_up(&sock->readers);
     return 0;
 }
 
 int socket_recv(int socket_id, char *buffer, size_t length)
 {
     kernel_socket_t *sock = &socket_table[socket_id];
+    uint32_t flags;
 
-    get_current_task()->state = TASK_WAITING;
-
-    while (sock->buffer[0] == '\0') scheduler();
-
-    get_current_task()->state = TASK_RUNNING;
+    wait_event(sock->readers, sock->buffer[0] != '\0');
 
     if (length > sock->buffer_size) return -1;
 
+    /* The sender may be filling it in again on another CPU */
+    flags = spin_lock_irqsave(&sock->lock);
     memcpy(buffer, sock->buffer, length);
     memset(sock->buffer, 0, sock->buffer_size);
+    spin_unlock_irqrestore(&sock->lock, flags);
     return 0;
 }
@@ -3,6 +3,8 @@
 
 #include "../utils/utils.h"
 #include "../utils/stdint.h"
+#include "../tasks/wait_queue.h"
+#include "../utils/spinlock.h"
 
 typedef struct
 {
@@ -13,6 +15,8 @@ typedef struct
     size_t buffer_size;
     bool is_bound; /* Indicates if a process is bound to the socket */
     bool is_connected; /* Socket is connected ? */
+    spinlock_t lock; /* Buffer */
+    wait_queue_t readers; /* Tasks in socket_recv() waiting for data */
 } kernel_socket_t;
 
 int _socket();
@@ -4,6 +4,10 @@
 #include "../tasks/task.h"
 #include "../keyboard/signals.h"
 #include "../keyboard/keyboard.h"
+#include "../keyboard/idt.h"
+#include "../memory/memory.h"
+#include "../ide/ext2_fileio.h"
+#include "../timers/timers.h"
 
 typedef int (*syscall_handler_6_t)(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5, uint32_t arg6);
 typedef int (*syscall_handler_5_t)(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5);
@@ -13,7 +17,9 @@ typedef int (*syscall_handler_2_t)(uint32_t arg1, uint32_t arg2);
 typedef int (*syscall_handler_1_t)(uint32_t arg1);
 typedef int (*syscall_handler_0_t)();
 
-bool syscall_happening = false;
+volatile uint32_t syscall_happening = 0;
+/* Tasks waiting for the syscall in progress to finish */
+static wait_queue_t syscall_wq;
 
 typedef enum
 {
@@ -49,12 +55,36 @@ typedef struct
     ret_value_size ret_value_entry;
 } syscall_entry_t;
 
+static ext2_FILE* get_file(int fd)
+{
+    task_t* task = get_current_task();
+
+    if (!task || fd < 3 || fd >= TASK_MAX_FILES)
+        return NULL;
+    return task->files[fd];
+}
+
 int sys_exit(int status)
 {
     _exit(status);
     return status;
 }
 
+/* One syscall at a time, on all CPUs. The test is also the claim. */
+static void syscall_lock(void)
+{
+    uint32_t flags = irq_save();
+
+    wait_event(syscall_wq, __sync_lock_test_and_set(&syscall_happening, 1) == 0);
+    irq_restore(flags);
+}
+
+static void syscall_unlock(void)
+{
+    __sync_lock_release(&syscall_happening);
+    wake_up(&syscall_wq);
+}
+
 int sys_write(int fd, const char* buf, size_t count)
 {
     if (!buf || count == 0)
@@ -62,6 +92,8 @@ int sys_write(int fd, const char* buf, size_t count)
         printf("Write: Invalid buffer or count, %d\n", count);
         return -1;
     }
+    if (get_file(fd))
+        return ext2_fwrite(buf, 1, count, get_file(fd));
     if (fd < 0 || fd > 2)
     {
         // printf("Write: Invalid file descriptor\n");
@@ -89,10 +121,16 @@ int sys_read(int fd, char* buf, size_t count)
 // }
 
 
+    if (get_file(fd))
+        return ext2_fread(buf, 1, count, get_file(fd));
+
     if (fd == 0)
     {
         clear_kb_buffer();
-        while (getc() != '\n') scheduler();
+        /* Other tasks may make syscalls while we wait for a line */
+        syscall_unlock();
+        while (get_last_char_blocking() != '\n');
+        syscall_lock();
         char* buffer = get_kb_buffer();
         size_t len = strlen(buffer);
         buffer[len - 1] = '\0'; /* remove '\n' */
@@ -112,14 +150,42 @@ int sys_read(int fd, char* buf, size_t count)
 
 int sys_open(const char* path, int flags)
 {
-    printf("Syscall: open(%s, %d)\n", path, flags);
-    return 1;
+    task_t* task = get_current_task();
+    const char* mode = "r";
+    int fd;
+
+    if (!path || !task)
+        return -1;
+    if (flags & O_APPEND)
+        mode = "a";
+    else if (flags & O_TRUNC)
+        mode = "w";
+    else if (flags & (O_WRONLY | O_RDWR))
+        mode = "r+";
+
+    for (fd = 3; fd < TASK_MAX_FILES && task->files[fd]; fd++)
+        ;
+    if (fd == TASK_MAX_FILES)
+        return -1;
+    task->files[fd] = ext2_fopen(path, mode);
+    return task->files[fd] ? fd : -1;
 }
 
 int sys_close(int fd)
 {
-    printf("Syscall: close(%d)\n", fd);
-    return 1;
+    ext2_FILE* file = get_file(fd);
+
+    if (fd >= 0 && fd < 3)
+        return 0;
+    if (!file)
+        return -1;
+    get_current_task()->files[fd] = NULL;
+    return ext2_fclose(file);
+}
+
+int sys_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    return (int)mmap(addr, length, prot | PROT_USER, flags, fd, offset);
 }
 
 int sys_get_pid()
@@ -127,9 +193,75 @@ int sys_get_pid()
     return get_current_task()->pid;
 }
 
-void sys_sleep(uint32_t seconds)
+/*
+ * Rounds up to whole ticks. On an early wakeup the time left goes to
+ * 'rem' and -1 is returned.
+ */
+int sys_nanosleep(const struct timespec* req, struct timespec* rem)
 {
-    printf("Syscall: sleep(%d)\n", seconds);
+    uint32_t ticks;
+    uint32_t left;
+
+    if (!req || req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= NSEC_PER_SEC)
+        return -1;
+    /* Half the tick space at most, so the deadline cannot wrap past now */
+    if ((uint32_t)req->tv_sec >= 0x7FFFFFFF / PIT_FREQUENCY)
+        ticks = 0x7FFFFFFF;
+    else
+        ticks = req->tv_sec * PIT_FREQUENCY
+            + (req->tv_nsec + NSEC_PER_TICK - 1) / NSEC_PER_TICK;
+
+    /* Other tasks may make syscalls while we sleep */
+    syscall_unlock();
+    left = timer_sleep(ticks);
+    syscall_lock();
+
+    if (!left)
+        return 0;
+    if (rem)
+    {
+        rem->tv_sec = left / PIT_FREQUENCY;
+        rem->tv_nsec = (left % PIT_FREQUENCY) * NSEC_PER_TICK;
+    }
+    return -1;
+}
+
+int sys_nice(int inc)
+{
+    return _nice(inc);
+}
+
+long sys_times(struct tms* buf)
+{
+    return _times(buf);
+}
+
+int sys_getrusage(int who, struct rusage* usage)
+{
+    return _getrusage(who, usage);
+}
+
+/* Other tasks, the child among them, may make syscalls while we sleep */
+int sys_wait4(pid_t pid, int* status, int options, struct rusage* usage)
+{
+    pid_t ret;
+
+    if (options & WNOHANG)
+        return _wait4(pid, status, options, usage);
+    syscall_unlock();
+    ret = _wait4(pid, status, options, usage);
+    syscall_lock();
+    return ret;
+}
+
+int sys_waitpid(pid_t pid, int* status, int options)
+{
+    return sys_wait4(pid, status, options, NULL);
+}
+
+int sys_clone(uint32_t flags, int (*fn)(void*), void* arg, void* stack, uint32_t tls)
+{
+    return _clone(flags, fn, arg, stack, tls);
 }
 
 int sys_kill(uint32_t pid, uint32_t signal)
@@ -151,7 +283,7 @@ syscall_entry_t syscall_table[SYS_MAX_SYSCALL];
 
 void force_no_syscall()
 {
-    syscall_happening = false;
+    syscall_unlock();
 }
 
 int syscall_handler(registers reg, uint32_t intr_no, uint32_t err_code, error_state stack)
@@ -170,13 +302,11 @@ int syscall_handler(registers reg, uint32_t intr_no, uint32_t err_code, error_st
         printf("Unknown syscall: %d\n", syscall_number);
         return -1;
     }
-    // printf("syscall happening: %d\n", syscall_happening);
-    while (syscall_happening)
-    {
-        // puts("Syscall happening\n");
-        scheduler();
-    }
-    syscall_happening = true;
+    /* Still in the interrupt gate: nobody can take the syscall from us */
+    syscall_lock();
+    get_current_task()->in_syscall = true;
+    /* Blocking calls wait on IRQs */
+    enable_interrupts();
 
     syscall_entry_t entry = syscall_table[syscall_number];
 
@@ -213,7 +343,9 @@ int syscall_handler(registers reg, uint32_t intr_no, uint32_t err_code, error_st
 
     // scheduler();
 
-    syscall_happening = false;
+    /* Not a saved pointer: a forked child comes back here as itself */
+    get_current_task()->in_syscall = false;
+    syscall_unlock();
     return ret_value.int_value;
 }
 
@@ -257,11 +389,11 @@ void init_syscalls()
         .handler.handler = (void*)sys_get_pid,
     };
 
-    // syscall_table[SYS_SLEEP] = (syscall_entry_t){
-    //     .ret_value_entry = RET_INT,
-    //     .num_args = 1,
-    //     .handler.handler_1 = sys_sleep,
-    // };
+    syscall_table[SYS_NANOSLEEP] = (syscall_entry_t){
+        .ret_value_entry = RET_INT,
+        .num_args = 2,
+        .handler.handler = (void*)sys_nanosleep,
+    };
 
     syscall_table[SYS_SIGNAL] = (syscall_entry_t){
         .ret_value_entry = RET_INT,
@@ -275,6 +407,60 @@ void init_syscalls()
         .handler.handler = (void*)sys_kill,
     };
 
+    syscall_table[SYS_NICE] = (syscall_entry_t){
+        .ret_value_entry = RET_INT,
+        .num_args = 1,
+        .handler.handler = (void*)sys_nice,
+    };
+
+    syscall_table[SYS_TIMES] = (syscall_entry_t){
+        .ret_value_entry = RET_INT,
+        .num_args = 1,
+        .handler.handler = (void*)sys_times,
+    };
+
+    syscall_table[SYS_GETRUSAGE] = (syscall_entry_t){
+        .ret_value_entry = RET_INT,
+        .num_args = 2,
+        .handler.handler = (void*)sys_getrusage,
+    };
+
+    syscall_table[SYS_WAITPID] = (syscall_entry_t){
+        .ret_value_entry = RET_INT,
+        .num_args = 3,
+        .handler.handler = (void*)sys_waitpid,
+    };
+
+    syscall_table[SYS_WAIT4] = (syscall_entry_t){
+        .ret_value_entry = RET_INT,
+        .num_args = 4,
+        .handler.handler = (void*)sys_wait4,
+    };
+
+    syscall_table[SYS_CLONE] = (syscall_entry_t){
+        .ret_value_entry = RET_INT,
+        .num_args = 5,
+        .handler.handler = (void*)sys_clone,
+    };
+
+    syscall_table[SYS_MMAP] = (syscall_entry_t){
+        .ret_value_entry = RET_PTR,
+        .num_args = 6,
+        .handler.handler = (void*)sys_mmap,
+    };
+
+    syscall_table[SYS_MUNMAP] = (syscall_entry_t){
+        .ret_value_entry = RET_INT,
+        .num_args = 2,
+        .handler.handler = (void*)munmap,
+    };
+
+    syscall_table[SYS_MSYNC] = (syscall_entry_t){
+        .ret_value_entry = RET_INT,
+        .num_args = 3,
+        .handler.handler = (void*)msync,
+    };
+
     syscall_table[SYS_SCHED_YIELD] = (syscall_entry_t){
         .ret_value_entry = RET_INT,
         .num_args = 0,
@@ -90,6 +90,7 @@ typedef enum {
     SYS_SIGPENDING = 73,
     SYS_SETHOSTNAME = 74,
     SYS_SETRLIMIT = 75,
+    SYS_GETRUSAGE = 77,
     SYS_GETRLIMIT = 78,
     SYS_SETTIMEOFDAY = 79,
     // ...
@@ -98,11 +99,22 @@ typedef enum {
     SYS_MMAP = 90,
     SYS_MUNMAP = 91,
     SYS_WAIT4 = 114,
+    SYS_CLONE = 120,
+    SYS_MSYNC = 144,
     SYS_SCHED_YIELD = 158,
-    SYS_MAX_SYSCALL = 160,
+    SYS_NANOSLEEP = 162,
+    SYS_MAX_SYSCALL = 163,
 
 } syscalls_num;
 
+/* open() flags */
+#define O_RDONLY    0x0
+#define O_WRONLY    0x1
+#define O_RDWR      0x2
+#define O_CREAT     0x40
+#define O_TRUNC     0x200
+#define O_APPEND    0x400
+
 
 
 int syscall_handler(registers reg, uint32_t intr_no, uint32_t err_code, error_state stack);
@@ -13,6 +13,7 @@ typedef struct cpu_state {
     uint32_t esp_;
     uint32_t eip;
     uint32_t eflags;
+    uint32_t cr3;       /* Page directory; switch_context loads it */
 } cpu_state_t;
 
 
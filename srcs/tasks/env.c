@@ -2,10 +2,17 @@
 #include "../utils/stdint.h"
 #include "../memory/memory.h"
 #include "env.h"
+#include "../smp/smp.h"
 
 #define INITIAL_HASHTABLE_SIZE 128
 
-env_hashtable_t *active_env = NULL;
+/* Environment of the task running on each CPU */
+static env_hashtable_t *active_envs[MAX_CPUS];
+
+static inline env_hashtable_t* active_env_get(void)
+{
+    return active_envs[smp_processor_id()];
+}
 
 /* djb2 hash function (by Dan Bernstein) */
 unsigned long hash_string(const char *str)
@@ -21,16 +28,16 @@ unsigned long hash_string(const char *str)
 
 env_hashtable_t* env_hashtable_create(size_t size)
 {
-    env_hashtable_t *table = vmalloc(sizeof(env_hashtable_t), true);
+    env_hashtable_t *table = kmalloc(sizeof(env_hashtable_t));
     if (!table) return NULL;
     table->size = size;
-    table->buckets = vmalloc(size * sizeof(env_entry_t*), true);
-    memset(table->buckets, 0, size * sizeof(env_entry_t*));
+    table->buckets = kmalloc(size * sizeof(env_entry_t*));
     if (!table->buckets)
     {
-        vfree(table);
+        kfree(table);
         return NULL;
     }
+    memset(table->buckets, 0, size * sizeof(env_entry_t*));
     return table;
 }
 
@@ -43,14 +50,14 @@ void env_hashtable_destroy(env_hashtable_t *table)
         while (entry)
         {
             env_entry_t *next = entry->next;
-            vfree(entry->key);
-            vfree(entry->value);
-            vfree(entry);
+            kfree(entry->key);
+            kfree(entry->value);
+            kfree(entry);
             entry = next;
         }
     }
-    vfree(table->buckets);
-    vfree(table);
+    kfree(table->buckets);
+    kfree(table);
 }
 
 int env_hashtable_set(env_hashtable_t *table, const char *key, const char *value)
@@ -66,22 +73,22 @@ int env_hashtable_set(env_hashtable_t *table, const char *key, const char *value
         {
             char *new_value = vstrdup(value);
             if (!new_value) return -1;
-            vfree(entry->value);
+            kfree(entry->value);
             entry->value = new_value;
             return 0;
         }
         entry = entry->next;
     }
     
-    env_entry_t *new_entry = vmalloc(sizeof(env_entry_t), true);
+    env_entry_t *new_entry = kmalloc(sizeof(env_entry_t));
     if (!new_entry) return -1;
     new_entry->key = vstrdup(key);
     new_entry->value = vstrdup(value);
     if (!new_entry->key || !new_entry->value)
     {
-        vfree(new_entry->key);
-        vfree(new_entry->value);
-        vfree(new_entry);
+        kfree(new_entry->key);
+        kfree(new_entry->value);
+        kfree(new_entry);
         return -1;
     }
     new_entry->next = table->buckets[index];
@@ -119,9 +126,9 @@ int env_hashtable_remove(env_hashtable_t *table, const char *key)
                 prev->next = entry->next;
             else
                 table->buckets[index] = entry->next;
-            vfree(entry->key);
-            vfree(entry->value);
-            vfree(entry);
+            kfree(entry->key);
+            kfree(entry->value);
+            kfree(entry);
             return 0;
         }
         prev = entry;
@@ -147,10 +154,22 @@ char** get_full_env(env_hashtable_t *table)
         }
     }
     
-    char **envp = vmalloc((count + 1) * sizeof(char*), true);
+    /*
+     * The array and its strings are handed to user mode, so they live in
+     * one user-visible vmalloc() block instead of a page each.
+     */
+    size_t total_len = (count + 1) * sizeof(char*);
+    for (size_t i = 0; i < table->size; i++)
+    {
+        for (env_entry_t *entry = table->buckets[i]; entry; entry = entry->next)
+            total_len += strlen(entry->key) + 1 + strlen(entry->value) + 1;
+    }
+
+    char **envp = vmalloc(total_len, true);
     if (!envp)
         return NULL;
     
+    char *env_str = (char*)(envp + count + 1);
     size_t idx = 0;
     for (size_t i = 0; i < table->size; i++)
     {
@@ -159,22 +178,12 @@ char** get_full_env(env_hashtable_t *table)
         {
             size_t key_len   = strlen(entry->key);
             size_t value_len = strlen(entry->value);
-            size_t total_len = key_len + 1 + value_len + 1;
-            char *env_str = vmalloc(total_len, true);
-            if (!env_str)
-            {
-                for (size_t j = 0; j < idx; j++)
-                {
-                    vfree(envp[j]);
-                }
-                vfree(envp);
-                return NULL;
-            }
             memcpy(env_str, entry->key, key_len);
             env_str[key_len] = '=';
             memcpy(env_str + key_len + 1, entry->value, value_len);
-            env_str[total_len - 1] = '\0';
+            env_str[key_len + 1 + value_len] = '\0';
             envp[idx++] = env_str;
+            env_str += key_len + 1 + value_len + 1;
             entry = entry->next;
         }
     }
@@ -185,16 +194,18 @@ char** get_full_env(env_hashtable_t *table)
 
 char** _get_full_env(void)
 {
-    return get_full_env(active_env);
+    return get_full_env(active_env_get());
 }
 
 char* _getenv(const char *name)
 {
-    return env_hashtable_get(active_env, name);
+    return env_hashtable_get(active_env_get(), name);
 }
 
 int _setenv(const char *name, const char *value, int overwrite)
 {
+    env_hashtable_t *active_env = active_env_get();
+
     if (!active_env || !name || !value)
         return -1;
     if (!overwrite && _getenv(name))
@@ -204,6 +215,8 @@ int _setenv(const char *name, const char *value, int overwrite)
 
 int _unsetenv(const char *name)
 {
+    env_hashtable_t *active_env = active_env_get();
+
     if (!active_env)
         return -1;
     return env_hashtable_remove(active_env, name);
@@ -225,6 +238,8 @@ int _putenv(char *string)
 
 void print_env(void)
 {
+    env_hashtable_t *active_env = active_env_get();
+
     if (!active_env)
         return;
     
@@ -241,5 +256,5 @@ void print_env(void)
 
 void set_active_env(env_hashtable_t *env)
 {
-    active_env = env;
+    active_envs[smp_processor_id()] = env;
 }
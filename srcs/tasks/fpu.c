@@ -0,0 +1,211 @@
+#include "fpu.h"
+#include "task.h"
+#include "../memory/slab.h"
+#include "../display/display.h"
+#include "../keyboard/signals.h"
+#include "../utils/cpu.h"
+#include "../smp/smp.h"
+
+/*
+ * Lazy FPU switching. Every switch leaves CR0.TS set, so a task's first
+ * FPU or SSE instruction traps to #NM, which loads its state. Only then
+ * does it get a state area, and only a task that used the FPU during its
+ * slice has it saved when it is switched away from. Saving then, rather
+ * than on the next owner's #NM, leaves no task's state in another CPU's
+ * registers, so tasks can still be stolen by any CPU.
+ */
+
+/*############################################################################*/
+/*                                                                            */
+/*                           LOCALS                                           */
+/*                                                                            */
+/*############################################################################*/
+static kmem_cache_t* fpu_cache = NULL;
+static bool has_fxsr = false;
+static bool sse_ready = false;      /* Every CPU has SSE on: fpu_kernel_usable() */
+/* fninit state, with the default MXCSR: what a task starts with */
+static uint8_t fpu_initial_state[FPU_STATE_SIZE] __attribute__((aligned(FPU_STATE_ALIGN)));
+
+static inline void fpu_save(void* state)
+{
+    if (has_fxsr)
+        __asm__ __volatile__("fxsave (%0)" :: "r"(state) : "memory");
+    else
+        __asm__ __volatile__("fnsave (%0)" :: "r"(state) : "memory");
+}
+
+static inline void fpu_restore(void* state)
+{
+    if (has_fxsr)
+        __asm__ __volatile__("fxrstor (%0)" :: "r"(state) : "memory");
+    else
+        __asm__ __volatile__("frstor (%0)" :: "r"(state) : "memory");
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           INIT                                             */
+/*                                                                            */
+/*############################################################################*/
+
+/* Run on every CPU, an AP before any of its C code may copy memory. */
+void fpu_init_cpu()
+{
+    uint32_t features = cpuid_features_edx();
+    uint32_t cr0 = read_cr0();
+
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    write_cr0(cr0);
+    if (features & CPUID_EDX_FXSR)
+    {
+        if (features & CPUID_EDX_SSE)
+            write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+        else
+            write_cr4(read_cr4() | CR4_OSFXSR);
+    }
+    __asm__ __volatile__("fninit");
+    write_cr0(cr0 | CR0_TS);
+}
+
+/* BSP, once the slab is up. */
+void fpu_init()
+{
+    uint32_t features = cpuid_features_edx();
+
+    if (!(features & CPUID_EDX_FPU))
+        kernel_panic("No FPU");
+    has_fxsr = (features & CPUID_EDX_FXSR) != 0;
+    fpu_init_cpu();
+
+    clts();
+    fpu_save(fpu_initial_state);
+    write_cr0(read_cr0() | CR0_TS);
+
+    fpu_cache = kmem_cache_create("fpu_state", FPU_STATE_SIZE, FPU_STATE_ALIGN, NULL);
+    sse_ready = (features & (CPUID_EDX_FXSR | CPUID_EDX_SSE)) == (CPUID_EDX_FXSR | CPUID_EDX_SSE);
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           TASKS                                            */
+/*                                                                            */
+/*############################################################################*/
+
+/**
+ * fpu_handle_nm:
+ *   #NM: the current task touched the FPU with CR0.TS set. Gives it the
+ *   FPU with its own state, a clean one on its first use.
+ */
+void fpu_handle_nm()
+{
+    task_t* task = get_current_task();
+
+    clts();
+    if (!task)
+        return;
+    if (!task->fpu_state)
+    {
+        task->fpu_state = kmem_cache_alloc(fpu_cache);
+        if (!task->fpu_state)
+        {
+            puts_color("FPU: out of memory!\n", RED);
+            write_cr0(read_cr0() | CR0_TS);
+            _kill(0, 7);
+            return;
+        }
+        memcpy(task->fpu_state, fpu_initial_state, FPU_STATE_SIZE);
+    }
+    fpu_restore(task->fpu_state);
+}
+
+/* Interrupts are off. TS still clear means 'prev' used the FPU since it came in. */
+void fpu_switch_out(task_t* prev)
+{
+    uint32_t cr0 = read_cr0();
+
+    if (cr0 & CR0_TS)
+        return;
+    if (prev->fpu_state)
+        fpu_save(prev->fpu_state);
+    write_cr0(cr0 | CR0_TS);
+}
+
+/* The child starts with the parent's state, if it has one. -1 when out of memory. */
+int fpu_fork(task_t* child, task_t* parent)
+{
+    uint32_t flags;
+
+    child->fpu_state = NULL;
+    if (!parent->fpu_state)
+        return 0;
+    child->fpu_state = kmem_cache_alloc(fpu_cache);
+    if (!child->fpu_state)
+        return -1;
+
+    flags = irq_save();
+    /* Still in the registers if the parent is running with the FPU */
+    if (parent == get_current_task() && !(read_cr0() & CR0_TS))
+        fpu_save(parent->fpu_state);
+    memcpy(child->fpu_state, parent->fpu_state, FPU_STATE_SIZE);
+    /* fnsave reinitialises the FPU: reload it on the next use */
+    write_cr0(read_cr0() | CR0_TS);
+    irq_restore(flags);
+    return 0;
+}
+
+void fpu_free(task_t* task)
+{
+    if (task->fpu_state)
+        kmem_cache_free(fpu_cache, task->fpu_state);
+    task->fpu_state = NULL;
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           KERNEL USE                                       */
+/*                                                                            */
+/*############################################################################*/
+
+bool fpu_kernel_usable()
+{
+    return sse_ready;
+}
+
+/**
+ * kernel_fpu_begin:
+ *   Lends the FPU to kernel code, until kernel_fpu_end(). Interrupts stay
+ *   off in between, so no switch can save the kernel's registers as the
+ *   task's. A task's live state goes to its area first, and TS is set
+ *   again at the end so its next use loads it back.
+ *   Returns false, with nothing changed, if this CPU already lent it out:
+ *   a nested user would save the outer one's registers as the task's.
+ *   The code in between must not fault or sleep for the same reason.
+ */
+bool kernel_fpu_begin(uint32_t* flags)
+{
+    task_t* task;
+    cpu_t* cpu;
+
+    *flags = irq_save();
+    cpu = this_cpu();
+    if (!sse_ready || cpu->in_kernel_fpu)
+    {
+        irq_restore(*flags);
+        return false;
+    }
+    cpu->in_kernel_fpu = true;
+
+    task = get_current_task();
+    if (!(read_cr0() & CR0_TS) && task && task->fpu_state)
+        fpu_save(task->fpu_state);
+    clts();
+    return true;
+}
+
+void kernel_fpu_end(uint32_t flags)
+{
+    write_cr0(read_cr0() | CR0_TS);
+    this_cpu()->in_kernel_fpu = false;
+    irq_restore(flags);
+}
@@ -0,0 +1,23 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include "../utils/stdint.h"
+#include "../utils/utils.h"
+
+/* fxsave wants 512 bytes on a 16 byte boundary; fnsave fits in them too */
+#define FPU_STATE_SIZE  512
+#define FPU_STATE_ALIGN 16
+
+struct task_struct;
+
+void fpu_init();
+void fpu_init_cpu();
+void fpu_handle_nm();
+void fpu_switch_out(struct task_struct* prev);
+int fpu_fork(struct task_struct* child, struct task_struct* parent);
+void fpu_free(struct task_struct* task);
+bool fpu_kernel_usable();
+bool kernel_fpu_begin(uint32_t* flags);
+void kernel_fpu_end(uint32_t flags);
+
+#endif
@@ -1,5 +1,6 @@
 #include "task.h"
 #include "../memory/memory.h"
+#include "../memory/slab.h"
 #include "../utils/utils.h"
 #include "../utils/stdint.h"
 #include "../display/display.h"
@@ -7,12 +8,71 @@
 #include "../gdt/gdt.h"
 #include "../kshell/kshell.h"
 #include "../user/syscalls/stdlib.h"
-#include "../utils/queue.h"
 #include "../sockets/sockets.h"
+#include "../ide/ext2_fileio.h"
+#include "../keyboard/keyboard.h"
+#include "../keyboard/idt.h"
+#include "../timers/timers.h"
+#include "../utils/cpu.h"
+#include "../utils/spinlock.h"
+#include "../smp/smp.h"
+#include "../smp/apic.h"
+#include "fpu.h"
+#include "workqueue.h"
 
 #define STACK_SIZE 4096
-#define MAX_ACTIVE_TASKS 15
+/* Live tasks; exited ones give their slot and PID back */
+#define MAX_ACTIVE_TASKS 1024
 #define USER_STACK_SIZE 4096
+/* Stack mapped below USER_STACK_TOP in each task's own directory */
+#define TASK_STACK_SIZE (4 * 4096)
+
+/* Time slice in timer ticks, 50 ms at PIT_FREQUENCY */
+#define DEFAULT_QUANTUM 5
+#define MAX_QUANTUM PIT_FREQUENCY
+
+/*
+ * Multi-level feedback queue. A task's level is a base set by its nice
+ * value plus one for every slice it used up, so CPU hogs sink while tasks
+ * that block or give the CPU back early stay on top. Once a second every
+ * penalty is forgiven, so the sunken ones cannot starve.
+ */
+#define SCHED_LEVELS 8
+#define SCHED_BOOST_TICKS PIT_FREQUENCY
+#define NICE_MIN (-20)
+#define NICE_MAX 19
+
+/*
+ * PIDs come from a bitmap, handed out next-fit so a PID is not reused
+ * right after its task is gone. Way more PIDs than MAX_ACTIVE_TASKS, so
+ * there is always a free one. Lookups go through a hash on the low bits.
+ */
+#define PID_MAX 32768
+#define PID_HASH_SIZE 1024
+
+/*
+ * Each CPU has its own run queues, under their own lock, and picks only
+ * from those. An idle CPU steals from the busiest one, and every CPU
+ * pulls a task over now and then when another has two more queued.
+ */
+#define SCHED_BALANCE_TICKS 10
+
+/* top: refresh period and the busiest tasks it lists */
+#define TOP_REFRESH_TICKS PIT_FREQUENCY
+#define TOP_ROWS 16
+
+/*
+ * Locking: sched_lock covers the task list, the PID tables and the child
+ * lists, rq->lock the queues and the tasks' state, level and CPU. Wait
+ * queue locks and timer_lock come first, then sched_lock, then run queue
+ * locks in CPU order.
+ */
+#define current_task (this_cpu()->current)
+#define this_rq() (&runqueues[smp_processor_id()])
+#define task_rq(task) (&runqueues[(task)->cpu_id])
+
+/* Address in the task's space of a pointer into its stack's direct map. */
+#define STACK_VA(top, ptr) (USER_STACK_TOP - ((uintptr_t)(top) - (uintptr_t)(ptr)))
 
 void kernel_main();
 void task_1(void);
@@ -23,13 +83,18 @@ extern void switch_context(task_t *prev, task_t *next);
 extern void switch_context_to_user(task_t *prev, task_t *next);
 extern void copy_context(task_t *prev, task_t *next);
 void show_tasks();
+static void set_quantum();
+static void show_top();
+static void pid_free(pid_t pid);
 
 /* ASM ones */
 extern void fork_trampoline(void);
-extern void capture_cpu_state(cpu_state_t *state);
+extern int capture_cpu_state(cpu_state_t *state) __attribute__((returns_twice));
 
 static command_t commands[] = {
     {"show", "Show active tasks", show_tasks},
+    {"quantum", "Set the scheduler time slice in ticks", set_quantum},
+    {"top", "Live CPU usage per task, any key quits", show_top},
     {NULL, NULL, NULL}
 };
 
@@ -41,61 +106,240 @@ static char* default_envp[] = {
     NULL
 };
 
-task_t* current_task = NULL;
+/*
+ * FIFO per level, only tasks ready to run and not running. The owner
+ * takes from the heads, thieves from the tails: the tasks it would run
+ * last.
+ */
+typedef struct runqueue
+{
+    spinlock_t lock;
+    task_t* head[SCHED_LEVELS];
+    task_t* tail[SCHED_LEVELS];
+    volatile uint32_t bitmap;   /* Bit n set: level n is not empty */
+    volatile uint32_t nr_queued;
+    uint32_t load;              /* Live tasks placed on this CPU */
+    task_t* switched_from;      /* on_cpu until its registers are saved */
+    volatile bool need_resched;
+    uint32_t balance_ticks;
+    uint32_t steals;            /* Tasks pulled from other CPUs */
+    uint32_t stolen;            /* Tasks other CPUs pulled from us */
+} runqueue_t;
+
 task_t* task_list = NULL;
-task_t* to_free = NULL;
-pid_t task_index = 0;
-Queue finished_pid_queue;
+/* Waiters for a child to exit sleep here, each rechecks its own children */
+static wait_queue_t task_exit_wq;
+
+/*
+ * Exited tasks, linked through rq_next, whose resources a worker frees:
+ * closing files and writing mapped pages back is too slow to be done
+ * with interrupts off. A zombie its parent may still wait for keeps its
+ * task_t and PID until then.
+ */
+static spinlock_t reap_lock = SPINLOCK_INIT;
+static task_t* reap_list = NULL;
+static work_t reap_work;
+
+static uint32_t sched_quantum = DEFAULT_QUANTUM;
+
+static runqueue_t runqueues[MAX_CPUS];
+static spinlock_t sched_lock = SPINLOCK_INIT;
+
+static uint32_t pid_bitmap[PID_MAX / 32];
+static pid_t last_pid = 0;
+static task_t* pid_hash[PID_HASH_SIZE];
+static uint32_t nr_tasks = 0;       /* Created and not yet exited */
+static bool sched_running = false;
+static uint32_t boost_ticks = 0;
+
+static kmem_cache_t* task_cache = NULL;
+static kmem_cache_t* child_cache = NULL;
+
+static task_t* alloc_task()
+{
+    task_t* task = kmem_cache_alloc(task_cache);
+    if (task)
+        memset(task, 0, sizeof(task_t));
+    return task;
+}
 
-void dtach_from_childs(task_t* task)
+/*
+ * 'task' exits: nobody will wait for its children. The live ones are
+ * freed by the reaper when they exit, the zombies it is done with right
+ * away. sched_lock is held.
+ */
+static void orphan_children(task_t* task)
 {
     child_list_t *current = task->children;
+    child_list_t *next;
+
     while (current)
     {
+        next = current->next;
         current->task->parent = NULL;
-        current = current->next;
+        if (current->task->state == TASK_ZOMBIE && current->task->released)
+        {
+            pid_free(current->task->pid);
+            kmem_cache_free(task_cache, current->task);
+        }
+        kmem_cache_free(child_cache, current);
+        current = next;
     }
-    kfree(task->children);
+    task->children = NULL;
 }
 
-void remove_from_father(task_t* task)
+void free_envp(task_t* task)
 {
-    if (!task->parent)
+    env_hashtable_destroy(task->env);
+}
+
+/* Kernel stacks are whole pages. Returns the top, or 0 when out of memory. */
+static uint32_t alloc_kernel_stack()
+{
+    uint8_t* stack = alloc_pages_contig(STACK_SIZE / PAGE_SIZE);
+
+    return stack ? (uint32_t)(stack + STACK_SIZE) : 0;
+}
+
+static void free_kernel_stack(uint32_t top)
+{
+    if (top)
+        free_pages_contig((void*)(top - STACK_SIZE), STACK_SIZE / PAGE_SIZE);
+}
+
+static void close_task_files(task_t* task)
+{
+    for (int fd = 0; fd < TASK_MAX_FILES; fd++)
+    {
+        if (task->files[fd])
+            ext2_fclose(task->files[fd]);
+        task->files[fd] = NULL;
+    }
+}
+
+/* The stack clone() gave a thread: part of its space, or kernel pages without one. */
+static void free_thread_stack(task_t* task)
+{
+    if (!task->thread_stack)
         return;
-    child_list_t *current = task->parent->children;
-    child_list_t *prev = NULL;
-    while (current)
+    if (task->mm)
+        vma_unmap(task->mm, task->thread_stack, THREAD_STACK_SIZE);
+    else
+        free_pages_contig((void*)task->thread_stack, THREAD_STACK_SIZE / PAGE_SIZE);
+    task->thread_stack = 0;
+}
+
+/* Everything a task holds but its PID, links and task_t. */
+static void task_free_resources(task_t* task)
+{
+    free_envp(task);
+    task->env = NULL;
+    fpu_free(task);
+    free_signals(task);
+    free_kernel_stack(task->kernel_stack);
+    task->kernel_stack = 0;
+    close_task_files(task);
+    free_thread_stack(task);
+    mm_put(task->mm);
+    task->mm = NULL;
+}
+
+/* Undoes a half-made task. */
+static void task_release(task_t* task)
+{
+    task_free_resources(task);
+    kmem_cache_free(task_cache, task);
+}
+
+/*
+ * Hands an exited task to the reaper, once no CPU runs on its stacks or
+ * in its address space any more.
+ */
+static void reap_task(task_t* task)
+{
+    uint32_t flags = spin_lock_irqsave(&reap_lock);
+
+    task->rq_next = reap_list;
+    reap_list = task;
+    spin_unlock_irqrestore(&reap_lock, flags);
+    queue_work(&reap_work);
+}
+
+/**
+ * reap_tasks:
+ *   Worker side of reap_task(), for every task handed over since it last
+ *   ran. A zombie with a parent stays on its list for wait(); it is freed
+ *   by whichever of the reaper and wait() comes last. An orphan goes now.
+ */
+static void reap_tasks(void* data)
+{
+    task_t* task;
+    task_t* next;
+    uint32_t flags;
+
+    UNUSED(data)
+    flags = spin_lock_irqsave(&reap_lock);
+    task = reap_list;
+    reap_list = NULL;
+    spin_unlock_irqrestore(&reap_lock, flags);
+
+    for (; task; task = next)
     {
-        if (current->task == task)
-        {
-            if (prev)
-                prev->next = current->next;
-            else
-                task->parent->children = current->next;
-            kfree(current);
-            break;
-        }
-        prev = current;
-        current = current->next;
+        next = task->rq_next;
+        task_free_resources(task);
+
+        flags = spin_lock_irqsave(&sched_lock);
+        task->released = true;
+        if (task->parent)
+            task = NULL;
+        else
+            pid_free(task->pid);
+        spin_unlock_irqrestore(&sched_lock, flags);
+        if (task)
+            kmem_cache_free(task_cache, task);
     }
 }
 
-void free_envp(task_t* task)
+/* Another task's stack is only mapped in its directory: go through the direct map. */
+static void push_task_stack(task_t* task, uint32_t value)
 {
-    env_hashtable_destroy(task->env);
+    task->cpu.esp_ -= sizeof(uint32_t);
+    *(uint32_t*)vmm_virt_to_phys(task->cpu.cr3, task->cpu.esp_) = value;
+}
+
+/**
+ * Maps a zeroed stack of 'size' bytes below USER_STACK_TOP in 'dir' and
+ * returns its top through the direct map, so the first frame can be built
+ * before the directory is ever loaded. NULL when out of frames.
+ */
+static uint32_t* map_task_stack(uint32_t dir, size_t size)
+{
+    uint32_t frame = 0;
+
+    for (uintptr_t va = USER_STACK_TOP - size; va < USER_STACK_TOP; va += PAGE_SIZE)
+    {
+        frame = vmm_map_user_page(dir, va, PAGE_RW);
+        if (!frame)
+            return NULL;
+    }
+    return (uint32_t*)(frame + PAGE_SIZE);
 }
 
-void free_finished_tasks()
+/*
+ * Where the task's stack may be, which fork() copies eagerly: below
+ * USER_STACK_TOP for a task's first thread, THREAD_STACK_SIZE bytes
+ * from its base for one made by clone().
+ */
+static void task_stack_range(task_t* task, uintptr_t* start, uintptr_t* end)
 {
-    if (!to_free)
+    if (task->stack >= USER_STACK_TOP - USER_STACK_MAX)
+    {
+        *start = USER_STACK_TOP - USER_STACK_MAX;
+        *end = USER_STACK_TOP;
         return;
-    dtach_from_childs(to_free);
-    remove_from_father(to_free);
-    free_envp(to_free);
-    kfree((void*)to_free->kernel_stack);
-    kfree((void*)to_free->stack);
-    kfree(to_free);
-    to_free = NULL;
+    }
+    *start = task->stack;
+    *end = task->stack + THREAD_STACK_SIZE;
 }
 
 task_t* get_current_task()
@@ -140,77 +384,615 @@ void set_current_gid(gid_t gid)
     current_task->gid = gid;
 }
 
-pid_t _wait(int* status)
+/* First free PID after the last one given out, wrapping around to 1. */
+static pid_t pid_alloc()
 {
-    data_t data;
-    pid_t pid = dequeue(&finished_pid_queue, &data);
-    if (pid == 0)
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    uint32_t pid = last_pid + 1;
+    uint32_t scanned = 0;
+    uint32_t word;
+
+    while (scanned < PID_MAX)
     {
-        scheduler();
-        while (pid == 0)
+        if (pid >= PID_MAX)
+            pid = 1;
+        /* Bits below 'pid' in its word count as taken */
+        word = pid_bitmap[pid / 32] | ((1U << (pid % 32)) - 1);
+        if (word != 0xFFFFFFFF)
         {
-            pid = dequeue(&finished_pid_queue, &data);
-            if (pid == 0)
-                scheduler();
+            pid = (pid & ~31U) + __builtin_ctz(~word);
+            pid_bitmap[pid / 32] |= 1U << (pid % 32);
+            last_pid = pid;
+            spin_unlock_irqrestore(&sched_lock, flags);
+            return pid;
         }
+        scanned += 32 - pid % 32;
+        pid = (pid | 31) + 1;
     }
-    if (status)
-        *status = data.status;
-    return data.pid;
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return -1;
+}
+
+static void pid_free(pid_t pid)
+{
+    if (pid > 0 && pid < PID_MAX)
+        pid_bitmap[pid / 32] &= ~(1U << (pid % 32));
 }
 
+static void pid_hash_insert(task_t* task)
+{
+    task_t** bucket = &pid_hash[task->pid & (PID_HASH_SIZE - 1)];
+
+    task->pid_next = *bucket;
+    *bucket = task;
+}
+
+static void pid_hash_remove(task_t* task)
+{
+    task_t** link = &pid_hash[task->pid & (PID_HASH_SIZE - 1)];
+
+    while (*link && *link != task)
+        link = &(*link)->pid_next;
+    if (*link)
+        *link = task->pid_next;
+    task->pid_next = NULL;
+}
+
+/* Live tasks only: exited ones are unhashed right away. */
 task_t* get_task_by_pid(pid_t pid)
 {
-    task_t *current = task_list;
-    do
+    task_t *task;
+
+    if (pid < 0)
+        return NULL;
+    for (task = pid_hash[pid & (PID_HASH_SIZE - 1)]; task; task = task->pid_next)
     {
-        if (current->pid == pid)
-            return current;
-        current = current->next;
-    } while (current != task_list);
+        if (task->pid == pid)
+            return task;
+    }
     return NULL;
 }
 
+static inline bool task_runnable(task_t* task)
+{
+    return task->state == TASK_READY || task->state == TASK_RUNNING;
+}
+
+static void task_update_level(task_t* task)
+{
+    uint32_t level = (task->nice - NICE_MIN) / 10 + task->sched_penalty;
+
+    task->sched_level = level < SCHED_LEVELS ? level : SCHED_LEVELS - 1;
+}
+
+/* Lower levels run less often, so they get longer slices. */
+static inline uint32_t level_quantum(uint32_t level)
+{
+    return sched_quantum * (1 + level / 2);
+}
+
+/* On the run queue of the task's CPU, whose lock is held. */
+static void rq_enqueue(task_t* task)
+{
+    runqueue_t* rq = task_rq(task);
+    uint32_t level = task->sched_level;
+
+    task->rq_next = NULL;
+    if (rq->tail[level])
+        rq->tail[level]->rq_next = task;
+    else
+        rq->head[level] = task;
+    rq->tail[level] = task;
+    rq->bitmap |= 1U << level;
+    rq->nr_queued++;
+    task->on_rq = true;
+    /* Kept across boosts and steals, which requeue it */
+    if (!task->ready_since)
+        task->ready_since = get_kticks();
+}
+
+static void rq_remove(task_t* task)
+{
+    runqueue_t* rq = task_rq(task);
+    uint32_t level = task->sched_level;
+    task_t* prev = NULL;
+    task_t* cur;
+
+    if (!task->on_rq)
+        return;
+    for (cur = rq->head[level]; cur != task; cur = cur->rq_next)
+        prev = cur;
+    if (prev)
+        prev->rq_next = task->rq_next;
+    else
+        rq->head[level] = task->rq_next;
+    if (rq->tail[level] == task)
+        rq->tail[level] = prev;
+    if (!rq->head[level])
+        rq->bitmap &= ~(1U << level);
+    rq->nr_queued--;
+    task->on_rq = false;
+}
+
+/* Head of the best non-empty level, found with one bit scan. */
+static task_t* rq_pick(runqueue_t* rq)
+{
+    task_t* task;
+    uint32_t level;
+
+    while (rq->bitmap)
+    {
+        level = __builtin_ctz(rq->bitmap);
+        task = rq->head[level];
+        rq->head[level] = task->rq_next;
+        if (!rq->head[level])
+        {
+            rq->tail[level] = NULL;
+            rq->bitmap &= ~(1U << level);
+        }
+        rq->nr_queued--;
+        task->on_rq = false;
+        if (task_runnable(task))
+        {
+            task->wait_ticks += get_kticks() - task->ready_since;
+            task->ready_since = 0;
+            return task;
+        }
+        task->ready_since = 0;
+    }
+    return NULL;
+}
+
+/* Locks the queue 'task' is on, which may change until it is locked. */
+static runqueue_t* task_rq_lock(task_t* task)
+{
+    runqueue_t* rq;
+
+    while (1)
+    {
+        rq = task_rq(task);
+        spin_lock(&rq->lock);
+        if (rq == task_rq(task))
+            return rq;
+        spin_unlock(&rq->lock);
+    }
+}
+
+/* Both queues, the lower CPU first so two thieves cannot deadlock. */
+static void double_rq_lock(runqueue_t* a, runqueue_t* b)
+{
+    if (a > b)
+    {
+        runqueue_t* tmp = a;
+        a = b;
+        b = tmp;
+    }
+    spin_lock(&a->lock);
+    spin_lock(&b->lock);
+}
+
+static void double_rq_unlock(runqueue_t* a, runqueue_t* b)
+{
+    spin_unlock(&a->lock);
+    spin_unlock(&b->lock);
+}
+
+/*
+ * The registers of the task this CPU last switched away from are saved
+ * now: others may run it. Called once we are back on a task's stack.
+ * One that exited is off its stacks and directory for good: the reaper
+ * can have them.
+ */
+static inline void finish_switch(runqueue_t* rq)
+{
+    task_t* prev = rq->switched_from;
+    bool dead;
+
+    if (!prev)
+        return;
+    /* Read first: once on_cpu is clear, a killer may make it a zombie too */
+    dead = prev->state == TASK_ZOMBIE;
+    rq->switched_from = NULL;
+    __asm__ __volatile__("" ::: "memory");
+    prev->on_cpu = false;
+    if (dead)
+        reap_task(prev);
+}
+
+/*
+ * What a thief takes from 'rq': coldest level first, from the tail, and
+ * a task that last ran on the thief over any other, its cache may still
+ * be warm there. Tasks still being switched away from are left alone.
+ */
+static task_t* rq_steal_candidate(runqueue_t* rq, uint32_t thief)
+{
+    task_t* found = NULL;
+    task_t* task;
+    int level;
+
+    for (level = SCHED_LEVELS - 1; level >= 0 && !found; level--)
+    {
+        for (task = rq->head[level]; task; task = task->rq_next)
+        {
+            if (task->on_cpu || !task_runnable(task))
+                continue;
+            if (task->last_cpu == thief)
+                return task;
+            found = task;
+        }
+    }
+    return found;
+}
+
+/**
+ * load_balance:
+ *   Pulls one task from the busiest CPU to ours, when it has at least
+ *   'imbalance' more queued. Interrupts are off and no queue is locked.
+ *   Returns whether a task was pulled.
+ */
+static bool load_balance(uint32_t imbalance)
+{
+    uint32_t self = smp_processor_id();
+    runqueue_t* rq = &runqueues[self];
+    runqueue_t* busiest = NULL;
+    task_t* task;
+
+    for (uint32_t cpu = 0; cpu < cpu_count; cpu++)
+    {
+        if (cpu == self || !cpus[cpu].online)
+            continue;
+        if (!busiest || runqueues[cpu].nr_queued > busiest->nr_queued)
+            busiest = &runqueues[cpu];
+    }
+    /* Unlocked peek, checked again below */
+    if (!busiest || busiest->nr_queued < rq->nr_queued + imbalance)
+        return false;
+
+    double_rq_lock(rq, busiest);
+    task = NULL;
+    if (busiest->nr_queued >= rq->nr_queued + imbalance)
+        task = rq_steal_candidate(busiest, self);
+    if (task)
+    {
+        rq_remove(task);
+        busiest->load--;
+        busiest->stolen++;
+        task->cpu_id = self;
+        rq->load++;
+        rq->steals++;
+        rq_enqueue(task);
+    }
+    double_rq_unlock(rq, busiest);
+    return task != NULL;
+}
+
+/* Least loaded online CPU, for a new task. Unlocked: only a hint. */
+static uint32_t select_cpu()
+{
+    uint32_t best = 0;
+
+    for (uint32_t cpu = 1; cpu < cpu_count; cpu++)
+    {
+        if (cpus[cpu].online && runqueues[cpu].load < runqueues[best].load)
+            best = cpu;
+    }
+    return best;
+}
+
+/* Forgives every penalty, moving the tasks back up. Interrupts are off. */
+static void sched_boost()
+{
+    task_t* task;
+    runqueue_t* rq;
+    bool queued;
+
+    spin_lock(&sched_lock);
+    task = task_list;
+    do
+    {
+        if (task->sched_penalty)
+        {
+            rq = task_rq_lock(task);
+            queued = task->on_rq;
+            rq_remove(task);
+            task->sched_penalty = 0;
+            task_update_level(task);
+            if (queued)
+                rq_enqueue(task);
+            spin_unlock(&rq->lock);
+        }
+        task = task->next;
+    } while (task != task_list);
+    spin_unlock(&sched_lock);
+}
+
+/**
+ * task_wake:
+ *   Makes a waiting task runnable again. Having blocked, it is treated as
+ *   interactive and gets its penalty back.
+ */
+void task_wake(task_t* task)
+{
+    uint32_t flags = irq_save();
+    runqueue_t* rq = task_rq_lock(task);
+    uint32_t cpu = task->cpu_id;
+    bool kick = false;
+
+    if (task->state == TASK_WAITING)
+    {
+        task->state = TASK_READY;
+        rq_remove(task);
+        task->sched_penalty = 0;
+        task_update_level(task);
+        /* Still on its way out of scheduler(): that one picks it up */
+        if (task != cpus[cpu].current)
+        {
+            rq_enqueue(task);
+            kick = cpu != smp_processor_id() && cpu_is_idle(cpu);
+        }
+    }
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+    /* A halted CPU only notices its queue on an interrupt */
+    if (kick)
+        smp_send_reschedule(cpu);
+}
+
+/* nice(2): only root may raise its priority. */
+int _nice(int inc)
+{
+    int nice;
+
+    if (inc < 0 && current_task->euid != 0)
+        return -1;
+    nice = current_task->nice + inc;
+    if (nice < NICE_MIN)
+        nice = NICE_MIN;
+    if (nice > NICE_MAX)
+        nice = NICE_MAX;
+    /* The running task is never queued, so its level can just change */
+    current_task->nice = nice;
+    task_update_level(current_task);
+    return 0;
+}
+
+/* times(2): ticks since boot, PIT_FREQUENCY a second. */
+long _times(struct tms* buf)
+{
+    task_t* task = current_task;
+
+    if (buf)
+    {
+        buf->tms_utime = task->utime;
+        buf->tms_stime = task->stime;
+        buf->tms_cutime = task->cutime;
+        buf->tms_cstime = task->cstime;
+    }
+    return get_kticks();
+}
+
+static void ticks_to_timeval(uint32_t ticks, struct timeval* tv)
+{
+    tv->tv_sec = ticks / PIT_FREQUENCY;
+    tv->tv_usec = (ticks % PIT_FREQUENCY) * (NSEC_PER_TICK / 1000);
+}
+
+/* getrusage(2), times and context switches. Children only have times. */
+int _getrusage(int who, struct rusage* usage)
+{
+    task_t* task = current_task;
+
+    if (!usage)
+        return -1;
+    memset(usage, 0, sizeof(struct rusage));
+    if (who == RUSAGE_SELF)
+    {
+        ticks_to_timeval(task->utime, &usage->ru_utime);
+        ticks_to_timeval(task->stime, &usage->ru_stime);
+        usage->ru_nvcsw = task->nvcsw;
+        usage->ru_nivcsw = task->nivcsw;
+    }
+    else if (who == RUSAGE_CHILDREN)
+    {
+        ticks_to_timeval(task->cutime, &usage->ru_utime);
+        ticks_to_timeval(task->cstime, &usage->ru_stime);
+    }
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * One look at the children of 'parent' for wait4(): 1 with 'result' set
+ * when a zombie matching 'pid' was collected, 0 when the matching ones
+ * are all alive, -1 when there are none.
+ */
+static int wait_collect(task_t* parent, pid_t pid, int* status, struct rusage* usage, pid_t* result)
+{
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    child_list_t** link;
+    child_list_t* node;
+    task_t* child = NULL;
+    bool matched = false;
+    int exit_status;
+    uint32_t utime;
+    uint32_t stime;
+    uint32_t nvcsw;
+    uint32_t nivcsw;
+
+    for (link = &parent->children; *link; link = &(*link)->next)
+    {
+        if (pid > 0 && (*link)->task->pid != (uint32_t)pid)
+            continue;
+        matched = true;
+        if ((*link)->task->state == TASK_ZOMBIE)
+        {
+            child = (*link)->task;
+            break;
+        }
+    }
+    if (!child)
+    {
+        spin_unlock_irqrestore(&sched_lock, flags);
+        return matched ? 0 : -1;
+    }
+
+    node = *link;
+    *link = node->next;
+    kmem_cache_free(child_cache, node);
+    *result = child->pid;
+    exit_status = child->exit_status;
+    utime = child->utime + child->cutime;
+    stime = child->stime + child->cstime;
+    nvcsw = child->nvcsw;
+    nivcsw = child->nivcsw;
+    /* Freed here once the reaper is done with it, else by the reaper */
+    child->parent = NULL;
+    if (child->released)
+        pid_free(child->pid);
+    else
+        child = NULL;
+    spin_unlock_irqrestore(&sched_lock, flags);
+
+    if (child)
+        kmem_cache_free(task_cache, child);
+    /* Out of sched_lock: writing to them may fault */
+    if (status)
+        *status = exit_status;
+    if (usage)
+    {
+        memset(usage, 0, sizeof(struct rusage));
+        ticks_to_timeval(utime, &usage->ru_utime);
+        ticks_to_timeval(stime, &usage->ru_stime);
+        usage->ru_nvcsw = nvcsw;
+        usage->ru_nivcsw = nivcsw;
+    }
+    return 1;
+}
+
+/**
+ * _wait4:
+ *   wait4(2): collects an exited child of the caller, 'pid' or any of
+ *   them when it is -1 or less (there are no process groups). Sleeps
+ *   until one exits, unless 'options' has WNOHANG: then 0 means none has
+ *   yet. -1 when there is no such child. 'usage' gets the child's times,
+ *   its own waited-for children included, and context switches.
+ */
+pid_t _wait4(pid_t pid, int* status, int options, struct rusage* usage)
+{
+    task_t* task = current_task;
+    pid_t result = 0;
+    int ret;
+
+    if (pid == 0)
+        pid = -1;
+    if (options & WNOHANG)
+        ret = wait_collect(task, pid, status, usage, &result);
+    else
+        wait_event(task_exit_wq, (ret = wait_collect(task, pid, status, usage, &result)) != 0);
+    return ret < 0 ? -1 : result;
+}
+
+pid_t _waitpid(pid_t pid, int* status, int options)
+{
+    return _wait4(pid, status, options, NULL);
+}
+
+pid_t _wait(int* status)
+{
+    return _wait4(-1, status, 0, NULL);
+}
+
+/*
+ * Picks the next task and switches to it. Runs with interrupts off so the
+ * timer cannot reenter it; the caller gets its own interrupt flag back
+ * once it is switched to again.
+ */
 void scheduler(void)
 {
+    uint32_t flags = irq_save();
+    runqueue_t* rq = this_rq();
+    task_t* idle = this_cpu()->idle;
+    task_t *prev;
+    task_t *next;
+    bool preempted;
+
+    /* Before scheduler_init() or sched_init_cpu() */
     if (!current_task)
     {
-        if (!task_list)
-            return;
-        current_task = task_list;
+        irq_restore(flags);
+        return;
     }
+    sched_running = true;
     
-    free_finished_tasks();
+    finish_switch(rq);
 
-    task_t *next = current_task->next;
+    spin_lock(&rq->lock);
+    prev = current_task;
+    preempted = rq->need_resched;
+    if (prev != idle && task_runnable(prev))
+    {
+        if (!prev->time_slice)
+        {
+            if (prev->sched_penalty < SCHED_LEVELS - 1)
+                prev->sched_penalty++;
+        }
+        else if (!rq->need_resched && prev->sched_penalty
+                 && prev->time_slice * 2 > level_quantum(prev->sched_level))
+        {
+            /* Gave most of its slice back: it is waiting on something */
+            prev->sched_penalty--;
+        }
+        task_update_level(prev);
+        /* Preempted tasks compete right away, yielding ones go last */
+        if (rq->need_resched)
+            rq_enqueue(prev);
+    }
 
-    if (next->pid == 0)
+    next = rq_pick(rq);
+    if (prev != idle && task_runnable(prev) && !prev->on_rq)
     {
-        next = next->next;
+        if (next)
+            rq_enqueue(prev);
+        else
+            next = prev;
     }
+    if (!next)
+        next = idle ? idle : prev;
 
-    while (next->state == TASK_WAITING)
+    rq->need_resched = false;
+    next->time_slice = level_quantum(next->sched_level);
+    if (next == prev)
     {
-        next = next->next;
-        if (next->pid == 0)
-        {
-            next = next->next;
-        }
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        return;
     }
 
-    task_t *prev = current_task;
+    if (prev != idle)
+    {
+        if (preempted && task_runnable(prev))
+            prev->nivcsw++;
+        else
+            prev->nvcsw++;
+    }
+    fpu_switch_out(prev);
     tss_set_stack(next->kernel_stack);
-
+    /* Others leave %fs alone, so only a task that has TLS needs it based */
+    if (next->tls)
+        gdt_set_tls(next->tls);
     current_task = next;
+    next->on_cpu = true;
+    next->last_cpu = smp_processor_id();
+    /* Not to be stolen before switch_context() saved it */
+    rq->switched_from = prev;
     if (next->state == TASK_READY)
     {
         next->state = TASK_RUNNING;
     }
     else if (next->state == TASK_RUNNING)
     {
-        uint32_t *stack = (uint32_t*)next->cpu.esp_;
-        *--stack = (uint32_t)handle_signals;
-        next->cpu.esp_ = (uint32_t)stack;
+        push_task_stack(next, (uint32_t)handle_signals);
     }
     // if (next->pid == 5)
     //     while(1);
@@ -218,6 +1000,7 @@ void scheduler(void)
     // puts_color("Scheduler\n", current_task->pid); // easy way of seeing scheduler working.
     // puts_color("Scheduler\n", LIGHT_MAGENTA);
     set_active_env(next->env);
+    spin_unlock(&rq->lock);
     if (next->is_user)
     {
         // puts_color("Switching to user\n", LIGHT_MAGENTA);
@@ -226,18 +1009,275 @@ void scheduler(void)
     else
         switch_context(prev, next);
     // puts_color("Scheduler\n", RED);
-    /* think this should not be here maybe (?)*/
-    enable_interrupts();
-    outb(0x20, 0x20);
+    /* Back on prev's stack, maybe on another CPU */
+    finish_switch(this_rq());
+    irq_restore(flags);
+}
+
+/**
+ * scheduler_tick:
+ *   Called from the timer IRQ once it is acknowledged. Charges the tick to
+ *   the running task and switches away when its slice is used up, unless
+ *   it is inside a syscall or holds preemption off; then the switch waits
+ *   for a later tick. The task resumes here and returns through the iret.
+ */
+void scheduler_tick(void)
+{
+    runqueue_t* rq = this_rq();
+    task_t* task = current_task;
+
+    /* The boot task runs until the first scheduler() call */
+    if (!task || !sched_running)
+        return;
+
+    /* A task's first run does not come back through scheduler() */
+    finish_switch(rq);
+    /* Every CPU ticks: the boost goes by the BSP's */
+    if (smp_processor_id() == 0 && ++boost_ticks >= SCHED_BOOST_TICKS)
+    {
+        boost_ticks = 0;
+        sched_boost();
+    }
+    if (cpus_online > 1 && ++rq->balance_ticks >= SCHED_BALANCE_TICKS)
+    {
+        rq->balance_ticks = 0;
+        load_balance(2);
+    }
+
+    spin_lock(&rq->lock);
+    if (task == this_cpu()->idle)
+    {
+        if (rq->bitmap)
+            rq->need_resched = true;
+    }
+    else
+    {
+        /* Every task is ring 0: a syscall is what counts as system time */
+        if (task->in_syscall)
+            task->stime++;
+        else
+            task->utime++;
+        if (task->time_slice)
+            task->time_slice--;
+        if (!task->time_slice)
+            rq->need_resched = true;
+        /* Someone woke up on a better level */
+        if (rq->bitmap & ((1U << task->sched_level) - 1))
+            rq->need_resched = true;
+    }
+    spin_unlock(&rq->lock);
+
+    if (rq->need_resched && !task->in_syscall)
+        scheduler();
+}
+
+/**
+ * cpu_idle:
+ *   Body of the idle task of each CPU. With nothing queued, steals from
+ *   the busiest CPU, else halts until an IRQ. "sti; hlt" cannot be split
+ *   by an IRQ, so a wakeup between the check and the halt is not slept
+ *   through; other CPUs that queue a task for us send an IPI. On the BSP,
+ *   which owns the PIT, the periodic tick is stopped until the next timer
+ *   is due. An AP does the same with its LAPIC timer, but still wakes
+ *   every SCHED_BALANCE_TICKS to look for work to steal.
+ */
+void cpu_idle(void)
+{
+    runqueue_t* rq = this_rq();
+    bool bsp = smp_processor_id() == 0;
+    bool oneshot = false;
+    uint32_t ticks;
+
+    while (1)
+    {
+        disable_interrupts();
+        if (rq->bitmap || (cpus_online > 1 && load_balance(1)))
+        {
+            scheduler();
+            enable_interrupts();
+            continue;
+        }
+        if (bsp)
+            tick_nohz_enter();
+        else
+        {
+            /* The next tick is needed anyway: no point going one-shot */
+            ticks = timer_idle_ticks(SCHED_BALANCE_TICKS);
+            oneshot = ticks >= 2;
+            if (oneshot)
+                lapic_timer_oneshot(ticks);
+        }
+        __asm__ __volatile__("sti; hlt" ::: "memory");
+        disable_interrupts();
+        if (bsp)
+            tick_nohz_exit();
+        else if (oneshot)
+            lapic_timer_start();
+        enable_interrupts();
+    }
+}
+
+static void set_quantum()
+{
+    char* buffer;
+    uint32_t ticks;
+
+    printf("Quantum: %u ticks (%u ms)\n", sched_quantum, sched_quantum * 1000 / PIT_FREQUENCY);
+    printf("Enter the new quantum in ticks (hex, 1-%u): ", MAX_QUANTUM);
+    buffer = get_line();
+    ticks = hex_string_to_int(buffer);
+    if (ticks == 0 || ticks > MAX_QUANTUM)
+    {
+        puts_color("Invalid quantum!\n", RED);
+        return;
+    }
+    sched_quantum = ticks;
+    printf("Quantum set to %u ticks (%u ms)\n", ticks, ticks * 1000 / PIT_FREQUENCY);
+}
+
+typedef struct top_entry
+{
+    pid_t pid;
+    uint32_t ticks;         /* utime + stime */
+    uint32_t delta;         /* Since the last refresh */
+    uint32_t cpu;
+    task_state_t state;
+    char name[16];
+} top_entry_t;
+
+static const char* task_state_names[] = {
+    "RUN", "READY", "ZOMBIE", "WAIT", "DYING"
+};
+
+/* Copies up to 'max' live tasks under sched_lock. */
+static uint32_t top_snapshot(top_entry_t* out, uint32_t max)
+{
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    task_t* task = task_list;
+    uint32_t n = 0;
+
+    do
+    {
+        out[n].pid = task->pid;
+        out[n].ticks = task->utime + task->stime;
+        out[n].delta = out[n].ticks;
+        out[n].cpu = task->cpu_id;
+        out[n].state = task->state;
+        memcpy(out[n].name, task->name, sizeof(out[n].name));
+        n++;
+        task = task->next;
+    } while (task != task_list && n < max);
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return n;
+}
+
+/**
+ * show_top:
+ *   Every second, lists the tasks that used the most CPU since the last
+ *   refresh. 100% is one CPU's worth of ticks. Idle time is what the
+ *   busy tasks leave of every online CPU.
+ */
+static void show_top()
+{
+    top_entry_t* old = kmalloc(MAX_ACTIVE_TASKS * sizeof(top_entry_t));
+    top_entry_t* cur = kmalloc(MAX_ACTIVE_TASKS * sizeof(top_entry_t));
+    top_entry_t* swap;
+    top_entry_t tmp;
+    uint32_t old_n, n, i, j;
+    uint32_t start, elapsed, busy, permille;
+
+    if (!old || !cur)
+    {
+        puts_color("top: out of memory!\n", RED);
+        kfree(old);
+        kfree(cur);
+        return;
+    }
+    while (get_last_char())
+        ;
+    old_n = top_snapshot(old, MAX_ACTIVE_TASKS);
+    start = get_kticks();
+    while (!get_last_char())
+    {
+        timer_sleep(TOP_REFRESH_TICKS);
+        n = top_snapshot(cur, MAX_ACTIVE_TASKS);
+        elapsed = get_kticks() - start;
+        start += elapsed;
+        if (!elapsed)
+            elapsed = 1;
+
+        busy = 0;
+        for (i = 0; i < n; i++)
+        {
+            for (j = 0; j < old_n; j++)
+            {
+                if (old[j].pid == cur[i].pid)
+                {
+                    cur[i].delta = cur[i].ticks - old[j].ticks;
+                    break;
+                }
+            }
+            busy += cur[i].delta;
+        }
+        /* The busiest TOP_ROWS first, the rest is not shown */
+        for (i = 0; i < n && i < TOP_ROWS; i++)
+        {
+            for (j = i + 1; j < n; j++)
+            {
+                if (cur[j].delta > cur[i].delta)
+                {
+                    tmp = cur[i];
+                    cur[i] = cur[j];
+                    cur[j] = tmp;
+                }
+            }
+        }
+
+        clear_screen();
+        permille = busy * 1000 / (elapsed * cpus_online);
+        printf("top: %u tasks, %u CPUs, %u.%u%c busy, any key quits\n",
+               n, cpus_online, permille / 10, permille % 10, '%');
+        printf("  PID   CPU%c   TIME(s)  STATE  CPU  NAME\n", '%');
+        for (i = 0; i < n && i < TOP_ROWS; i++)
+        {
+            permille = cur[i].delta * 1000 / elapsed;
+            printf("  %d  %u.%u  %u  %s  %u  %s\n", cur[i].pid,
+                   permille / 10, permille % 10, cur[i].ticks / PIT_FREQUENCY,
+                   task_state_names[cur[i].state], cur[i].cpu, cur[i].name);
+        }
+
+        swap = old;
+        old = cur;
+        cur = swap;
+        old_n = n;
+    }
+    kfree(old);
+    kfree(cur);
 }
 
 void add_new_task(task_t* new_task)
 {
+    uint32_t flags = spin_lock_irqsave(&sched_lock);
+    runqueue_t* rq;
+    uint32_t cpu;
+
+    cpu = select_cpu();
+    rq = &runqueues[cpu];
+    spin_lock(&rq->lock);
+    new_task->cpu_id = cpu;
+    new_task->last_cpu = cpu;
+    rq->load++;
+    task_update_level(new_task);
+    new_task->time_slice = level_quantum(new_task->sched_level);
+    if (task_runnable(new_task))
+        rq_enqueue(new_task);
+    spin_unlock(&rq->lock);
+    pid_hash_insert(new_task);
+    nr_tasks++;
     if (!task_list)
     {
         task_list = new_task;
         new_task->next = new_task;
-        current_task = task_list;
     }
     else
     {
@@ -249,27 +1289,89 @@ void add_new_task(task_t* new_task)
         current->next = new_task;
         new_task->next = task_list;
     }
+    spin_unlock_irqrestore(&sched_lock, flags);
+    if (cpu != smp_processor_id() && cpu_is_idle(cpu))
+        smp_send_reschedule(cpu);
 }
 
 static void task_exit_task(task_t* task, int signal)
 {
+    runqueue_t* rq;
+    uint32_t flags;
+
+    /*
+     * Another task is taken off its queue first, so no CPU picks it from
+     * here on. One that is running, or whose registers are still being
+     * saved, cannot be freed under it: it is left to kill itself.
+     */
+    if (task != current_task)
+    {
+        flags = irq_save();
+        rq = task_rq_lock(task);
+        /* Exiting already, or a zombie */
+        if (task->state == TASK_ZOMBIE)
+        {
+            spin_unlock(&rq->lock);
+            irq_restore(flags);
+            return;
+        }
+        if (task->on_cpu)
+        {
+            task->signals.pending_signals |= 1 << 9;
+            spin_unlock(&rq->lock);
+            irq_restore(flags);
+            return;
+        }
+        rq_remove(task);
+        task->state = TASK_ZOMBIE;
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+    }
+
     if (task->on_exit)
         task->on_exit();
 
-    task_t *prev = current_task;
+    /* Interrupts stay off until we switch away, or are done with another */
+    flags = irq_save();
+    /* Both take their own locks, which come before sched_lock */
+    wait_queue_remove(task);
+    timer_del(&task->sleep_timer);
+
+    spin_lock(&sched_lock);
+    task_t *prev = task;
     while (prev->next != task)
         prev = prev->next;
 
     prev->next = task->next;
+    if (task_list == task)
+        task_list = task->next;
+    /* Its PID stays taken while it is a zombie on its parent's list */
+    pid_hash_remove(task);
+    nr_tasks--;
+    if (task->parent)
+    {
+        task->parent->cutime += task->utime + task->cutime;
+        task->parent->cstime += task->stime + task->cstime;
+    }
+    task->exit_status = signal;
+    orphan_children(task);
 
-    pid_t pid = task->pid;
-
+    rq = task_rq_lock(task);
+    rq_remove(task);
+    rq->load--;
     task->state = TASK_ZOMBIE;
-    // printf("Task %d exited with status %d ---\n", pid, signal);
-    enqueue(&finished_pid_queue, pid, signal);
-    to_free = task;
+    spin_unlock(&rq->lock);
+    // printf("Task %d exited with status %d ---\n", task->pid, signal);
+    spin_unlock(&sched_lock);
+    wake_up(&task_exit_wq);
+
+    /* Ourselves, finish_switch() hands us over once we are off our stack */
+    if (task != current_task)
+        reap_task(task);
 
     scheduler();
+    /* Only reached when another task was killed */
+    irq_restore(flags);
 }
 
 static void task_exit_pid(pid_t task_id)
@@ -298,10 +1400,13 @@ void kill_task(int signal)
 
 void add_child(task_t* parent, task_t* child)
 {
-    child_list_t *new_child = kmalloc(sizeof(child_list_t));
+    child_list_t *new_child = kmem_cache_alloc(child_cache);
+    uint32_t flags;
+
     new_child->task = child;
     new_child->next = NULL;
 
+    flags = spin_lock_irqsave(&sched_lock);
     if (!parent->children)
     {
         parent->children = new_child;
@@ -315,32 +1420,42 @@ void add_child(task_t* parent, task_t* child)
         }
         current->next = new_child;
     }
+    spin_unlock_irqrestore(&sched_lock, flags);
 }
 
 void create_task(void (*entry)(void), char* name, void (*on_exit)(void))
 {
     task_t *task;
     uint32_t *stack;
-    uint32_t *kernel_stack;
+    uint32_t *stack_top;
 
-    if (task_index >= MAX_ACTIVE_TASKS)
+    if (nr_tasks >= MAX_ACTIVE_TASKS)
     {
         puts_color("Max number of tasks reached\n", RED);
         return;
     }
     
-    task = kmalloc(sizeof(task_t));
-    stack = kmalloc(STACK_SIZE);
-    kernel_stack = kmalloc(STACK_SIZE);
-    
-    memset(stack, 0, STACK_SIZE);
-    task->stack = (uint32_t)stack; /* Point to the stack for being able to release it. */
-
-    stack = (uint32_t*)((uint32_t)stack & 0xFFFFFFF0);
-    stack += STACK_SIZE / sizeof(uint32_t);
+    task = alloc_task();
+    if (!task)
+    {
+        puts_color("create_task: out of memory\n", RED);
+        return;
+    }
+    task->mm = mm_create();
+    task->cpu.cr3 = task->mm ? task->mm->pgdir : 0;
+    stack_top = task->mm ? map_task_stack(task->cpu.cr3, TASK_STACK_SIZE) : NULL;
+    task->kernel_stack = stack_top ? alloc_kernel_stack() : 0;
+    if (!task->kernel_stack || init_signals(task) < 0)
+    {
+        puts_color("create_task: out of memory\n", RED);
+        task_release(task);
+        return;
+    }
 
-    kernel_stack = (uint32_t*)((uint32_t)kernel_stack & 0xFFFFFFF0);
-    kernel_stack += STACK_SIZE / sizeof(uint32_t);
+    /* Ring 0 cannot fault on its own stack: it stays fully mapped */
+    vma_map(task->mm, USER_STACK_TOP - TASK_STACK_SIZE, TASK_STACK_SIZE, VM_READ | VM_WRITE);
+    task->stack = USER_STACK_TOP - TASK_STACK_SIZE;
+    stack = stack_top;
 
     // Simulate interrupt frame (EIP, EFLAGS, etc.)
     *--stack = 0x202;   // EFLAGS (IF enabled)
@@ -348,10 +1463,11 @@ void create_task(void (*entry)(void), char* name, void (*on_exit)(void))
     *--stack = (uint32_t)task_exit; // EIP
     *--stack = (uint32_t)entry; // EIP
 
-    task->pid = task_index++;
-    task->cpu.esp_ = (uint32_t)stack; // Point to the simulated interrupt frame
+    task->pid = pid_alloc();
+    task->tgid = task->pid;
+    task->cpu.esp_ = STACK_VA(stack_top, stack); // Point to the simulated interrupt frame
+    task->cpu.eflags = 0x202; // Starts with interrupts on, so it can be preempted
     task->state = TASK_READY;
-    task->kernel_stack = (uint32_t)kernel_stack;
     memcpy(task->name, name, strlen(name) > 15 ? 15 : strlen(name));
     task->name[strlen(name) > 15 ? 15 : strlen(name)] = '\0';
     task->on_exit = on_exit;
@@ -361,7 +1477,6 @@ void create_task(void (*entry)(void), char* name, void (*on_exit)(void))
     task->gid = 0;
     task->is_user = false;
     task->env = NULL; /* Kernel tasks don't need envp. */
-    init_signals(task);
     add_new_task(task);
 }
 
@@ -370,7 +1485,6 @@ void create_user_task(void (*entry)(char**), char* name, void (*on_exit)(void))
     task_t *task;
     uint32_t *base;
     uint32_t *user_stack;
-    uint32_t *kernel_stack;
     uint32_t *user_stack_top;
     int env_size;
     int i;
@@ -378,22 +1492,33 @@ void create_user_task(void (*entry)(char**), char* name, void (*on_exit)(void))
     char* equal;
     char* value;
 
-    if (task_index >= MAX_ACTIVE_TASKS)
+    if (nr_tasks >= MAX_ACTIVE_TASKS)
     {
         puts_color("Max number of tasks reached\n", RED);
         return;
     }
     
-    task = kmalloc(sizeof(task_t));
-
-    base = (uint32_t*)vmalloc(USER_STACK_SIZE, true);
-    memset(base, 0, USER_STACK_SIZE);
+    task = alloc_task();
+    if (!task)
+    {
+        puts_color("create_user_task: out of memory\n", RED);
+        return;
+    }
 
-    user_stack_top = base + (USER_STACK_SIZE / sizeof(uint32_t)) - 1;
+    task->mm = mm_create();
+    task->cpu.cr3 = task->mm ? task->mm->pgdir : 0;
+    base = task->mm ? map_task_stack(task->cpu.cr3, USER_STACK_SIZE) : NULL;
+    task->kernel_stack = base ? alloc_kernel_stack() : 0;
+    if (!task->kernel_stack || init_signals(task) < 0)
+    {
+        puts_color("create_user_task: out of memory\n", RED);
+        task_release(task);
+        return;
+    }
 
-    kernel_stack = kmalloc(STACK_SIZE);
-    kernel_stack = (uint32_t*)((uint32_t)kernel_stack & 0xFFFFFFF0);
-    kernel_stack += STACK_SIZE / sizeof(uint32_t);
+    /* Only the top page is mapped, the rest grows in on page faults */
+    vma_map(task->mm, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_SIZE, VM_READ | VM_WRITE | VM_GROWSDOWN);
+    user_stack_top = base - 1;
 
     task->env = env_hashtable_create(128);
     for (i = 0; default_envp[i]; i++)
@@ -412,7 +1537,7 @@ void create_user_task(void (*entry)(char**), char* name, void (*on_exit)(void))
 
     user_stack = user_stack_top;
     *--user_stack = 0x2B;
-    *--user_stack = (uint32_t)user_stack_top;
+    *--user_stack = STACK_VA(base, user_stack_top);
     *--user_stack = (uint32_t)task_exit; // EIP
     *--user_stack = 0x202;
     *--user_stack = 0x23;
@@ -420,14 +1545,15 @@ void create_user_task(void (*entry)(char**), char* name, void (*on_exit)(void))
     *--user_stack;
     *--user_stack = (uint32_t)entry;
 
-    printf("User stack top after building iret frame: %p\n", user_stack);
+    printf("User stack top after building iret frame: %p\n", (void*)STACK_VA(base, user_stack));
 
     // make_page_user((uintptr_t)entry);
 
-    task->pid = task_index++;
-    task->cpu.esp_ = (uint32_t)user_stack;
-    task->kernel_stack = (uint32_t)kernel_stack;
-    task->stack = (uint32_t)base;
+    task->pid = pid_alloc();
+    task->tgid = task->pid;
+    task->cpu.esp_ = STACK_VA(base, user_stack);
+    task->cpu.eflags = 0x202;
+    task->stack = USER_STACK_TOP - USER_STACK_SIZE;
     task->state = TASK_READY;
     memcpy(task->name, name, strlen(name) > 15 ? 15 : strlen(name));
     task->name[strlen(name) > 15 ? 15 : strlen(name)] = '\0';
@@ -437,126 +1563,78 @@ void create_user_task(void (*entry)(char**), char* name, void (*on_exit)(void))
     task->euid = 1000;
     task->gid = 1000;
     task->is_user = true;
-    init_signals(task);
     add_new_task(task);
 }
 
 pid_t _do_fork(const cpu_state_t *parent_state)
 {
-    if (task_index >= MAX_ACTIVE_TASKS)
+    if (nr_tasks >= MAX_ACTIVE_TASKS)
     {
         puts_color("Max number of tasks reached\n", RED);
         return -1;
     }
 
     task_t *parent = current_task;
-    task_t *child = kmalloc(sizeof(task_t));
-    if (!child)
-        return -1;
+    task_t *child;
+    uintptr_t stack_start;
+    uintptr_t stack_end;
 
-    uint32_t live_esp = parent_state->esp_;
-
-
-    /*
-     * Determine the parent's aligned stack top.
-     * (This must match the way create_task() computes it.)
-     */
-    uint32_t *parent_raw_stack = (uint32_t *)parent->stack;
-    uint32_t *parent_stack_top = (uint32_t *)((uint32_t)parent_raw_stack & 0xFFFFFFF0);
-    parent_stack_top += STACK_SIZE / sizeof(uint32_t);
-
-    /* Calculate the used portion of the parent's stack in bytes.
-       (Stack grows downward so: used_bytes = parent_stack_top - live_esp) */
-    size_t used_bytes = (uint32_t)parent_stack_top - live_esp;
-
-    /*
-     * Allocate and align a new user stack for the child.
-     */
-    uint32_t *child_raw_stack = kmalloc(STACK_SIZE);
-    if (!child_raw_stack)
+    /* A kernel thread has no user window to copy */
+    if (!parent->mm)
+        return -1;
+    child = alloc_task();
+    if (!child)
         return -1;
-    child->stack = (uint32_t)child_raw_stack;
-    uint32_t *child_stack_top = (uint32_t *)((uint32_t)child_raw_stack & 0xFFFFFFF0);
-    child_stack_top += STACK_SIZE / sizeof(uint32_t);
 
     /*
-     * Compute the child's new ESP so that the same amount of stack is used.
-     * That is, if parent's ESP is X bytes below parent's top,
-     * then child's ESP = child_stack_top - used_bytes.
-     */
-    uint32_t *child_cpu_esp = (uint32_t *)((uint32_t)child_stack_top - used_bytes);
-    memcpy(child_cpu_esp, (void*)live_esp, used_bytes);
-
-    /* 
-     * Copy parent's CPU state (captured earlier) into the child.
+     * The child gets the parent's registers and a copy-on-write clone of
+     * its address space. The stack is copied eagerly: it sits at the same
+     * address in both, so no pointer into it needs fixing up.
      */
     memcpy(&child->cpu, parent_state, sizeof(cpu_state_t));
-    child->cpu.esp_ = (uint32_t)child_cpu_esp;
-
-    /* --- Adjust the frame pointer (EBP) chain in the copied stack --- */
+    task_stack_range(parent, &stack_start, &stack_end);
+    child->mm = mm_fork(parent->mm, stack_start, stack_end);
+    if (!child->mm)
     {
-        uintptr_t parent_top_addr = (uintptr_t)parent_stack_top;
-        uintptr_t child_top_addr  = (uintptr_t)child_stack_top;
-        uintptr_t delta = child_top_addr - parent_top_addr;
-
-        if (child->cpu.ebp >= live_esp && child->cpu.ebp < parent_top_addr)
-        {
-            child->cpu.ebp += delta;
-            uint32_t *cur_ebp = (uint32_t *)child->cpu.ebp;
-            while(cur_ebp &&
-                  ((uintptr_t)cur_ebp >= (uintptr_t)child_cpu_esp) &&
-                  ((uintptr_t)cur_ebp < child_top_addr))
-            {
-                uint32_t saved_ebp = *cur_ebp;
-                if (saved_ebp >= live_esp && saved_ebp < parent_top_addr)
-                {
-                    uint32_t new_val = saved_ebp + delta;
-                    *cur_ebp = new_val;
-                    cur_ebp = (uint32_t *)new_val;
-                }
-                else
-                {
-                    break;
-                }
-            }
-        }
+        kmem_cache_free(task_cache, child);
+        return -1;
     }
-    /* --- End EBP fix-up --- */
+    child->cpu.cr3 = child->mm->pgdir;
 
     /*
-     * Insert a trampoline address on the child's stack.
-     *
-     * When the child is scheduled, the context switch will load its ESP
-     * from child->cpu.esp_. A subsequent "ret" will pop the trampoline address,
-     * jump to fork_trampoline (which sets EAX to 0), and then "ret" to the
-     * original return address.
+     * When the child is scheduled, switch_context "ret"s into
+     * fork_trampoline, which makes capture_cpu_state() return 1 in _fork().
+     * The slot of capture_cpu_state()'s return address has been reused by
+     * the call to us since, so it is written back from the saved EIP.
      */
-    uint32_t *child_sp = (uint32_t *)child->cpu.esp_;
-    child_sp--;  // reserve space for the trampoline address
-    *child_sp = (uint32_t)fork_trampoline;
-    child->cpu.esp_ = (uint32_t)child_sp;
+    child->cpu.esp_ += sizeof(uint32_t);
+    push_task_stack(child, parent_state->eip);
+    push_task_stack(child, (uint32_t)fork_trampoline);
+    child->stack = parent->stack;
 
     /*
      * Allocate a new kernel stack for the child.
      * (Here we simply allocate a fresh kernel stack rather than copying the parent's.)
      */
-    uint32_t *child_kstack_alloc = kmalloc(STACK_SIZE);
-    if (!child_kstack_alloc)
+    child->kernel_stack = alloc_kernel_stack();
+    if (!child->kernel_stack || fpu_fork(child, parent) < 0 || init_signals(child) < 0)
+    {
+        task_release(child);
         return -1;
-    uint32_t *child_kstack_top = (uint32_t *)((uint32_t)child_kstack_alloc & 0xFFFFFFF0);
-    child_kstack_top += STACK_SIZE / sizeof(uint32_t);
-    child->kernel_stack = (uint32_t)child_kstack_top;
+    }
 
     /* Set up the remainder of the child's task structure. */
-    child->pid = task_index++;
+    child->pid = pid_alloc();
+    child->tgid = child->pid;
+    child->tls = parent->tls;
     child->state = TASK_READY;
     memcpy(child->name, parent->name, 15);
     child->name[15] = '\0';
     child->on_exit = parent->on_exit;
     child->entry = parent->entry;
     child->parent = parent;
+    child->nice = parent->nice;
     add_child(parent, child);
-    init_signals(child);
 
     add_new_task(child);
     // printf("Forked new task: child pid %d, parent pid %d\n", child->pid, parent->pid);
@@ -566,26 +1644,180 @@ pid_t _do_fork(const cpu_state_t *parent_state)
 pid_t _fork(void)
 {
     cpu_state_t state;
-    capture_cpu_state(&state);
+
+    /* Returns a second time, in the child, once it is first scheduled */
+    if (capture_cpu_state(&state))
+        return 0;
     return _do_fork(&state);
 }
 
+/* Where a clone() thread starts: its return value is its exit status. */
+static void thread_entry(int (*fn)(void*), void* arg)
+{
+    _exit(fn(arg));
+}
+
+/*
+ * Stack of a new thread: the one given, else THREAD_STACK_SIZE bytes in
+ * the mmap part of its space, or kernel pages for a kernel thread. It is
+ * backed right away, as the thread's first frame is built in it and ring
+ * 0 cannot fault on its own stack. Returns its top, or 0.
+ */
+static uintptr_t thread_stack_setup(task_t* task, void* stack)
+{
+    uintptr_t top = (uintptr_t)stack & ~0xFU;
+
+    if (stack)
+    {
+        task->stack = (top - THREAD_STACK_SIZE) & ~0xFFFU;
+        if (task->mm && vma_populate(task->mm, task->stack, top - task->stack) < 0)
+            return 0;
+        return top;
+    }
+    if (task->mm)
+    {
+        task->thread_stack = vma_alloc(task->mm, THREAD_STACK_SIZE, VM_READ | VM_WRITE);
+        if (task->thread_stack && vma_populate(task->mm, task->thread_stack, THREAD_STACK_SIZE) < 0)
+            return 0;
+    }
+    else
+        task->thread_stack = (uintptr_t)alloc_pages_contig(THREAD_STACK_SIZE / PAGE_SIZE);
+    task->stack = task->thread_stack;
+    return task->thread_stack ? task->thread_stack + THREAD_STACK_SIZE : 0;
+}
+
+/**
+ * thread_create:
+ *   A new task running fn(arg) on 'stack', made from 'parent' as 'flags'
+ *   tell: with CLONE_VM it runs in the same address space, with
+ *   CLONE_SIGHAND it shares the signal handlers, with CLONE_THREAD it
+ *   joins the parent's thread group and is nobody's child. Open files
+ *   are never shared: the thread starts with none. NULL on failure.
+ */
+static task_t* thread_create(task_t* parent, uint32_t flags, int (*fn)(void*), void* arg,
+                             void* stack, uint32_t tls, const char* name)
+{
+    task_t* task;
+    uintptr_t stack_start;
+    uintptr_t stack_end;
+    uintptr_t top;
+
+    if (!fn || nr_tasks >= MAX_ACTIVE_TASKS)
+        return NULL;
+    if (((flags & CLONE_SIGHAND) && !(flags & CLONE_VM))
+        || ((flags & CLONE_THREAD) && !(flags & CLONE_SIGHAND)))
+        return NULL;
+    task = alloc_task();
+    if (!task)
+        return NULL;
+
+    if (parent->mm && (flags & CLONE_VM))
+    {
+        mm_get(parent->mm);
+        task->mm = parent->mm;
+    }
+    else if (parent->mm)
+    {
+        task_stack_range(parent, &stack_start, &stack_end);
+        task->mm = mm_fork(parent->mm, stack_start, stack_end);
+        if (!task->mm)
+        {
+            kmem_cache_free(task_cache, task);
+            return NULL;
+        }
+    }
+    task->cpu.cr3 = task->mm ? task->mm->pgdir : vmm_kernel_directory();
+
+    top = thread_stack_setup(task, stack);
+    task->kernel_stack = top ? alloc_kernel_stack() : 0;
+    if (!task->kernel_stack || copy_signals(task, parent, (flags & CLONE_SIGHAND) != 0) < 0)
+    {
+        task_release(task);
+        return NULL;
+    }
+
+    /* switch_context() returns into thread_entry(fn, arg) */
+    task->cpu.esp_ = top;
+    push_task_stack(task, (uint32_t)arg);
+    push_task_stack(task, (uint32_t)fn);
+    push_task_stack(task, 0);
+    push_task_stack(task, (uint32_t)thread_entry);
+    task->cpu.eflags = 0x202;
+
+    task->pid = pid_alloc();
+    task->tgid = (flags & CLONE_THREAD) ? parent->tgid : task->pid;
+    task->tls = (flags & CLONE_SETTLS) ? tls : parent->tls;
+    task->state = TASK_READY;
+    strncpy(task->name, name, 15);
+    task->name[15] = '\0';
+    task->nice = parent->nice;
+    task->uid = parent->uid;
+    task->euid = parent->euid;
+    task->gid = parent->gid;
+    task->is_user = parent->is_user;
+    /* Threads of a group are not waited for, the group is */
+    if (!(flags & CLONE_THREAD))
+    {
+        task->parent = parent;
+        add_child(parent, task);
+    }
+    add_new_task(task);
+    return task;
+}
+
+/**
+ * _clone:
+ *   Starts fn(arg) as a new task sharing what 'flags' say with the
+ *   caller, see thread_create(). 'stack' is its top, NULL for one of
+ *   THREAD_STACK_SIZE bytes; 'tls' the base of its %fs with
+ *   CLONE_SETTLS. Returns the new PID, -1 on failure.
+ */
+pid_t _clone(uint32_t flags, int (*fn)(void*), void* arg, void* stack, uint32_t tls)
+{
+    task_t* task = thread_create(current_task, flags, fn, arg, stack, tls, current_task->name);
+
+    if (!task)
+    {
+        puts_color("clone: cannot create the thread!\n", RED);
+        return -1;
+    }
+    return task->pid;
+}
+
+/**
+ * kthread_create:
+ *   A kernel thread running fn(arg): no user window, the kernel's page
+ *   directory, and the signal handlers of the boot task. It is in thread
+ *   group 0 and nobody waits for it.
+ */
+task_t* kthread_create(int (*fn)(void*), void* arg, const char* name)
+{
+    return thread_create(cpus[0].idle, CLONE_VM | CLONE_SIGHAND | CLONE_THREAD, fn, arg, NULL, 0, name);
+}
+
 void scheduler_init(void)
 {
-    task_t *idle = kmalloc(sizeof(task_t));
-    uint32_t *stack = kmalloc(STACK_SIZE);
-    stack += STACK_SIZE / sizeof(uint32_t);
+    task_cache = kmem_cache_create("task_t", sizeof(task_t), 0, NULL);
+    child_cache = kmem_cache_create("child_list_t", sizeof(child_list_t), 0, NULL);
 
-    init_queue(&finished_pid_queue);
+    task_t *idle = alloc_task();
+    uint32_t *stack = (uint32_t*)alloc_kernel_stack();
+
+    wait_queue_init(&task_exit_wq);
+    init_work(&reap_work, reap_tasks, NULL);
 
     *--stack = 0x202;
     *--stack = 0x08;
     *--stack = (uint32_t)kernel_main;
-    task_index = 0;
+    memset(pid_bitmap, 0, sizeof(pid_bitmap));
+    memset(pid_hash, 0, sizeof(pid_hash));
+    pid_bitmap[0] = 1;  /* PID 0 is ours for good */
+    last_pid = 0;
 
-    idle->pid = task_index++;
+    idle->pid = 0;
     idle->cpu.esp_ = (uint32_t)stack;
     idle->cpu.eip = (uint32_t)kernel_main;
+    idle->cpu.cr3 = vmm_kernel_directory();
     idle->state = TASK_READY;
     idle->next = idle;
     memcpy(idle->name, "idle", 4);
@@ -593,13 +1825,39 @@ void scheduler_init(void)
     idle->uid = 0;
     idle->euid = 0;
     idle->gid = 0;
-    current_task = idle;
+    idle->cpu_id = 0;
+    cpus[0].current = idle;
+    cpus[0].idle = idle;
     task_list = idle;
-    to_free = NULL;
+    pid_hash_insert(idle);
+    nr_tasks = 1;
     init_signals(idle);
     install_all_cmds(commands, TASKS);
 }
 
+/**
+ * sched_init_cpu:
+ *   Makes the code an AP runs into its idle task, before it takes ticks.
+ *   Like the BSP's it never exits, so it stays out of the task list and
+ *   PID tables: PID 0 is the BSP's.
+ */
+void sched_init_cpu(void)
+{
+    cpu_t* cpu = this_cpu();
+    task_t* idle = alloc_task();
+
+    idle->pid = 0;
+    idle->cpu.cr3 = vmm_kernel_directory();
+    idle->state = TASK_RUNNING;
+    idle->next = idle;
+    memcpy(idle->name, "idle", 4);
+    idle->name[4] = '\0';
+    idle->cpu_id = cpu->id;
+    init_signals(idle);
+    cpu->current = idle;
+    cpu->idle = idle;
+}
+
 /*************************************** */
 void task_1_exit()
 {
@@ -776,6 +2034,9 @@ void task_wait()
     while (1)
     {
         pid = _wait(&status);
+        /* No children to wait for */
+        if (pid < 0)
+            timer_sleep(PIT_FREQUENCY);
         set_putchar_color(GREEN);
         // printf("Task 5: Child %d exited with status %d\n", pid, status);
         set_putchar_color(LIGHT_GREY);
@@ -804,7 +2065,7 @@ void unsleep_kshell()
     // puts("Unsleeping kshell\n");
     /* Assuming kshell it's allways 1. */
     task_t *kshell = get_task_by_pid(1);
-    kshell->state = TASK_READY;
+    task_wake(kshell);
     force_no_syscall();
 }
 
@@ -824,7 +2085,6 @@ void start_foo_tasks(void)
     create_task(task_socket_send, "task_socket_send", NULL);
     create_task(task_socket_recv, "task_socket_recv", NULL);
         
-    to_free = NULL;
     // printf("current_task: %p\n", current_task);
 }
 
@@ -841,6 +2101,21 @@ void show_tasks()
         printf("  ESP: %p\n", current->cpu.esp_);
         printf("  EIP: %p\n", current->cpu.eip);
         printf("  State: %d\n", current->state);
+        printf("  Level: %u (nice %d)\n", current->sched_level, current->nice);
+        printf("  Time: %u user, %u system, %u waiting (ticks)\n",
+               current->utime, current->stime, current->wait_ticks);
+        printf("  Switches: %u voluntary, %u involuntary\n",
+               current->nvcsw, current->nivcsw);
+        printf("  FPU: %s\n", current->fpu_state ? "used" : "never");
+        printf("  CPU: %u\n", current->cpu_id);
         current = current->next;
     } while (current != task_list);
+    for (uint32_t cpu = 0; cpu < cpu_count; cpu++)
+    {
+        if (!cpus[cpu].online)
+            continue;
+        printf("CPU %u: %u queued, %u tasks, %u steals, %u stolen\n", cpu,
+               runqueues[cpu].nr_queued, runqueues[cpu].load,
+               runqueues[cpu].steals, runqueues[cpu].stolen);
+    }
 }
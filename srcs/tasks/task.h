@@ -6,6 +6,26 @@
 #include "../utils/utils.h"
 #include "cpu_state.h"
 #include "env.h"
+#include "../memory/memory.h"
+#include "wait_queue.h"
+#include "../timers/timers.h"
+
+/* Descriptors 0-2 are the console, files start at 3 */
+#define TASK_MAX_FILES 16
+
+/* clone() flags, as Linux numbers them */
+#define CLONE_VM        0x00000100  /* Share the address space */
+#define CLONE_SIGHAND   0x00000800  /* Share signal handlers, needs CLONE_VM */
+#define CLONE_THREAD    0x00010000  /* Same thread group, needs CLONE_SIGHAND */
+#define CLONE_SETTLS    0x00080000  /* 'tls' is the base of %fs */
+
+/* waitpid() options */
+#define WNOHANG         0x1         /* Return 0 rather than sleep */
+
+/* Stack clone() maps when given none, also the least it populates of one given */
+#define THREAD_STACK_SIZE (4 * 4096)
+
+struct ext2_FILE;
 
 typedef enum
 {
@@ -27,12 +47,40 @@ typedef struct task_struct
     cpu_state_t cpu;
     uint32_t cpu_esp_;    // you might keep cpu state in a struct
     uint32_t pid;
+    uint32_t tgid;        // Thread group: the PID of its first thread
     uintptr_t kernel_stack; // Kernel Stack (for syscalls)
     uintptr_t stack;        // User Stack
+    uintptr_t thread_stack; // Stack clone() allocated, 0 if none
+    mm_t *mm;               // User window, NULL for kernel threads
+    uint32_t tls;           // Base of %fs, 0 for none
+    struct ext2_FILE *files[TASK_MAX_FILES]; // Open files, by descriptor
     struct task_struct *parent;
     struct task_struct *next;
     child_list_t *children;
     task_state_t state;
+    uint32_t time_slice;  // Ticks left before the timer preempts us
+    uint32_t utime;       // Ticks charged outside syscalls
+    uint32_t stime;       // Ticks charged inside syscalls
+    uint32_t cutime;      // utime of exited children, theirs included
+    uint32_t cstime;
+    uint32_t nvcsw;       // Gave the CPU up: blocked, yielded or exited
+    uint32_t nivcsw;      // Preempted
+    uint32_t wait_ticks;  // Runnable on a queue but not running
+    uint32_t ready_since; // kticks when queued, 0 when not
+    void *fpu_state;      // FPU/SSE registers, once it used them
+    bool in_syscall;      // Not preempted until the syscall returns
+    int nice;             // -20 (favoured) to 19
+    uint32_t sched_level; // Run queue, 0 is picked first
+    uint32_t sched_penalty; // Levels lost by using up whole slices
+    bool on_rq;
+    uint32_t cpu_id; // CPU whose run queue it belongs to
+    uint32_t last_cpu; // Where it last ran, its cache may still be there
+    volatile bool on_cpu; // Running, or its registers not saved yet
+    struct task_struct *rq_next;
+    wait_queue_t *wait_queue;     // Queue we sleep on, if any
+    struct task_struct *wait_next;
+    ktimer_t sleep_timer;         // Armed while in timer_sleep()
+    struct task_struct *pid_next; // PID hash chain
     char name[16];
     void (*on_exit)(void);
     void (*entry)(void);
@@ -41,6 +89,7 @@ typedef struct task_struct
     void *mem_block;      // pointer to the big allocation
     size_t block_size;    // total size of the allocation
     int exit_status;
+    bool released;        // Zombie whose resources the reaper freed
     uid_t uid;
     uid_t euid;
     gid_t gid;
@@ -51,15 +100,29 @@ typedef struct task_struct
 } task_t;
 
 void scheduler(void);
+void scheduler_tick(void);
+void cpu_idle(void);
+void task_wake(task_t* task);
+int _nice(int inc);
+struct tms;
+struct rusage;
+long _times(struct tms* buf);
+int _getrusage(int who, struct rusage* usage);
 void start_foo_tasks(void);
 void scheduler_init(void);
+void sched_init_cpu(void);
 task_t* get_task_by_pid(pid_t pid);
 task_t* get_current_task();
 void kill_task();
 
 void _exit(int status);
+pid_t _wait(int* status);
+pid_t _waitpid(pid_t pid, int* status, int options);
+pid_t _wait4(pid_t pid, int* status, int options, struct rusage* usage);
 
 pid_t _fork(void);
+pid_t _clone(uint32_t flags, int (*fn)(void*), void* arg, void* stack, uint32_t tls);
+task_t* kthread_create(int (*fn)(void*), void* arg, const char* name);
 
 void start_user();
 
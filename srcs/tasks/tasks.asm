@@ -12,10 +12,21 @@ switch_context:
     mov [eax + 20], ebp
     mov [eax + 24], esp
     pushfd                 ; get the old EFLAGS into stack
-    pop dword [eax + 28]        ; store them in old_task->cpu.eflags (for example)
+    pop dword [eax + 32]        ; store them in old_task->cpu.eflags
+    cli                    ; no IRQ may push on the old stack once CR3 changes
 
     ; Restore new task's registers
     mov eax, [esp + 8]   ; new_task pointer
+
+    ; Switch address space (the stack VA now belongs to the new task)
+    mov ecx, [eax + 36]  ; new_task->cpu.cr3
+    test ecx, ecx
+    jz .same_space
+    mov edx, cr3
+    cmp ecx, edx
+    je .same_space
+    mov cr3, ecx
+.same_space:
     mov ebx, [eax + 0]
     mov ecx, [eax + 4]
     mov edx, [eax + 8]  
@@ -23,7 +34,7 @@ switch_context:
     mov edi, [eax + 16]
     mov ebp, [eax + 20]
     mov esp, [eax + 24]
-    push dword [eax + 28]        ; restore new_task->cpu.eflags
+    push dword [eax + 32]        ; restore new_task->cpu.eflags
     popfd
 
     ; .switch_to_new_task:
@@ -45,10 +56,21 @@ switch_context_to_user:
     mov [eax + 20], ebp
     mov [eax + 24], esp
     pushfd                 ; get the old EFLAGS into stack
-    pop dword [eax + 28]        ; store them in old_task->cpu.eflags (for example)
+    pop dword [eax + 32]        ; store them in old_task->cpu.eflags
+    cli                    ; no IRQ may push on the old stack once CR3 changes
 
     ; Restore new task's registers
     mov eax, [esp + 8]   ; new_task pointer
+
+    ; Switch address space (the stack VA now belongs to the new task)
+    mov ecx, [eax + 36]  ; new_task->cpu.cr3
+    test ecx, ecx
+    jz .same_space
+    mov edx, cr3
+    cmp ecx, edx
+    je .same_space
+    mov cr3, ecx
+.same_space:
     mov ebx, [eax + 0]
     mov ecx, [eax + 4]
     mov edx, [eax + 8]  
@@ -56,7 +78,7 @@ switch_context_to_user:
     mov edi, [eax + 16]
     mov ebp, [eax + 20]
     mov esp, [eax + 24]
-    push dword [eax + 28]        ; restore new_task->cpu.eflags
+    push dword [eax + 32]        ; restore new_task->cpu.eflags
     popfd
 
     ; .switch_to_new_task:
@@ -69,7 +91,7 @@ switch_context_to_user:
 [bits 32]
 global fork_trampoline
 fork_trampoline:
-    mov eax, 0
+    mov eax, 1             ; capture_cpu_state() returning in the child
     ret
 
 global capture_cpu_state
@@ -84,9 +106,11 @@ capture_cpu_state:
     mov [eax + 20], ebp
     mov [eax + 24], esp
     pushfd                 ; get the old EFLAGS into stack
-    pop dword [eax + 28]        ; store them in old_task->cpu.eflags (for example)
+    pop dword [eax + 32]        ; store them in old_task->cpu.eflags
+    mov ecx, [esp]         ; our return address, for fork to resume the child at
+    mov [eax + 28], ecx
 
-    ; Return to new task's EIP (stored on its stack)
+    xor eax, eax           ; 0 now, 1 when resumed through fork_trampoline
     ret
 
 section .note.GNU-stack noalloc noexec nowrite progbits
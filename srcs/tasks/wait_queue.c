@@ -0,0 +1,123 @@
+#include "wait_queue.h"
+#include "task.h"
+
+void wait_queue_init(wait_queue_t* wq)
+{
+    spin_lock_init(&wq->lock);
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+/* Appends 'task' unless it is queued already. wq->lock is held. */
+static void wait_queue_add(wait_queue_t* wq, task_t* task)
+{
+    if (task->wait_queue)
+        return;
+    task->wait_next = NULL;
+    task->wait_queue = wq;
+    if (wq->tail)
+        wq->tail->wait_next = task;
+    else
+        wq->head = task;
+    wq->tail = task;
+}
+
+/* Unlinks 'task' if it is still on 'wq'. wq->lock is held. */
+static void wait_queue_del(wait_queue_t* wq, task_t* task)
+{
+    task_t* prev = NULL;
+    task_t* cur;
+
+    for (cur = wq->head; cur && cur != task; cur = cur->wait_next)
+        prev = cur;
+    if (cur)
+    {
+        if (prev)
+            prev->wait_next = task->wait_next;
+        else
+            wq->head = task->wait_next;
+        if (wq->tail == task)
+            wq->tail = prev;
+    }
+    task->wait_queue = NULL;
+    task->wait_next = NULL;
+}
+
+/**
+ * prepare_to_wait:
+ *   Queues the current task on 'wq' and marks it waiting, before the
+ *   caller tests its condition. A wake_up() from then on makes it
+ *   runnable again, whether or not it switched away yet.
+ */
+void prepare_to_wait(wait_queue_t* wq)
+{
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    task_t* task = get_current_task();
+
+    wait_queue_add(wq, task);
+    task->state = TASK_WAITING;
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+/* The condition holds: back to running and off 'wq'. */
+void finish_wait(wait_queue_t* wq)
+{
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    task_t* task = get_current_task();
+
+    task->state = TASK_RUNNING;
+    if (task->wait_queue == wq)
+        wait_queue_del(wq, task);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+/**
+ * sleep_on:
+ *   Puts the current task at the end of 'wq' and switches away. Returns
+ *   once wake_up() made it runnable and it was picked again. Callers
+ *   recheck their condition, see wait_event().
+ */
+void sleep_on(wait_queue_t* wq)
+{
+    uint32_t flags = irq_save();
+
+    prepare_to_wait(wq);
+    scheduler();
+    finish_wait(wq);
+    irq_restore(flags);
+}
+
+/* Makes every task sleeping on 'wq' runnable again. Safe from IRQs. */
+void wake_up(wait_queue_t* wq)
+{
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    task_t* task = wq->head;
+    task_t* next;
+
+    wq->head = NULL;
+    wq->tail = NULL;
+    while (task)
+    {
+        next = task->wait_next;
+        task->wait_next = NULL;
+        task->wait_queue = NULL;
+        task_wake(task);
+        task = next;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+/* Takes a task off the queue it sleeps on, for a task that is killed. */
+void wait_queue_remove(task_t* task)
+{
+    wait_queue_t* wq = task->wait_queue;
+    uint32_t flags;
+
+    if (!wq)
+        return;
+    flags = spin_lock_irqsave(&wq->lock);
+    /* A wake_up() may have beaten us to it */
+    if (task->wait_queue == wq)
+        wait_queue_del(wq, task);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
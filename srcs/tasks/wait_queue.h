@@ -0,0 +1,51 @@
+#ifndef WAIT_QUEUE_H
+#define WAIT_QUEUE_H
+
+#include "../utils/stdint.h"
+#include "../utils/cpu.h"
+#include "../utils/spinlock.h"
+
+struct task_struct;
+void scheduler(void);
+
+/*
+ * Tasks sleeping until some condition holds. Sleepers are off the run
+ * queues entirely; whoever makes the condition true calls wake_up().
+ * A zeroed wait_queue_t is an empty one.
+ */
+typedef struct wait_queue
+{
+    spinlock_t lock;
+    struct task_struct *head;
+    struct task_struct *tail;
+} wait_queue_t;
+
+void wait_queue_init(wait_queue_t* wq);
+void sleep_on(wait_queue_t* wq);
+void prepare_to_wait(wait_queue_t* wq);
+void finish_wait(wait_queue_t* wq);
+void wake_up(wait_queue_t* wq);
+void wait_queue_remove(struct task_struct* task);
+
+/*
+ * Sleeps on 'wq' until 'condition' is true. The task is queued and marked
+ * waiting before the test, so a wake_up() from an IRQ or another CPU
+ * right after it only makes the switch a no-op instead of being lost.
+ * The caller's interrupt flag is restored.
+ */
+#define wait_event(wq, condition)                   \
+    do                                              \
+    {                                               \
+        uint32_t __wait_flags = irq_save();         \
+        while (1)                                   \
+        {                                           \
+            prepare_to_wait(&(wq));                 \
+            if (condition)                          \
+                break;                              \
+            scheduler();                            \
+        }                                           \
+        finish_wait(&(wq));                         \
+        irq_restore(__wait_flags);                  \
+    } while (0)
+
+#endif
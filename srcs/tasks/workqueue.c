@@ -0,0 +1,151 @@
+#include "workqueue.h"
+#include "task.h"
+#include "wait_queue.h"
+#include "../display/display.h"
+#include "../kshell/kshell.h"
+#include "../utils/spinlock.h"
+#include "../smp/smp.h"
+
+/*############################################################################*/
+/*                                                                            */
+/*                           DEFINES                                          */
+/*                                                                            */
+/*############################################################################*/
+/* One worker per online CPU, so long work cannot hold up the rest */
+#define MAX_WORKERS MAX_CPUS
+
+/*############################################################################*/
+/*                                                                            */
+/*                           LOCALS                                           */
+/*                                                                            */
+/*############################################################################*/
+static void show_workqueue();
+
+/* FIFO of pending work, under work_lock. Workers sleep on work_wq. */
+static spinlock_t work_lock = SPINLOCK_INIT;
+static work_t* work_head = NULL;
+static work_t* work_tail = NULL;
+static wait_queue_t work_wq;
+
+static task_t* workers[MAX_WORKERS];
+static uint32_t nr_workers = 0;
+static uint32_t nr_pending = 0;
+static volatile uint32_t nr_busy = 0;   /* Dropped outside work_lock: atomic only */
+static uint32_t nr_queued = 0;      /* Since boot */
+static volatile uint32_t nr_done = 0;
+
+static command_t commands[] = {
+    {"workq", "Show the kernel worker pool", show_workqueue},
+    {NULL, NULL, NULL}
+};
+
+/*############################################################################*/
+/*                                                                            */
+/*                           FUNCTIONS                                        */
+/*                                                                            */
+/*############################################################################*/
+
+void init_work(work_t* work, void (*func)(void*), void* data)
+{
+    work->func = func;
+    work->data = data;
+    work->next = NULL;
+    work->pending = false;
+}
+
+/**
+ * queue_work:
+ *   Hands 'work' to the pool. Safe from IRQs and timer callbacks.
+ *   Returns false when it was still pending: it runs once for both.
+ */
+bool queue_work(work_t* work)
+{
+    uint32_t flags = spin_lock_irqsave(&work_lock);
+
+    if (work->pending)
+    {
+        spin_unlock_irqrestore(&work_lock, flags);
+        return false;
+    }
+    work->pending = true;
+    work->next = NULL;
+    if (work_tail)
+        work_tail->next = work;
+    else
+        work_head = work;
+    work_tail = work;
+    nr_pending++;
+    nr_queued++;
+    spin_unlock_irqrestore(&work_lock, flags);
+    wake_up(&work_wq);
+    return true;
+}
+
+/* Oldest pending work, no longer pending once taken. NULL when none. */
+static work_t* dequeue_work()
+{
+    uint32_t flags = spin_lock_irqsave(&work_lock);
+    work_t* work = work_head;
+
+    if (work)
+    {
+        work_head = work->next;
+        if (!work_head)
+            work_tail = NULL;
+        work->next = NULL;
+        work->pending = false;
+        nr_pending--;
+        __atomic_fetch_add(&nr_busy, 1, __ATOMIC_RELAXED);
+    }
+    spin_unlock_irqrestore(&work_lock, flags);
+    return work;
+}
+
+static int worker_thread(void* arg)
+{
+    work_t* work;
+
+    UNUSED(arg)
+    while (1)
+    {
+        wait_event(work_wq, (work = dequeue_work()) != NULL);
+        work->func(work->data);
+        __atomic_fetch_sub(&nr_busy, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&nr_done, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/* Once the APs are up: workers are spread like any other task. */
+void workqueue_init(void)
+{
+    char name[16] = "kworker/";
+    uint32_t count = cpus_online ? cpus_online : 1;
+
+    wait_queue_init(&work_wq);
+    for (uint32_t i = 0; i < count && i < MAX_WORKERS; i++)
+    {
+        name[8] = '0' + i;
+        name[9] = '\0';
+        workers[nr_workers] = kthread_create(worker_thread, NULL, name);
+        if (workers[nr_workers])
+            nr_workers++;
+    }
+    if (!nr_workers)
+        kernel_panic("workqueue_init: cannot start the workers!\n");
+    install_all_cmds(commands, TASKS);
+}
+
+/*############################################################################*/
+/*                                                                            */
+/*                           TESTS                                            */
+/*                                                                            */
+/*############################################################################*/
+
+static void show_workqueue()
+{
+    printf("Workers: %u, %u busy\n", nr_workers, nr_busy);
+    printf("Work: %u pending, %u queued, %u done\n", nr_pending, nr_queued, nr_done);
+    for (uint32_t i = 0; i < nr_workers; i++)
+        printf("  %s: PID %d, CPU %u\n", workers[i]->name, workers[i]->pid, workers[i]->cpu_id);
+}
@@ -0,0 +1,25 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include "../utils/stdint.h"
+#include "../utils/utils.h"
+
+/*
+ * Deferred work, run in process context by a pool of kernel threads: it
+ * may sleep, and it runs next to the interactive tasks instead of inside
+ * whoever queued it. A work item is queued at most once at a time; it
+ * may be queued again from its own function.
+ */
+typedef struct work
+{
+    void (*func)(void* data);
+    void* data;
+    struct work* next;
+    volatile bool pending;      /* Queued, not picked by a worker yet */
+} work_t;
+
+void init_work(work_t* work, void (*func)(void*), void* data);
+bool queue_work(work_t* work);
+void workqueue_init(void);
+
+#endif
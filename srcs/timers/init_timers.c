@@ -1,37 +1,163 @@
 #include "../keyboard/idt.h"
 #include "../utils/stdint.h"
 #include "../io/io.h" // Include your I/O port functions (outb, inb)
+#include "timers.h"
+#include "../tasks/task.h"
+#include "../smp/apic.h"
 
 #define PIT_CONTROL_PORT 0x43
 #define PIT_CHANNEL0_PORT 0x40
 #define PIT_BASE_FREQUENCY 1193182
-#define PIT_FREQUENCY 100
 #define PIC1_COMMAND 0x20
 #define PIC_EOI 0x20
 
+#define PIT_MODE_PERIODIC 0x34  /* Channel 0, lo/hi byte, rate generator */
+#define PIT_MODE_ONESHOT  0x30  /* Channel 0, lo/hi byte, IRQ on terminal count */
+#define PIT_LATCH_CH0     0x00
+#define PIT_READBACK_CH0  0xE2  /* Read back the status of channel 0 */
+#define PIT_STATUS_OUT    0x80  /* Output pin: high once a one-shot is done */
+#define PIT_MAX_COUNT     0xFFFF
+
 #define SECONDS_TO_TICKS(x) (x * PIT_FREQUENCY)
 
-static uint32_t tick_count = 0;
+static volatile uint32_t kticks = 0;   /* Never reset */
 static uint64_t seconds = 0;
+static uint16_t tick_divisor;           /* PIT cycles per tick */
+/* Ticks the armed one-shot stands for, 0 while the tick is periodic */
+static uint32_t oneshot_ticks = 0;
+static uint32_t nohz_entries = 0;
+static uint32_t nohz_skipped = 0;       /* Tick IRQs we did without */
 
+/*
+ * Tasks are parked on the timer wheel. Before the scheduler runs, and for
+ * the idle task which must never block, we halt until the deadline.
+ */
 void sleep(uint32_t seconds)
 {
-    uint32_t target_ticks = SECONDS_TO_TICKS(seconds);
-    tick_count = 0;
-    while (tick_count < target_ticks)
+    task_t* task = get_current_task();
+    uint32_t deadline = kticks + SECONDS_TO_TICKS(seconds);
+
+    if (task && task->pid != 0)
+    {
+        timer_sleep(SECONDS_TO_TICKS(seconds));
+        return;
+    }
+    while (!time_after_eq(kticks, deadline))
     {
         __asm__ __volatile__("hlt");  // Halt until next interrupt
     }
 }
 
+static void pit_program(uint8_t mode, uint16_t count)
+{
+    outb(PIT_CONTROL_PORT, mode);
+    outb(PIT_CHANNEL0_PORT, (uint8_t)(count & 0xFF));  // Low byte
+    outb(PIT_CHANNEL0_PORT, (uint8_t)((count >> 8) & 0xFF));  // High byte
+}
+
+static uint16_t pit_read_count()
+{
+    uint16_t count;
+
+    outb(PIT_CONTROL_PORT, PIT_LATCH_CH0);
+    count = inb(PIT_CHANNEL0_PORT);
+    count |= inb(PIT_CHANNEL0_PORT) << 8;
+    return count;
+}
+
+static bool pit_irq_pending()
+{
+    return irq_is_pending(0);
+}
+
+static void tick_advance(uint32_t ticks)
+{
+    while (ticks--)
+    {
+        kticks++;
+        if (kticks % PIT_FREQUENCY == 0)
+        {
+            seconds++;
+        }
+    }
+}
+
+/*####################################*/
+/*            Tickless idle           */
+/*####################################*/
+
+/**
+ * tick_nohz_enter:
+ *   Called by the idle task with interrupts off, right before it halts.
+ *   Swaps the periodic tick for a one-shot that lands on the tick boundary
+ *   of the next timer due. The PIT counts 16 bits, so that is at most
+ *   about 54 ms away; a longer idle period just rearms on each wakeup.
+ */
+void tick_nohz_enter(void)
+{
+    uint32_t ticks = timer_idle_ticks(PIT_MAX_COUNT / tick_divisor);
+    uint16_t left;
+
+    /* The next tick is needed anyway, or its IRQ is already on its way */
+    if (ticks < 2 || oneshot_ticks || pit_irq_pending())
+        return;
+
+    /* Mode 2 counts down once per tick: keep the part already elapsed */
+    left = pit_read_count();
+    pit_program(PIT_MODE_ONESHOT, left + (ticks - 1) * tick_divisor);
+    oneshot_ticks = ticks;
+    if (pit_irq_pending())
+    {
+        /* A tick slipped in before the reload: it is all we get */
+        pit_program(PIT_MODE_PERIODIC, tick_divisor);
+        oneshot_ticks = 0;
+        return;
+    }
+    nohz_entries++;
+}
+
+/**
+ * tick_nohz_exit:
+ *   Called with interrupts off when the idle task wakes up. If another IRQ
+ *   woke us, the ticks that went by are accounted for and the one-shot is
+ *   cut down to the next tick boundary, whose IRQ restarts the tick.
+ */
+void tick_nohz_exit(void)
+{
+    uint32_t ahead;
+    uint16_t count;
+
+    if (!oneshot_ticks)
+        return;
+    outb(PIT_CONTROL_PORT, PIT_READBACK_CH0);
+    if (inb(PIT_CHANNEL0_PORT) & PIT_STATUS_OUT)
+        return; /* Expired: its IRQ is pending and will do it */
+
+    count = pit_read_count();
+    ahead = (count + tick_divisor - 1) / tick_divisor;  /* Boundaries left */
+    tick_advance(oneshot_ticks - ahead);
+    nohz_skipped += oneshot_ticks - ahead;
+    if (ahead > 1)
+        pit_program(PIT_MODE_ONESHOT, count - (ahead - 1) * tick_divisor);
+    oneshot_ticks = 1;
+    run_timers();
+}
+
 /* On each tick i can just switch task so it's easy(?) */
 void irq_handler_timer()
 {
-    tick_count++;
-    if (tick_count % PIT_FREQUENCY == 0)
+    uint32_t ticks = 1;
+
+    if (oneshot_ticks)
     {
-        seconds++;
+        /* The one-shot fired on a tick boundary: go periodic from here */
+        pit_program(PIT_MODE_PERIODIC, tick_divisor);
+        ticks = oneshot_ticks;
+        nohz_skipped += ticks - 1;
+        oneshot_ticks = 0;
     }
+    tick_advance(ticks);
+    run_timers();
     /* I think i'm sending it somewhere else */
     // outb(0x20, 0x20);
 }
@@ -41,6 +167,18 @@ uint64_t get_kuptime()
     return seconds;
 }
 
+uint32_t get_kticks()
+{
+    return kticks;
+}
+
+/* Times the idle task went tickless, and the tick IRQs that saved */
+void get_nohz_stats(uint32_t* entries, uint32_t* skipped)
+{
+    *entries = nohz_entries;
+    *skipped = nohz_skipped;
+}
+
 void init_pit(uint32_t frequency)
 {
     if (frequency < 18)
@@ -56,13 +194,14 @@ void init_pit(uint32_t frequency)
     uint16_t divisor = PIT_BASE_FREQUENCY / frequency;
 
     // printf("PIT divisor: %d\n", divisor);
-    outb(PIT_CONTROL_PORT, 0x36);
-
-    outb(PIT_CHANNEL0_PORT, (uint8_t)(divisor & 0xFF));  // Low byte
-    outb(PIT_CHANNEL0_PORT, (uint8_t)((divisor >> 8) & 0xFF));  // High byte
+    /* Rate generator rather than square wave: the count can be read back */
+    tick_divisor = divisor;
+    oneshot_ticks = 0;
+    pit_program(PIT_MODE_PERIODIC, divisor);
 }
 
 void init_timer()
 {
+    timer_wheel_init();
     init_pit(PIT_FREQUENCY);
 }
@@ -0,0 +1,240 @@
+#include "../utils/stdint.h"
+#include "../utils/utils.h"
+#include "../utils/cpu.h"
+#include "../utils/spinlock.h"
+#include "../tasks/task.h"
+#include "../smp/smp.h"
+#include "timers.h"
+
+/*
+ * Hierarchical timer wheel. The first level has one slot per tick for the
+ * next 256 ticks; each further level has 64 slots, each one covering a
+ * whole turn of the level below it. Adding and removing a timer is a list
+ * insert or unlink. When the first level wraps, the next slot of level 2
+ * is cascaded (its timers re-added one level down), and so on upwards, so
+ * every timer moves at most four times before it fires. Nothing is done
+ * per pending timer on ticks where none expire.
+ *
+ * The wheel is shared: any CPU adds and removes timers, the BSP's tick
+ * runs them. Callbacks run under timer_lock and so must not touch the
+ * wheel themselves; they may take sched_lock, which comes after it.
+ */
+#define TVR_BITS    8
+#define TVN_BITS    6
+#define TVR_SIZE    (1 << TVR_BITS)
+#define TVN_SIZE    (1 << TVN_BITS)
+#define TVR_MASK    (TVR_SIZE - 1)
+#define TVN_MASK    (TVN_SIZE - 1)
+#define TVN_LEVELS  4
+
+/* Slot of level 'n' (0 is the first 64-slot level) 'time' falls in */
+#define TVN_INDEX(time, n) (((time) >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+static ktimer_t* tv1[TVR_SIZE];
+static ktimer_t* tvn[TVN_LEVELS][TVN_SIZE];
+static uint32_t wheel_time;     /* Next tick run_timers() has to process */
+static spinlock_t timer_lock = SPINLOCK_INIT;
+
+/*####################################*/
+/*             Wheel slots            */
+/*####################################*/
+
+static void slot_insert(ktimer_t** slot, ktimer_t* timer)
+{
+    timer->next = *slot;
+    if (*slot)
+        (*slot)->pprev = &timer->next;
+    *slot = timer;
+    timer->pprev = slot;
+}
+
+static void slot_unlink(ktimer_t* timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* Picks the slot from how far away the timer is, not from when it is */
+static void wheel_insert(ktimer_t* timer)
+{
+    uint32_t expires = timer->expires;
+    uint32_t delta = expires - wheel_time;
+    ktimer_t** slot;
+
+    if ((int32_t)delta < 0)
+        slot = &tv1[wheel_time & TVR_MASK];   /* Late: fire on the next run */
+    else if (delta < TVR_SIZE)
+        slot = &tv1[expires & TVR_MASK];
+    else if (delta < 1 << (TVR_BITS + TVN_BITS))
+        slot = &tvn[0][TVN_INDEX(expires, 0)];
+    else if (delta < 1 << (TVR_BITS + 2 * TVN_BITS))
+        slot = &tvn[1][TVN_INDEX(expires, 1)];
+    else if (delta < 1 << (TVR_BITS + 3 * TVN_BITS))
+        slot = &tvn[2][TVN_INDEX(expires, 2)];
+    else
+        slot = &tvn[3][TVN_INDEX(expires, 3)];
+    slot_insert(slot, timer);
+}
+
+/* Spreads slot 'index' of level 'level' over the levels below it */
+static uint32_t cascade(uint32_t level, uint32_t index)
+{
+    ktimer_t* timer = tvn[level][index];
+    ktimer_t* next;
+
+    tvn[level][index] = NULL;
+    while (timer)
+    {
+        next = timer->next;
+        timer->next = NULL;
+        timer->pprev = NULL;
+        wheel_insert(timer);
+        timer = next;
+    }
+    return index;
+}
+
+/*####################################*/
+/*              Interface             */
+/*####################################*/
+
+void timer_wheel_init(void)
+{
+    memset(tv1, 0, sizeof(tv1));
+    memset(tvn, 0, sizeof(tvn));
+    wheel_time = get_kticks();
+}
+
+void timer_setup(ktimer_t* timer, ktimer_fn_t fn, void* data)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->data = data;
+}
+
+/* Arms 'timer' for the absolute tick 'expires', re-arming it if pending. */
+void timer_add(ktimer_t* timer, uint32_t expires)
+{
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+
+    if (timer_pending(timer))
+        slot_unlink(timer);
+    timer->expires = expires;
+    wheel_insert(timer);
+    spin_unlock_irqrestore(&timer_lock, flags);
+
+    /* A tickless BSP must work out how long it may sleep again */
+    if (cpus_online > 1 && smp_processor_id() != 0 && cpu_is_idle(0))
+        smp_send_reschedule(0);
+}
+
+/* Disarms 'timer'. Returns 1 if it was still pending, 0 if it had fired. */
+int timer_del(ktimer_t* timer)
+{
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+    int pending = timer_pending(timer);
+
+    if (pending)
+        slot_unlink(timer);
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return pending;
+}
+
+/* Called from the timer IRQ: fires everything due up to the current tick. */
+void run_timers(void)
+{
+    uint32_t now = get_kticks();
+    uint32_t index;
+    uint32_t level;
+    ktimer_t* timer;
+
+    spin_lock(&timer_lock);
+    while (time_after_eq(now, wheel_time))
+    {
+        index = wheel_time & TVR_MASK;
+        /* Level 0 wrapped: pull down the next turn, higher levels first */
+        for (level = 0; !index && level < TVN_LEVELS; level++)
+            index = cascade(level, TVN_INDEX(wheel_time, level));
+        index = wheel_time & TVR_MASK;
+        wheel_time++;
+
+        /* A callback may add timers, even to this slot: take them one by one */
+        while ((timer = tv1[index]))
+        {
+            slot_unlink(timer);
+            timer->fn(timer->data);
+        }
+    }
+    spin_unlock(&timer_lock);
+}
+
+/**
+ * timer_idle_ticks:
+ *   Ticks from now until run_timers() next has work, at most 'max'. Only
+ *   the first level is looked at: a cascade point counts as work, since
+ *   it may bring down timers due right then. Interrupts must be off.
+ */
+uint32_t timer_idle_ticks(uint32_t max)
+{
+    uint32_t now = get_kticks();
+    uint32_t ticks = max;
+    uint32_t time;
+
+    spin_lock(&timer_lock);
+    /* Ticks not processed yet: the next one is due at once */
+    if (time_after_eq(now, wheel_time))
+        ticks = 0;
+    for (time = wheel_time; ticks && time - now < max; time++)
+    {
+        if (!(time & TVR_MASK) || tv1[time & TVR_MASK])
+        {
+            ticks = time - now;
+            break;
+        }
+    }
+    spin_unlock(&timer_lock);
+    return ticks;
+}
+
+/*####################################*/
+/*              Sleeping              */
+/*####################################*/
+
+static void sleep_timeout(void* data)
+{
+    task_wake((task_t*)data);
+}
+
+/**
+ * timer_sleep:
+ *   Parks the current task for 'ticks' timer ticks. Sleepers are off the
+ *   run queues and cost nothing until their timer fires. Returns the ticks
+ *   that were left if the task was woken up early, else 0.
+ */
+uint32_t timer_sleep(uint32_t ticks)
+{
+    task_t* task = get_current_task();
+    uint32_t flags;
+    uint32_t left = 0;
+
+    if (!ticks)
+    {
+        scheduler();
+        return 0;
+    }
+    flags = irq_save();
+    timer_setup(&task->sleep_timer, sleep_timeout, task);
+    /* Before the timer is armed: it may fire on the BSP right away */
+    task->state = TASK_WAITING;
+    timer_add(&task->sleep_timer, get_kticks() + ticks);
+    scheduler();
+    if (timer_del(&task->sleep_timer) && !time_after_eq(get_kticks(), task->sleep_timer.expires))
+        left = task->sleep_timer.expires - get_kticks();
+    irq_restore(flags);
+    return left;
+}
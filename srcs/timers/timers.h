@@ -1,9 +1,60 @@
 #ifndef TIMERS_H
 #define TIMERS_H
 
+#include "../utils/stdint.h"
+
+#define PIT_FREQUENCY 100   /* Timer ticks per second */
+#define NSEC_PER_SEC  1000000000
+#define NSEC_PER_TICK (NSEC_PER_SEC / PIT_FREQUENCY)
+
+#ifndef _STRUCT_TIMESPEC
+#define _STRUCT_TIMESPEC
+struct timespec
+{
+    long tv_sec;
+    long tv_nsec;
+};
+#endif
+
+typedef void (*ktimer_fn_t)(void* data);
+
+/*
+ * One-shot kernel timer: 'fn(data)' runs from the timer IRQ once kticks
+ * reaches 'expires'. 'pprev' points at whatever links to us in the wheel
+ * and is NULL while the timer is not pending, so removal is O(1).
+ */
+typedef struct ktimer
+{
+    struct ktimer *next;
+    struct ktimer **pprev;
+    uint32_t expires;
+    ktimer_fn_t fn;
+    void *data;
+} ktimer_t;
+
 void init_timer();
 void irq_handler_timer();
 void sleep(uint32_t seconds);
 uint64_t get_kuptime();
+uint32_t get_kticks();
+void tick_nohz_enter(void);
+void tick_nohz_exit(void);
+void get_nohz_stats(uint32_t* entries, uint32_t* skipped);
+
+void timer_wheel_init(void);
+void timer_setup(ktimer_t* timer, ktimer_fn_t fn, void* data);
+void timer_add(ktimer_t* timer, uint32_t expires);
+int timer_del(ktimer_t* timer);
+void run_timers(void);
+uint32_t timer_idle_ticks(uint32_t max);
+uint32_t timer_sleep(uint32_t ticks);
+
+/* Wrap-safe "tick a is at or after tick b" */
+#define time_after_eq(a, b) ((int32_t)((a) - (b)) >= 0)
+
+static inline int timer_pending(const ktimer_t* timer)
+{
+    return timer->pprev != 0;
+}
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,26 @@
+%define syscall int 0x30
+
+global clone
+clone:
+    push ebp
+    mov ebp, esp
+    push ebx
+    push esi
+    push edi
+
+    mov ebx, [ebp + 8]      ; flags
+    mov ecx, [ebp + 12]     ; fn
+    mov edx, [ebp + 16]     ; arg
+    mov esi, [ebp + 20]     ; stack
+    mov edi, [ebp + 24]     ; tls
+    mov eax, 120
+
+    syscall
+
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
+
+section .note.GNU-stack noalloc noexec nowrite progbits
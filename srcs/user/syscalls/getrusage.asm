@@ -0,0 +1,17 @@
+%define syscall int 0x30
+
+global getrusage
+getrusage:
+    push ebp
+    mov ebp, esp
+
+    mov ebx, [ebp + 8]
+    mov ecx, [ebp + 12]
+    mov eax, 77
+
+    syscall
+
+    pop ebp
+    ret
+
+section .note.GNU-stack noalloc noexec nowrite progbits
@@ -0,0 +1,17 @@
+%define syscall int 0x30
+
+global nanosleep
+nanosleep:
+    push ebp
+    mov ebp, esp
+
+    mov ebx, [ebp + 8]
+    mov ecx, [ebp + 12]
+    mov eax, 162
+
+    syscall
+
+    pop ebp
+    ret
+
+section .note.GNU-stack noalloc noexec nowrite progbits
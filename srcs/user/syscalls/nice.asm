@@ -0,0 +1,16 @@
+%define syscall int 0x30
+
+global nice
+nice:
+    push ebp
+    mov ebp, esp
+
+    mov ebx, [ebp + 8]
+    mov eax, 34
+
+    syscall
+
+    pop ebp
+    ret
+
+section .note.GNU-stack noalloc noexec nowrite progbits
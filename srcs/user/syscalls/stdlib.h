@@ -4,12 +4,66 @@
 
 typedef void (*signal_handler_t)(int);
 
+#ifndef _STRUCT_TIMESPEC
+#define _STRUCT_TIMESPEC
+struct timespec
+{
+    long tv_sec;
+    long tv_nsec;
+};
+#endif
+
+/* Clock ticks, PIT_FREQUENCY a second */
+struct tms
+{
+    long tms_utime;
+    long tms_stime;
+    long tms_cutime;
+    long tms_cstime;
+};
+
+#ifndef _STRUCT_TIMEVAL
+#define _STRUCT_TIMEVAL
+struct timeval
+{
+    long tv_sec;
+    long tv_usec;
+};
+#endif
+
+#define RUSAGE_SELF     0
+#define RUSAGE_CHILDREN (-1)
+
+/* waitpid() options */
+#define WNOHANG         0x1
+
+/* clone() flags */
+#define CLONE_VM        0x00000100
+#define CLONE_SIGHAND   0x00000800
+#define CLONE_THREAD    0x00010000
+#define CLONE_SETTLS    0x00080000
+
+struct rusage
+{
+    struct timeval ru_utime;
+    struct timeval ru_stime;
+    long ru_nvcsw;          /* Voluntary context switches */
+    long ru_nivcsw;         /* Involuntary ones */
+};
+
 int write(int fd, const char* buf, size_t count);
 int kill(uint32_t pid, uint32_t signal);
 int signal(int signal, signal_handler_t handler);
 size_t read(int fd, char* buf, size_t count);
 int get_pid();
 void yeld();
+int nice(int inc);
+int nanosleep(const struct timespec* req, struct timespec* rem);
 void exit(int status);
+long times(struct tms* buf);
+int getrusage(int who, struct rusage* usage);
+int waitpid(int pid, int* status, int options);
+int wait4(int pid, int* status, int options, struct rusage* usage);
+int clone(uint32_t flags, int (*fn)(void*), void* arg, void* stack, uint32_t tls);
 
 #endif
@@ -0,0 +1,16 @@
+%define syscall int 0x30
+
+global times
+times:
+    push ebp
+    mov ebp, esp
+
+    mov ebx, [ebp + 8]
+    mov eax, 43
+
+    syscall
+
+    pop ebp
+    ret
+
+section .note.GNU-stack noalloc noexec nowrite progbits
@@ -0,0 +1,21 @@
+%define syscall int 0x30
+
+global wait4
+wait4:
+    push ebp
+    mov ebp, esp
+    push esi
+
+    mov ebx, [ebp + 8]
+    mov ecx, [ebp + 12]
+    mov edx, [ebp + 16]
+    mov esi, [ebp + 20]
+    mov eax, 114
+
+    syscall
+
+    pop esi
+    pop ebp
+    ret
+
+section .note.GNU-stack noalloc noexec nowrite progbits
@@ -14,7 +14,6 @@ clear_segment_registers:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
-    ret
+    ret                 ; gs keeps the per-CPU segment
 
 section .note.GNU-stack noalloc noexec nowrite progbits
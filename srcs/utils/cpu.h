@@ -0,0 +1,92 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include "stdint.h"
+
+/* CPUID leaf 1, EDX feature bits */
+#define CPUID_EDX_FPU   (1 << 0)    /* x87 on chip */
+#define CPUID_EDX_PSE   (1 << 3)    /* 4 MB pages */
+#define CPUID_EDX_PGE   (1 << 13)   /* Global pages */
+#define CPUID_EDX_FXSR  (1 << 24)   /* fxsave and fxrstor */
+#define CPUID_EDX_SSE   (1 << 25)
+
+/* EFLAGS bits */
+#define EFLAGS_IF       (1 << 9)    /* Maskable interrupts enabled */
+
+/* CR0 bits */
+#define CR0_MP          (1 << 1)    /* wait traps on TS too */
+#define CR0_EM          (1 << 2)    /* No FPU, emulate it */
+#define CR0_TS          (1 << 3)    /* Next FPU use raises #NM */
+#define CR0_NE          (1 << 5)    /* FPU errors as #MF, not IRQ 13 */
+#define CR0_WP          (1 << 16)   /* Ring 0 honours read-only pages */
+
+/* CR4 bits */
+#define CR4_PSE         (1 << 4)
+#define CR4_PGE         (1 << 7)
+#define CR4_OSFXSR      (1 << 9)    /* fxsave covers SSE, SSE enabled */
+#define CR4_OSXMMEXCPT  (1 << 10)   /* SSE errors as #XM */
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx)
+{
+    __asm__ __volatile__("cpuid"
+                         : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                         : "a"(leaf), "c"(0));
+}
+
+/* EDX of CPUID leaf 1, enough to test the features above. */
+static inline uint32_t cpuid_features_edx()
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return edx;
+}
+
+static inline uint32_t read_cr0()
+{
+    uint32_t cr0;
+
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint32_t cr0)
+{
+    __asm__ __volatile__("mov %0, %%cr0" :: "r"(cr0) : "memory");
+}
+
+/* Clears CR0.TS: FPU instructions run without trapping. */
+static inline void clts()
+{
+    __asm__ __volatile__("clts" ::: "memory");
+}
+
+static inline uint32_t read_cr4()
+{
+    uint32_t cr4;
+
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint32_t cr4)
+{
+    __asm__ __volatile__("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+/* Disables interrupts, returning the EFLAGS to hand to irq_restore(). */
+static inline uint32_t irq_save()
+{
+    uint32_t flags;
+
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags)
+{
+    if (flags & EFLAGS_IF)
+        __asm__ __volatile__("sti" ::: "memory");
+}
+
+#endif
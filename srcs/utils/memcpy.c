@@ -1,11 +1,53 @@
-#include "stdint.h"
-void *memcpy(void *dest, const void *src, size_t n)
-{
-    char *d = dest;
-    const char *s = src;
-    for (size_t i = 0; i < n; i++)
-    {
-        d[i] = s[i];
-    }
-    return dest;
-}
+#include "stdint.h"
+#include "../tasks/fpu.h"
+#include "../memory/memory.h"
+
+/* Below this the FPU handover costs more than SSE saves */
+#define SSE_COPY_MIN 1024
+
+/*
+ * 64 bytes a round through xmm0-3; unaligned loads and stores. False when
+ * the FPU is already lent out on this CPU: the caller copies bytewise.
+ */
+static bool memcpy_sse(char *d, const char *s, size_t blocks)
+{
+    uint32_t flags;
+
+    if (!kernel_fpu_begin(&flags))
+        return false;
+    while (blocks--)
+    {
+        __asm__ __volatile__(
+            "movups   (%0), %%xmm0\n"
+            "movups 16(%0), %%xmm1\n"
+            "movups 32(%0), %%xmm2\n"
+            "movups 48(%0), %%xmm3\n"
+            "movups %%xmm0,   (%1)\n"
+            "movups %%xmm1, 16(%1)\n"
+            "movups %%xmm2, 32(%1)\n"
+            "movups %%xmm3, 48(%1)\n"
+            :: "r"(s), "r"(d) : "memory");
+        s += 64;
+        d += 64;
+    }
+    kernel_fpu_end(flags);
+    return true;
+}
+
+void *memcpy(void *dest, const void *src, size_t n)
+{
+    char *d = dest;
+    const char *s = src;
+    size_t i = 0;
+
+    /* Never with the FPU held across a fault: user and direct-map memory may take one */
+    if (n >= SSE_COPY_MIN && fpu_kernel_usable()
+        && is_heap_range(d, n) && is_heap_range(s, n)
+        && memcpy_sse(d, s, n / 64))
+        i = n & ~(size_t)63;
+    for (; i < n; i++)
+    {
+        d[i] = s[i];
+    }
+    return dest;
+}
@@ -0,0 +1,68 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "stdint.h"
+#include "cpu.h"
+
+/*
+ * Ticket lock: CPUs get the lock in the order they asked for it, so none
+ * of them can be starved by the others. Locks that are also taken from
+ * IRQ handlers must be held with interrupts off, see spin_lock_irqsave().
+ * A zeroed spinlock_t is an unlocked one.
+ */
+typedef struct spinlock
+{
+    volatile uint16_t owner;    /* Ticket being served */
+    volatile uint16_t next;     /* Next ticket to hand out */
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0, 0 }
+
+/* Spins until 'ticket' is served. In smp.c: it also answers TLB flushes. */
+void spin_wait(spinlock_t* lock, uint16_t ticket);
+
+static inline void cpu_relax()
+{
+    __asm__ __volatile__("pause" ::: "memory");
+}
+
+static inline void spin_lock_init(spinlock_t* lock)
+{
+    lock->owner = 0;
+    lock->next = 0;
+}
+
+static inline void spin_lock(spinlock_t* lock)
+{
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_ACQUIRE);
+
+    if (lock->owner != ticket)
+        spin_wait(lock, ticket);
+    __asm__ __volatile__("" ::: "memory");
+}
+
+static inline void spin_unlock(spinlock_t* lock)
+{
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+static inline int spin_is_locked(spinlock_t* lock)
+{
+    return lock->owner != lock->next;
+}
+
+static inline uint32_t spin_lock_irqsave(spinlock_t* lock)
+{
+    uint32_t flags = irq_save();
+
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags)
+{
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif